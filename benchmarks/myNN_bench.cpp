@@ -0,0 +1,477 @@
+// micro benchmarks of the hot paths
+//
+//   myNN_bench [--threads 1,2,4] [--filter name] [--min-time seconds] [--json file]
+//
+// every case reports ns/op, GFLOP/s, GB/s (bytes that must at least be read and
+// written once) and Tensor allocations per op; --json writes the same numbers in a
+// form that can be diffed between builds
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Allocator.hpp"
+#include "DataParallel.hpp"
+#include "DenseLayer.hpp"
+#include "Gemm.hpp"
+#include "InferenceServer.hpp"
+#include "Network.hpp"
+#include "Optimizer.hpp"
+#include "Sparse.hpp"
+#include "Tensor.hpp"
+#include "ThreadPool.hpp"
+
+using namespace myNN;
+
+namespace
+{
+  struct BenchResult
+  {
+    std::string name;
+    std::string shape;
+    int threads = 1;
+    long iterations = 0;
+    double nsPerOp = 0.0;
+    double gflops = 0.0;
+    double gbps = 0.0;
+    double allocsPerOp = 0.0;
+  };
+
+  struct BenchOptions
+  {
+    std::vector<int> threads;
+    std::string filter;
+    double minTime = 0.2;
+    std::string jsonPath;
+  };
+
+  std::vector<BenchResult> results;
+  BenchOptions options;
+
+  // run fn until minTime has passed, after one untimed warm-up call
+  void bench(const std::string &name, const std::string &shape, double flops, double bytes,
+             const std::function<void()> &fn)
+  {
+    if (!options.filter.empty() && name.find(options.filter) == std::string::npos)
+      return;
+
+    fn();
+
+    Allocator &allocator = defaultAllocator();
+    std::size_t requestsBefore = allocator.stats().requests;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0.0;
+    long iterations = 0;
+    while (elapsed < options.minTime)
+    {
+      fn();
+      iterations++;
+      elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::size_t requests = allocator.stats().requests - requestsBefore;
+
+    BenchResult r;
+    r.name = name;
+    r.shape = shape;
+    r.threads = ThreadPool::instance().numThreads();
+    r.iterations = iterations;
+    r.nsPerOp = elapsed / iterations * 1e9;
+    r.gflops = flops / r.nsPerOp;
+    r.gbps = bytes / r.nsPerOp;
+    r.allocsPerOp = static_cast<double>(requests) / iterations;
+    results.push_back(r);
+
+    std::printf("%-18s %-16s %3d %14.1f %10.2f %10.2f %8.1f\n", r.name.c_str(), r.shape.c_str(), r.threads,
+                r.nsPerOp, r.gflops, r.gbps, r.allocsPerOp);
+    std::fflush(stdout);
+  }
+
+  std::string dims(std::initializer_list<int> d)
+  {
+    std::ostringstream s;
+    for (auto it = d.begin(); it != d.end(); ++it)
+      s << (it == d.begin() ? "" : "x") << *it;
+    return s.str();
+  }
+
+  Tensor filled(int rows, int cols)
+  {
+    Tensor t({rows, cols});
+    for (int i = 0; i < t.size(); i++)
+      t[i] = static_cast<float>((i * 7) % 23) / 23.0f - 0.5f;
+    return t;
+  }
+
+  void benchMatMul(int M, int N, int K)
+  {
+    Tensor A = filled(M, K);
+    Tensor B = filled(K, N);
+    double flops = 2.0 * M * N * K;
+    double bytes = 4.0 * (static_cast<double>(M) * K + static_cast<double>(K) * N + static_cast<double>(M) * N);
+    bench("matMul", dims({M, N, K}), flops, bytes, [&]
+          { Tensor C = A.matMul(B); });
+  }
+
+  void benchTranspose(int M, int N)
+  {
+    Tensor A = filled(M, N);
+    bench("transpose", dims({M, N}), 0.0, 8.0 * M * N, [&]
+          { Tensor T = A.transpose(); });
+  }
+
+  void benchAddBroadcast(int M, int N)
+  {
+    Tensor A = filled(M, N);
+    Tensor b = filled(1, N);
+    bench("addBroadcast", dims({M, N}), static_cast<double>(M) * N, 8.0 * M * N, [&]
+          { Tensor C = A.addBroadcast(b); });
+  }
+
+  void benchSumRows(int M, int N)
+  {
+    Tensor A = filled(M, N);
+    bench("sumRows", dims({M, N}), static_cast<double>(M) * N, 4.0 * M * N, [&]
+          { Tensor s = A.sumRows(); });
+  }
+
+  // the elementwise kernels on a whole tensor, in place so nothing is allocated
+  void benchElementwise(int M, int N)
+  {
+    Tensor A = filled(M, N);
+    Tensor B = filled(M, N);
+    double n = static_cast<double>(M) * N;
+    bench("tensor.add", dims({M, N}), n, 12.0 * n, [&]
+          { A.add(B); });
+    bench("tensor.mulScalar", dims({M, N}), n, 8.0 * n, [&]
+          { A.mul_inplace(0.5f); });
+    bench("tensor.fill", dims({M, N}), 0.0, 4.0 * n, [&]
+          { A.fill(0.25f); });
+    bench("tensor.apply", dims({M, N}), n, 8.0 * n, [&]
+          { A.apply([](float x)
+                    { return x > 0.0f ? x : 0.0f; }); });
+    volatile float total = 0.0f;
+    bench("tensor.sum", dims({M, N}), n, 4.0 * n, [&]
+          { total = B.sum(); });
+  }
+
+  void benchDense(int batch, int in, int out)
+  {
+    DenseLayer layer(in, out);
+    Tensor x = filled(batch, in);
+    Tensor dY = filled(batch, out);
+    double mnk = static_cast<double>(batch) * in * out;
+    double weightBytes = 4.0 * in * out;
+
+    bench("dense.forward", dims({batch, in, out}), 2.0 * mnk, weightBytes + 4.0 * batch * (in + out), [&]
+          { Tensor y = layer.forward(x); });
+
+    // dB, dW and dX as backProp runs them
+    bench("dense.backward", dims({batch, in, out}), 4.0 * mnk, 3.0 * weightBytes + 8.0 * batch * (in + out), [&]
+          {
+            layer.dB(dY);
+            layer.dW(dY, x);
+            Tensor dX = layer.dX(dY);
+          });
+  }
+
+  // one update of a layer's parameters; every rule is a single pass, so bytes are the
+  // arrays it reads and writes once
+  void benchOptimizer(const char *name, OptimizerKind kind, int in, int out)
+  {
+    DenseLayer layer(in, out, true);
+    OptimizerConfig config;
+    config.kind = kind;
+    double n = static_cast<double>(in + 1) * out;
+    int moments = kind == OptimizerKind::SGD ? 0 : kind == OptimizerKind::Momentum ? 1 : 2;
+    bench(name, dims({in, out}), n * (moments == 2 ? 14.0 : 3.0), n * 4.0 * (3 + 2 * moments), [&]
+          { layer.step(config, 1e-6f); });
+  }
+
+  void benchTrainStep(int batch, const std::vector<int> &widths)
+  {
+    Network net;
+    double mnk = 0.0;
+    double weightBytes = 0.0;
+    for (size_t i = 0; i + 1 < widths.size(); i++)
+    {
+      net.addLayer(DenseLayer(widths[i], widths[i + 1]));
+      mnk += static_cast<double>(batch) * widths[i] * widths[i + 1];
+      weightBytes += 4.0 * widths[i] * widths[i + 1];
+    }
+    Tensor x = filled(batch, widths.front());
+    Tensor y = filled(batch, widths.back());
+
+    std::ostringstream shape;
+    shape << batch;
+    for (size_t i = 0; i < widths.size(); i++)
+      shape << (i == 0 ? ":" : "-") << widths[i];
+
+    // forward, backward (dW and dX) and the update, each a pass over the weights
+    bench("network.trainStep", shape.str(), 6.0 * mnk, 4.0 * weightBytes, [&]
+          {
+            Tensor pred = net.forwardPass(x);
+            Tensor grad = net.getLayers().back().dL_dY(pred, y);
+            net.backProp(grad, x);
+            net.updateParameters(1e-6f);
+          });
+  }
+
+  // the same step with one replica per pool thread; run with --threads 1,2,4,... for
+  // the scaling from 1 to N threads
+  void benchDataParallel(int batch, const std::vector<int> &widths)
+  {
+    Network net;
+    double mnk = 0.0;
+    double weightBytes = 0.0;
+    for (size_t i = 0; i + 1 < widths.size(); i++)
+    {
+      net.addLayer(DenseLayer(widths[i], widths[i + 1]));
+      mnk += static_cast<double>(batch) * widths[i] * widths[i + 1];
+      weightBytes += 4.0 * widths[i] * widths[i + 1];
+    }
+    Tensor x = filled(batch, widths.front());
+    Tensor y = filled(batch, widths.back());
+    DataParallelTrainer trainer(net);
+    FitOptions options;
+    options.learningRate = 1e-6f;
+
+    std::ostringstream shape;
+    shape << batch;
+    for (size_t i = 0; i < widths.size(); i++)
+      shape << (i == 0 ? ":" : "-") << widths[i];
+
+    bench("dataParallel.step", shape.str(), 6.0 * mnk, 4.0 * weightBytes, [&]
+          { trainer.trainBatch(x, y, options); });
+  }
+
+  // requests answered one at a time with a 1-row predict each, against the same requests
+  // submitted together to an InferenceServer that batches them; an op is the whole burst
+  void benchServing(int requests, const std::vector<int> &widths)
+  {
+    Network net;
+    double mnk = 0.0;
+    double weightBytes = 0.0;
+    for (size_t i = 0; i + 1 < widths.size(); i++)
+    {
+      net.addLayer(DenseLayer(widths[i], widths[i + 1]));
+      mnk += static_cast<double>(requests) * widths[i] * widths[i + 1];
+      weightBytes += 4.0 * widths[i] * widths[i + 1];
+    }
+    Tensor x = filled(requests, widths.front());
+
+    std::ostringstream shape;
+    shape << requests;
+    for (size_t i = 0; i < widths.size(); i++)
+      shape << (i == 0 ? ":" : "-") << widths[i];
+
+    bench("serving.single", shape.str(), 2.0 * mnk, requests * weightBytes, [&]
+          {
+            for (int i = 0; i < requests; i++)
+              Tensor y = net.predict(x.view().rowSlice(i, i + 1));
+          });
+
+    ServerOptions serverOptions;
+    serverOptions.maxBatch = requests;
+    InferenceServer server(net, serverOptions);
+    std::vector<std::future<Tensor>> results(requests);
+    bench("serving.batched", shape.str(), 2.0 * mnk, weightBytes, [&]
+          {
+            for (int i = 0; i < requests; i++)
+              results[i] = server.submit(x.view().rowSlice(i, i + 1));
+            for (std::future<Tensor> &result : results)
+              result.get();
+          });
+  }
+
+  // a layer pruned to the given sparsity against the same layer dense; flops and bytes
+  // count only the stored weights, so the GFLOP/s are the useful ones
+  void benchSparse(int batch, int in, int out, float sparsity)
+  {
+    DenseLayer dense(in, out);
+    DenseLayer sparse = dense;
+    sparse.prune(sparsity);
+    Tensor x = filled(batch, in);
+    Tensor dY = filled(batch, out);
+    double mnk = static_cast<double>(batch) * in * out;
+    double activationBytes = 4.0 * batch * (in + out);
+    double nnz = sparse.getSparseWeights().nnz();
+    double sparseBytes = static_cast<double>(sparse.getSparseWeights().bytes());
+
+    std::ostringstream shape;
+    shape << dims({batch, in, out}) << "@" << static_cast<int>(sparsity * 100 + 0.5f) << "%";
+
+    // the same layer unpruned, keyed like the sparse cases so every shape and sparsity
+    // gets one baseline row
+    bench("sparse.denseBaseline", shape.str(), 2.0 * mnk, 4.0 * in * out + activationBytes, [&]
+          { Tensor y = dense.forward(x); });
+    bench("sparse.forward", shape.str(), 2.0 * batch * nnz, sparseBytes + activationBytes, [&]
+          { Tensor y = sparse.forward(x); });
+    bench("sparse.dX", shape.str(), 2.0 * batch * nnz, sparseBytes + activationBytes, [&]
+          { Tensor dX = sparse.dX(dY); });
+  }
+
+  // a layer fed rows with nnzPerRow nonzeros out of in columns, against the same rows
+  // dense; sparse flops and bytes count only the weight rows the inputs pick
+  void benchSparseInput(int batch, int in, int out, int nnzPerRow)
+  {
+    DenseLayer layer(in, out);
+    Tensor dense({batch, in});
+    for (int i = 0; i < batch; i++)
+      for (int t = 0; t < nnzPerRow; t++)
+        dense(i, static_cast<int>((static_cast<long long>(i) * 7919 + t * 104729) % in)) = 1.0f;
+    SparseTensor x(dense);
+    Tensor dY = filled(batch, out);
+    double nnz = x.nnz();
+    double activationBytes = 4.0 * batch * out;
+
+    std::ostringstream shape;
+    shape << dims({batch, in, out}) << "@" << nnzPerRow;
+
+    bench("sparseInput.denseBaseline", shape.str(), 2.0 * batch * in * out, 4.0 * (in * out + batch * (in + out)), [&]
+          { Tensor y = layer.forward(dense); });
+    bench("sparseInput.forward", shape.str(), 2.0 * nnz * out, 4.0 * nnz * out + x.bytes() + activationBytes, [&]
+          { Tensor y = layer.forward(x); });
+    bench("sparseInput.dW", shape.str(), 2.0 * nnz * out, 8.0 * nnz * out + x.bytes() + activationBytes, [&]
+          { layer.dW(dY, x); });
+  }
+
+  void runAll()
+  {
+    for (int n : {64, 128, 256, 512})
+      benchMatMul(n, n, n);
+    benchMatMul(1, 512, 512);
+    benchMatMul(8, 1024, 1024);
+    benchMatMul(4096, 16, 64);
+    benchMatMul(64, 64, 4096);
+
+    for (int n : {256, 1024})
+      benchTranspose(n, n);
+    benchTranspose(4096, 64);
+
+    benchAddBroadcast(256, 256);
+    benchAddBroadcast(4096, 64);
+    benchSumRows(256, 256);
+    benchSumRows(4096, 64);
+    benchElementwise(256, 256);
+    benchElementwise(1024, 1024);
+
+    benchDense(1, 256, 256);
+    benchDense(64, 256, 256);
+    benchDense(256, 1024, 1024);
+
+    benchOptimizer("optimizer.sgd", OptimizerKind::SGD, 1024, 1024);
+    benchOptimizer("optimizer.momentum", OptimizerKind::Momentum, 1024, 1024);
+    benchOptimizer("optimizer.adam", OptimizerKind::Adam, 1024, 1024);
+    benchOptimizer("optimizer.adamw", OptimizerKind::AdamW, 1024, 1024);
+
+    benchTrainStep(32, {16, 32, 4});
+    benchTrainStep(64, {784, 256, 128, 10});
+    benchDataParallel(256, {64, 128, 128, 10});
+    benchDataParallel(64, {784, 256, 128, 10});
+
+    benchServing(32, {784, 256, 128, 10});
+
+    benchSparse(1, 1024, 1024, 0.9f);
+    benchSparse(64, 1024, 1024, 0.9f);
+    benchSparse(64, 1024, 1024, 0.5f);
+    benchSparseInput(64, 20000, 64, 32);
+  }
+
+  std::string jsonEscape(const std::string &s)
+  {
+    std::string out;
+    for (char c : s)
+    {
+      if (c == '"' || c == '\\')
+        out += '\\';
+      out += c;
+    }
+    return out;
+  }
+
+  void writeJson(const std::string &path)
+  {
+    std::FILE *f = std::fopen(path.c_str(), "w");
+    if (!f)
+    {
+      std::cerr << "cannot write " << path << "\n";
+      std::exit(1);
+    }
+
+    std::fprintf(f, "{\n  \"kernel\": \"%s\",\n", gemmKernelName());
+#ifdef NDEBUG
+    std::fprintf(f, "  \"assertions\": false,\n");
+#else
+    std::fprintf(f, "  \"assertions\": true,\n");
+#endif
+    std::fprintf(f, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+      const BenchResult &r = results[i];
+      std::fprintf(f,
+                   "    {\"name\": \"%s\", \"shape\": \"%s\", \"threads\": %d, \"iterations\": %ld, "
+                   "\"ns_per_op\": %.1f, \"gflops\": %.3f, \"gbps\": %.3f, \"allocs_per_op\": %.2f}%s\n",
+                   jsonEscape(r.name).c_str(), jsonEscape(r.shape).c_str(), r.threads, r.iterations,
+                   r.nsPerOp, r.gflops, r.gbps, r.allocsPerOp, i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(f, "  ]\n}\n");
+    std::fclose(f);
+  }
+
+  std::vector<int> parseList(const std::string &s)
+  {
+    std::vector<int> values;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ','))
+      values.push_back(std::atoi(item.c_str()));
+    return values;
+  }
+
+  void usage()
+  {
+    std::cerr << "usage: myNN_bench [--threads 1,2,4] [--filter name] [--min-time seconds] [--json file]\n";
+    std::exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (i + 1 >= argc)
+      usage();
+    if (arg == "--threads")
+      options.threads = parseList(argv[++i]);
+    else if (arg == "--filter")
+      options.filter = argv[++i];
+    else if (arg == "--min-time")
+      options.minTime = std::atof(argv[++i]);
+    else if (arg == "--json")
+      options.jsonPath = argv[++i];
+    else
+      usage();
+  }
+  if (options.threads.empty())
+    options.threads = {ThreadPool::instance().numThreads()};
+
+  std::printf("kernel: %s, elementwise: %s\n", gemmKernelName(), tensorKernelName());
+  std::printf("%-18s %-16s %3s %14s %10s %10s %8s\n", "name", "shape", "thr", "ns/op", "GFLOP/s", "GB/s", "allocs");
+  for (int threads : options.threads)
+  {
+    ThreadPool::instance().setNumThreads(threads);
+    runAll();
+  }
+
+  if (!options.jsonPath.empty())
+    writeJson(options.jsonPath);
+  return 0;
+}
@@ -1,11 +1,12 @@
 #ifndef ACTIVATION_LAYER
 #define ACTIVATION_LAYER
 
-#include "Tensor.hpp"
+#include "Layer.hpp"
 
 namespace myNN
 {
-  class ActivationLayer
+  // elementwise activation, the output has the shape of the input
+  class ActivationLayer : public Layer
   {
   protected:
     Tensor lastInput_;
@@ -14,8 +15,15 @@ namespace myNN
     virtual ~ActivationLayer() = default;
     virtual Tensor forward(const Tensor &x) = 0;
     virtual Tensor backward(const Tensor &out) = 0;
+
+    int outputSize(int inputSize) const override { return inputSize; }
+
+    // the derivative is taken from the output, the input is not kept
+    bool backwardNeedsInput() const override { return false; }
+
+    bool backwardNeedsOutput() const override { return true; }
   };
 
 } // namespace MyNN
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,138 @@
+#ifndef ALLOCATOR
+#define ALLOCATOR
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace myNN
+{
+
+  // every block handed out for Tensor data is aligned to a cache line, which also
+  // covers the widest SIMD loads
+  constexpr std::size_t TENSOR_ALIGNMENT = 64;
+
+  // allocation counters, all sizes in bytes
+  struct AllocStats
+  {
+    std::size_t requests = 0;        // allocate calls
+    std::size_t heapAllocations = 0; // requests that had to go to the system
+    std::size_t heapFrees = 0;       // blocks given back to the system
+    std::size_t bytesInUse = 0;      // bytes held by live blocks
+    std::size_t peakBytesInUse = 0;
+    std::size_t bytesCached = 0; // bytes sitting in free lists
+  };
+
+  // pluggable source of Tensor storage
+  class Allocator
+  {
+  public:
+    virtual ~Allocator() = default;
+    virtual void *allocate(std::size_t bytes) = 0;
+    virtual void deallocate(void *p, std::size_t bytes) = 0;
+    virtual AllocStats stats() const = 0;
+  };
+
+  // straight to the system allocator, one heap allocation per request and nothing
+  // cached; the counters are atomics so concurrent requests never wait on each other
+  class SystemAllocator : public Allocator
+  {
+  private:
+    std::atomic<std::size_t> requests_{0};
+    std::atomic<std::size_t> heapFrees_{0};
+    std::atomic<std::size_t> bytesInUse_{0};
+    std::atomic<std::size_t> peakBytesInUse_{0};
+
+  public:
+    void *allocate(std::size_t bytes) override;
+    void deallocate(void *p, std::size_t bytes) override;
+    AllocStats stats() const override;
+  };
+
+  // rounds requests up to a size class and keeps freed blocks on a free list per class,
+  // so a loop that allocates the same shapes every iteration stops touching the heap;
+  // cached blocks are only returned by release() or the destructor, so it is meant for
+  // a Workspace around a bounded piece of work rather than as the process default
+  class PoolAllocator : public Allocator
+  {
+  private:
+    mutable std::mutex mutex_;
+    std::vector<std::vector<void *>> freeLists_;
+    AllocStats stats_;
+
+  public:
+    PoolAllocator() = default;
+    ~PoolAllocator() override;
+    PoolAllocator(const PoolAllocator &) = delete;
+    PoolAllocator &operator=(const PoolAllocator &) = delete;
+
+    void *allocate(std::size_t bytes) override;
+    void deallocate(void *p, std::size_t bytes) override;
+    AllocStats stats() const override;
+
+    // give all cached blocks back to the system
+    void release();
+
+    // size a request is rounded up to, and the index of its class
+    static std::size_t sizeClass(std::size_t bytes, std::size_t &index);
+  };
+
+  // allocator new Tensors on this thread draw from (a process wide SystemAllocator unless
+  // changed); pool workers use the one of the thread that started their job
+  Allocator &defaultAllocator();
+
+  // change the allocator for new Tensors on this thread, nullptr restores the process
+  // wide default; existing Tensors keep returning memory to the allocator they came from
+  void setDefaultAllocator(Allocator *allocator);
+
+  // routes new Tensor storage of this thread, and of the pool jobs it runs, to an
+  // allocator for the lifetime of the scope, e.g. a PoolAllocator kept alive across
+  // training steps as a per-step workspace; other threads are not affected
+  class Workspace
+  {
+  private:
+    Allocator *previous_;
+
+  public:
+    explicit Workspace(Allocator &allocator);
+    ~Workspace();
+    Workspace(const Workspace &) = delete;
+    Workspace &operator=(const Workspace &) = delete;
+  };
+
+  // std allocator adapter used by Tensor storage; remembers the Allocator it draws from
+  template <typename T>
+  class TensorAllocator
+  {
+  private:
+    Allocator *source_;
+
+    template <typename U>
+    friend class TensorAllocator;
+
+  public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    TensorAllocator() : source_(&defaultAllocator()) {}
+
+    template <typename U>
+    TensorAllocator(const TensorAllocator<U> &other) : source_(other.source_) {}
+
+    T *allocate(std::size_t n) { return static_cast<T *>(source_->allocate(n * sizeof(T))); }
+
+    void deallocate(T *p, std::size_t n) { source_->deallocate(p, n * sizeof(T)); }
+
+    // copies of a Tensor draw from whatever allocator is current
+    TensorAllocator select_on_container_copy_construction() const { return TensorAllocator(); }
+
+    template <typename U>
+    bool operator==(const TensorAllocator<U> &other) const { return source_ == other.source_; }
+  };
+
+} // namespace myNN
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef CHECKPOINT
+#define CHECKPOINT
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Network.hpp"
+
+namespace myNN
+{
+
+  // on-disk layout of a checkpoint (native little-endian):
+  //   CheckpointHeader (64 bytes)
+  //   nTensors CheckpointEntry records (64 bytes each)
+  //   tensor data, row-major float32, every tensor starting on a 64 byte boundary
+  // because of the alignment a mapped checkpoint can be used in place by the SIMD kernels
+  struct CheckpointHeader
+  {
+    char magic[8]; // "MYNNCKPT"
+    std::uint32_t version;
+    std::uint32_t nLayers;
+    std::uint32_t nTensors;
+    std::uint32_t flags; // CHECKPOINT_HAS_STATE if training state was saved
+    std::uint8_t reserved[40];
+  };
+
+  // what a stored tensor holds
+  enum class CheckpointTensor : std::uint32_t
+  {
+    Weights = 0,
+    Bias = 1,
+    WeightGrad = 2,
+    BiasGrad = 3,
+    WeightMoment = 4, // OptimizerState::m of the weights
+    WeightSecondMoment = 5,
+    BiasMoment = 6,
+    BiasSecondMoment = 7
+  };
+
+  struct CheckpointEntry
+  {
+    std::uint32_t layer;
+    std::uint32_t kind; // CheckpointTensor
+    std::uint32_t rows;
+    std::uint32_t cols;
+    std::uint64_t offset; // from the start of the file
+    std::uint32_t activation; // Activation applied after the layer, set on Weights entries
+    std::uint32_t optimizer;  // OptimizerKind of the state saved for a Weights or Bias entry
+    std::uint32_t optimizerSteps;
+    std::uint8_t reserved[28];
+  };
+
+  static_assert(sizeof(CheckpointHeader) == 64, "checkpoint header must stay 64 bytes");
+  static_assert(sizeof(CheckpointEntry) == 64, "checkpoint entry must stay 64 bytes");
+
+  constexpr std::uint32_t CHECKPOINT_HAS_STATE = 1;
+
+  // write every layer's weights and biases, plus the gradients and optimizer moments if
+  // includeState is set
+  // activations are stored with the Dense layer before them; throws if the network has
+  // layers that cannot be described that way
+  void saveCheckpoint(const Network &net, const std::string &path, bool includeState = false);
+
+  // read a checkpoint into a new, trainable Network
+  Network loadCheckpoint(const std::string &path);
+
+  // read-only memory mapping of a checkpoint; weights are used where they lie in the
+  // file, nothing is parsed or copied beyond the small table of entries
+  class MappedCheckpoint
+  {
+  private:
+    void *map_ = nullptr;
+    std::size_t mapSize_ = 0;
+    CheckpointHeader header_;
+    std::vector<CheckpointEntry> entries_;
+
+    // index into entries_ of each layer's weights and bias
+    std::vector<int> weightEntry_;
+    std::vector<int> biasEntry_;
+
+    TensorView entryView(const CheckpointEntry &e) const;
+
+  public:
+    explicit MappedCheckpoint(const std::string &path);
+    ~MappedCheckpoint();
+    MappedCheckpoint(const MappedCheckpoint &) = delete;
+    MappedCheckpoint &operator=(const MappedCheckpoint &) = delete;
+
+    int numLayers() const { return static_cast<int>(header_.nLayers); }
+
+    bool hasState() const { return (header_.flags & CHECKPOINT_HAS_STATE) != 0; }
+
+    // zero-copy views of layer i's parameters
+    TensorView weights(int layer) const;
+
+    TensorView bias(int layer) const;
+
+    // activation that follows layer i
+    Activation activation(int layer) const;
+
+    // any stored tensor of a layer, throws if it is not in the file
+    TensorView tensor(int layer, CheckpointTensor kind) const;
+
+    // copy of the optimizer state saved for a layer's weights, or its bias if bias is set
+    OptimizerState optimizerState(int layer, bool bias) const;
+
+    // inference straight from the mapped weights
+    Tensor forward(const TensorView &input) const;
+  };
+
+} // namespace myNN
+
+#endif
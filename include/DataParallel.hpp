@@ -0,0 +1,71 @@
+#ifndef DATA_PARALLEL
+#define DATA_PARALLEL
+
+#include <iosfwd>
+#include <vector>
+
+#include "Network.hpp"
+
+namespace myNN
+{
+
+  // data-parallel training on the thread pool: every batch is split into one shard per
+  // replica, each replica runs forward and backward on its shard on its own thread, the
+  // gradients are summed and one optimizer step is applied to the shared weights
+  // the network itself is replica 0; the others share its parameters and only own
+  // their gradients and activation buffers, so the weights exist once
+  // the layers of the network must not be added or replaced while a trainer uses it
+  class DataParallelTrainer
+  {
+  private:
+    Network &net_;
+    std::vector<Network> replicas_; // replicas 1..n-1
+
+    // squared error of each shard, padded so the replicas never share a cache line
+    struct alignas(64) ShardResult
+    {
+      double squaredError = 0.0;
+    };
+    std::vector<ShardResult> shards_;
+
+    // sum the gradients of every replica into the network's, in parallel over cache
+    // line aligned slices so no two threads ever write the same line and no locks are taken
+    void reduceGradients(int nShards);
+
+  public:
+    // replicas <= 0 means one per thread of the pool
+    explicit DataParallelTrainer(Network &net, int replicas = 0);
+
+    DataParallelTrainer(const DataParallelTrainer &) = delete;
+    DataParallelTrainer &operator=(const DataParallelTrainer &) = delete;
+
+    int numReplicas() const { return static_cast<int>(replicas_.size()) + 1; }
+
+    // forward, backward, reduction and one optimizer step, returns the batch RMSE
+    // shards honour options.microBatchSize
+    float trainBatch(const TensorView &x, const TensorView &y, const FitOptions &options);
+
+    // Network::fit with every batch trained data-parallel
+    std::vector<EpochStats> fit(const Tensor &X, const Tensor &Y, const FitOptions &options = FitOptions());
+
+    std::vector<EpochStats> fit(BatchLoader &loader, const FitOptions &options = FitOptions());
+  };
+
+  // training throughput with 1 to maxThreads threads and as many replicas
+  struct ScalingPoint
+  {
+    int threads = 1;
+    double samplesPerSec = 0.0;
+    double speedup = 1.0;    // over one thread
+    double efficiency = 1.0; // speedup / threads
+  };
+
+  // train copies of net on X and Y with each thread count and measure the throughput; the
+  // thread pool is resized for each run and restored afterwards; a table is written to
+  // out if given
+  std::vector<ScalingPoint> scalingReport(const Network &net, const Tensor &X, const Tensor &Y,
+                                          const FitOptions &options, int maxThreads, std::ostream *out = nullptr);
+
+} // namespace myNN
+
+#endif
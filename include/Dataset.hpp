@@ -0,0 +1,136 @@
+#ifndef DATASET
+#define DATASET
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Tensor.hpp"
+
+namespace myNN
+{
+
+  // on-disk layout of a dataset file: this 64 byte header, then `rows` rows of
+  // `features` input values followed by `targets` target values, row-major float32
+  struct DatasetHeader
+  {
+    char magic[8];       // "MYNNDATA"
+    std::uint32_t version;
+    std::uint32_t dtype; // 0 = float32, the only type so far
+    std::uint64_t rows;
+    std::uint32_t features;
+    std::uint32_t targets;
+    std::uint8_t reserved[32];
+  };
+
+  static_assert(sizeof(DatasetHeader) == 64, "dataset header must stay 64 bytes");
+
+  // streams rows into a dataset file, so datasets larger than memory can be written in pieces
+  class DatasetWriter
+  {
+  private:
+    std::FILE *file_ = nullptr;
+    DatasetHeader header_;
+
+  public:
+    DatasetWriter(const std::string &path, int features, int targets);
+    ~DatasetWriter();
+    DatasetWriter(const DatasetWriter &) = delete;
+    DatasetWriter &operator=(const DatasetWriter &) = delete;
+
+    // append rows of inputs X and matching targets Y
+    void append(const TensorView &X, const TensorView &Y);
+
+    // write the final row count and close the file, also done by the destructor
+    void close();
+  };
+
+  // write a whole in-memory dataset in one go
+  void writeDataset(const std::string &path, const TensorView &X, const TensorView &Y);
+
+  // read-only memory mapping of a dataset file, pages are loaded by the OS on demand
+  class MappedDataset
+  {
+  private:
+    void *map_ = nullptr;
+    std::size_t mapSize_ = 0;
+    const float *rows_ = nullptr;
+    DatasetHeader header_;
+
+  public:
+    explicit MappedDataset(const std::string &path);
+    ~MappedDataset();
+    MappedDataset(const MappedDataset &) = delete;
+    MappedDataset &operator=(const MappedDataset &) = delete;
+
+    int rows() const { return static_cast<int>(header_.rows); }
+
+    int features() const { return static_cast<int>(header_.features); }
+
+    int targets() const { return static_cast<int>(header_.targets); }
+
+    // zero-copy views of the inputs and targets of rows [begin, end)
+    TensorView inputs(int begin, int end) const;
+
+    TensorView outputs(int begin, int end) const;
+
+    // hint the OS to start reading rows [begin, end) in the background
+    void prefetch(int begin, int end) const;
+  };
+
+  // delivers a mapped dataset as batch-sized Tensors; a background thread fills the
+  // next batch while the caller trains on the current one
+  class BatchLoader
+  {
+  private:
+    struct Slot
+    {
+      Tensor x;
+      Tensor y;
+      bool ready = false;
+    };
+
+    const MappedDataset &data_;
+    int batchSize_;
+    bool shuffle_;
+    unsigned seed_;
+    int epoch_ = 0;
+
+    std::vector<int> batchOrder_;
+    Slot slots_[2];
+    int consumed_ = 0;
+    bool stop_ = false;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::thread producer_;
+
+    void produce();
+    void stopProducer();
+
+  public:
+    // shuffle visits the batches in a new random order every epoch, rows inside a batch
+    // stay sequential so reads from disk stay sequential too
+    BatchLoader(const MappedDataset &data, int batchSize, bool shuffle = false, unsigned seed = 0);
+    ~BatchLoader();
+    BatchLoader(const BatchLoader &) = delete;
+    BatchLoader &operator=(const BatchLoader &) = delete;
+
+    int batchSize() const { return batchSize_; }
+
+    int numBatches() const { return static_cast<int>(batchOrder_.size()); }
+
+    // next batch of the epoch, false once the epoch is exhausted
+    // x and y are swapped with the prefetched buffers, so pass the same tensors every call
+    bool next(Tensor &x, Tensor &y);
+
+    // start the next epoch
+    void reset();
+  };
+
+} // namespace myNN
+
+#endif
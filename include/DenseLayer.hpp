@@ -1,12 +1,16 @@
 #ifndef DENSE_LAYER
 #define DENSE_LAYER
 
+#include "Half.hpp"
+#include "Layer.hpp"
+#include "Optimizer.hpp"
+#include "Sparse.hpp"
 #include "Tensor.hpp"
 
 namespace myNN
 {
 
-    class DenseLayer
+    class DenseLayer : public Layer
     {
     private:
         Tensor w_;
@@ -14,36 +18,130 @@ namespace myNN
         Tensor dW_;
         Tensor dB_;
 
+        // mixed precision: w_ stays the fp32 master copy that updates are applied to,
+        // forward and dX read the rounded copy wLow_
+        DType precision_ = DType::Float32;
+        HalfTensor wLow_;
+
+        // pruned weights: forward and dX only touch the nonzero ones, held as w_^T in
+        // sparse rows, one per output; w_ stays the master copy and is kept zero outside
+        // the pattern
+        bool sparse_ = false;
+        SparseTensor wSparse_;
+
+        // weight gradient of the latest dW on a sparse input: only the rows of w_ for the
+        // features that occurred, used by step instead of dW_ while rowGrad_ is set
+        SparseRows dWRows_;
+        bool rowGrad_ = false;
+
+        // optimizer moments of w_ and b_, kept with the parameters they belong to
+        OptimizerState wState_;
+        OptimizerState bState_;
+
+        // set on data-parallel replicas: forward and backward read the parameters of
+        // this layer instead of their own, only the gradients are per replica
+        const DenseLayer *shared_ = nullptr;
+
+        const DenseLayer &params() const { return shared_ ? *shared_ : *this; }
+
     public:
         // constructor
         DenseLayer(int nInputs, int nOutputs, bool initialiseGrads = false);
 
-        // forward feed
-        Tensor forward(const Tensor &input) const;
+        // forward feed, input may be a view such as a slice of a dataset
+        Tensor forward(const TensorView &input) const;
+
+        // forward feed with bias and activation fused into the matMul
+        Tensor forward(const TensorView &input, Activation activation) const;
+
+        // forward feed of reduced precision activations, accumulated in fp32
+        Tensor forward(const HalfTensor &input, Activation activation = Activation::None) const;
+
+        // forward feed of sparse input rows, e.g. one-hot or hashed features: every stored
+        // element scales its row of the weights into the output; reads the fp32 weights
+        Tensor forward(const SparseTensor &input, Activation activation = Activation::None) const;
+
+        void forwardInto(const SparseTensor &input, float *out, Activation activation = Activation::None) const;
+
+        // store the weights used by forward and backward as bfloat16 or half, or go back to fp32
+        void setPrecision(DType precision);
+
+        DType getPrecision() const { return precision_; }
+
+        // re-round the reduced precision weights after w_ was changed directly
+        void syncWeights();
+
+        // read weights, bias and precision from owner from now on and drop the own copies;
+        // owner must have the same shape and outlive this layer, which can no longer be
+        // stepped
+        void shareParameters(const DenseLayer &owner);
+
+        bool sharesParameters() const { return shared_ != nullptr; }
+
+        // zero the sparsity fraction of the weights with the smallest magnitude and switch
+        // to sparse weights; returns the magnitude below which weights were cut
+        float prune(float sparsity);
+
+        // run forward and dX on the nonzero weights only, or go back to dense ones; the
+        // pattern is fixed when switching, later updates keep the other weights at zero
+        void setSparse(bool sparse);
+
+        bool isSparse() const { return sparse_; }
+
+        // the nonzero weights as w^T, empty unless sparse
+        const SparseTensor &getSparseWeights() const { return wSparse_; }
+
+        // reduced precision weights, empty unless a 16 bit precision is set
+        const HalfTensor &getLowWeights() const { return wLow_; }
 
         // get weights
         Tensor &getWeights() { return w_; }
 
+        const Tensor &getWeights() const { return w_; }
+
         // get biases
         Tensor &getBias() { return b_; }
 
+        const Tensor &getBias() const { return b_; }
+
         // get dW_
         Tensor &getdW_() { return dW_; }
 
+        const Tensor &getdW_() const { return dW_; }
+
         // get dB_
         Tensor &getdB_() { return dB_; }
 
-        // RMSE easiest cost function
-        float rmse(const Tensor &pred, const Tensor &target) const;
+        const Tensor &getdB_() const { return dB_; }
+
+        // optimizer state of the weights and of the bias
+        OptimizerState &getWeightState() { return wState_; }
+
+        const OptimizerState &getWeightState() const { return wState_; }
+
+        OptimizerState &getBiasState() { return bState_; }
+
+        const OptimizerState &getBiasState() const { return bState_; }
+
+        // gradient of weights, written into dW_ or added to it if accumulate is set; a row
+        // gradient accumulated so far is made dense first
+        void dW(const Tensor &dL_dY, const TensorView &input, bool accumulate = false);
 
-        // derivative of RMSE (weird naming)
-        Tensor dL_dY(const Tensor &pred, const Tensor &target) const;
+        // gradient of weights for a sparse input, only for the rows of the features the
+        // batch uses; written into getdWRows() instead of dW_, or added to it if
+        // accumulate is set, and step then only updates those rows; accumulated onto a
+        // dense gradient the rows are added to dW_ instead
+        void dW(const Tensor &dL_dY, const SparseTensor &input, bool accumulate = false);
 
-        // gradient of weights
-        void dW(const Tensor &dL_dY, const Tensor &input);
+        // true if the latest dW came from a sparse input
+        bool hasRowGradient() const { return rowGrad_; }
 
-        // gradient of bias
-        void dB(const Tensor &dL_dY);
+        SparseRows &getdWRows() { return dWRows_; }
+
+        const SparseRows &getdWRows() const { return dWRows_; }
+
+        // gradient of bias, written into dB_ or added to it if accumulate is set
+        void dB(const Tensor &dL_dY, bool accumulate = false);
 
         // gradient of X
         Tensor dX(const Tensor &dL_dY);
@@ -51,8 +149,27 @@ namespace myNN
         // backward prop
         Tensor backward(const Tensor &dL_dY);
 
-        // update parameters
-        void updateParameters(float lr);
+        // one optimizer step on w_ and b_, a single in-place pass over each; weight
+        // decay only applies to w_
+        void step(const OptimizerConfig &config, float lr) override;
+
+        // zero dW_ and dB_
+        void zeroGrad() override;
+
+        // Layer interface, used when run as part of a Network graph
+        std::unique_ptr<Layer> clone() const override;
+
+        const char *name() const override { return "dense"; }
+
+        int outputSize(int inputSize) const override;
+
+        void forwardInto(const TensorView &input, float *out) const override;
+
+        // forwardInto with an activation fused into the GEMM epilogue
+        void forwardInto(const TensorView &input, float *out, Activation activation) const;
+
+        // dB, dW and dX, the output is not needed
+        Tensor backwardFrom(const Tensor &dOut, const TensorView &input, const TensorView &output, bool accumulate) override;
     };
 
 } // myNN
@@ -0,0 +1,85 @@
+#ifndef DISTRIBUTED
+#define DISTRIBUTED
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Network.hpp"
+#include "Transport.hpp"
+
+namespace myNN
+{
+
+  // data-parallel training across processes: every rank trains its own copy of the
+  // network on its own shard of the data, the gradients are averaged over the ring with
+  // ringAllReduce and every rank applies the same optimizer step, so the copies stay equal
+  // gradients are sent in buckets of about bucketBytes; a bucket is all-reduced on a
+  // communication thread as soon as backProp has finished its layers, while the backward
+  // pass of the earlier layers goes on
+  // all ranks must use the same network structure, bucket size and batch sizes
+  class DistributedTrainer
+  {
+  private:
+    Network &net_;
+    Transport &transport_;
+    std::size_t bucketFloats_;
+
+    // gradient tensor of a layer, in the order backProp finished them
+    struct Span
+    {
+      float *data;
+      std::size_t n;
+    };
+    std::vector<Span> filling_;
+    std::size_t fillingFloats_ = 0;
+
+    // buckets handed to the communication thread, which owns buffer_ and scratch_
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::deque<std::vector<Span>> queue_;
+    int inFlight_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::vector<float> buffer_;
+    std::vector<float> scratch_;
+
+    void gradientsReady(DenseLayer &layer);
+    void submit();
+    void wait();
+    void workerLoop();
+    void allReduceBucket(const std::vector<Span> &bucket);
+
+  public:
+    DistributedTrainer(Network &net, Transport &transport, std::size_t bucketBytes = 1 << 20);
+    ~DistributedTrainer();
+    DistributedTrainer(const DistributedTrainer &) = delete;
+    DistributedTrainer &operator=(const DistributedTrainer &) = delete;
+
+    int rank() const { return transport_.rank(); }
+
+    int size() const { return transport_.size(); }
+
+    // copy the parameters of rank 0 to every rank, call once before training
+    void broadcastParameters();
+
+    // forward and backward on the local batch, gradient all-reduce overlapped with the
+    // backward pass and one optimizer step; returns the RMSE over the batches of all ranks
+    float trainBatch(const TensorView &x, const TensorView &y, const FitOptions &options);
+
+    // Network::fit on this rank's data with every batch trained across the ring; every
+    // rank must run the same number of batches, i.e. hold the same number of rows
+    std::vector<EpochStats> fit(const Tensor &X, const Tensor &Y, const FitOptions &options = FitOptions());
+
+    std::vector<EpochStats> fit(BatchLoader &loader, const FitOptions &options = FitOptions());
+  };
+
+} // namespace myNN
+
+#endif
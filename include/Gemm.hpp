@@ -0,0 +1,49 @@
+#ifndef GEMM
+#define GEMM
+
+namespace myNN
+{
+
+  // activation that can be fused into the store of a GEMM result
+  enum class Activation
+  {
+    None,
+    ReLU
+  };
+
+  // work applied to each output tile while it is still in registers:
+  // C = activation(alpha * A * B + beta * C + bias)
+  struct GemmEpilogue
+  {
+    const float *bias = nullptr; // one value per column of C, or nullptr
+    Activation activation = Activation::None;
+    float alpha = 1.0f;
+    float beta = 0.0f; // C is not read when beta is 0, so it may hold garbage
+  };
+
+  // C = op(A) * op(B) for row-major matrices, op(A) is M x K, op(B) is K x N, C is M x N
+  // op(X) is X or X^T, transposed operands are read in place from their original storage
+  // lda, ldb and ldc are the row strides (leading dimensions) of the stored matrices
+  // the epilogue scales the product, adds it to the scaled old C and a bias row and applies
+  // an activation as the result is written
+  void gemm(bool transA, bool transB,
+            int M, int N, int K,
+            const float *A, int lda,
+            const float *B, int ldb,
+            float *C, int ldc,
+            const GemmEpilogue &epilogue = GemmEpilogue());
+
+  // C = A * B where element (i, p) of A is A[i * rsA + p * csA] and element (p, j) of B is
+  // B[p * rsB + j * csB], so any strided view (slices, transposes) can be multiplied in place
+  void gemmStrided(int M, int N, int K,
+                   const float *A, int rsA, int csA,
+                   const float *B, int rsB, int csB,
+                   float *C, int ldc,
+                   const GemmEpilogue &epilogue = GemmEpilogue());
+
+  // name of the micro-kernel picked for this CPU
+  const char *gemmKernelName();
+
+} // namespace myNN
+
+#endif
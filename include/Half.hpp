@@ -0,0 +1,149 @@
+#ifndef HALF
+#define HALF
+
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+#include "Allocator.hpp"
+#include "Gemm.hpp"
+#include "TensorView.hpp"
+
+namespace myNN
+{
+
+  class Tensor;
+
+  // element type of stored tensor data; compute is always fp32
+  enum class DType
+  {
+    Float32,
+    BFloat16, // fp32 with the low 16 mantissa bits dropped, same range as fp32
+    Float16   // IEEE 754 half precision
+  };
+
+  // bytes per element
+  inline int dtypeSize(DType dtype)
+  {
+    return dtype == DType::Float32 ? 4 : 2;
+  }
+
+  inline float bf16ToFloat(std::uint16_t h)
+  {
+    return std::bit_cast<float>(static_cast<std::uint32_t>(h) << 16);
+  }
+
+  // round to nearest even, NaNs stay NaN
+  inline std::uint16_t floatToBf16(float f)
+  {
+    std::uint32_t x = std::bit_cast<std::uint32_t>(f);
+    if ((x & 0x7fffffffu) > 0x7f800000u)
+      return static_cast<std::uint16_t>((x >> 16) | 0x40);
+    x += 0x7fffu + ((x >> 16) & 1);
+    return static_cast<std::uint16_t>(x >> 16);
+  }
+
+  inline float halfToFloat(std::uint16_t h)
+  {
+    std::uint32_t sign = static_cast<std::uint32_t>(h & 0x8000u) << 16;
+    std::uint32_t exponent = (h >> 10) & 0x1fu;
+    std::uint32_t mantissa = h & 0x3ffu;
+
+    if (exponent == 0)
+    {
+      // zero or subnormal: mantissa * 2^-24
+      float f = static_cast<float>(mantissa) * (1.0f / 16777216.0f);
+      return std::bit_cast<float>(std::bit_cast<std::uint32_t>(f) | sign);
+    }
+    if (exponent == 31)
+      return std::bit_cast<float>(sign | 0x7f800000u | (mantissa << 13));
+    return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+  }
+
+  // round to nearest even, overflow goes to infinity
+  inline std::uint16_t floatToHalf(float f)
+  {
+    std::uint32_t x = std::bit_cast<std::uint32_t>(f);
+    std::uint32_t sign = (x >> 16) & 0x8000u;
+    std::uint32_t absx = x & 0x7fffffffu;
+
+    if (absx >= 0x7f800000u) // inf or NaN
+      return static_cast<std::uint16_t>(sign | 0x7c00u | (absx > 0x7f800000u ? 0x200u : 0u));
+    if (absx >= 0x477ff000u) // rounds past the largest half
+      return static_cast<std::uint16_t>(sign | 0x7c00u);
+    if (absx < 0x38800000u)
+    {
+      // below the smallest normal half: adding 0.5 lines the fp32 rounding up with the
+      // half subnormal spacing of 2^-24
+      float rounded = std::bit_cast<float>(absx) + 0.5f;
+      return static_cast<std::uint16_t>(sign | (std::bit_cast<std::uint32_t>(rounded) - 0x3f000000u));
+    }
+
+    std::uint32_t odd = (absx >> 13) & 1;
+    absx += 0xc8000fffu + odd; // rebias the exponent from 127 to 15 and round
+    return static_cast<std::uint16_t>(sign | (absx >> 13));
+  }
+
+  // convert n values between fp32 and a 16 bit type, vectorised where the CPU allows
+  void toFloat(const std::uint16_t *src, float *dst, int n, DType dtype);
+
+  void fromFloat(const float *src, std::uint16_t *dst, int n, DType dtype);
+
+  // 2D row-major tensor stored as bfloat16 or half
+  class HalfTensor
+  {
+  public:
+    using Storage = std::vector<std::uint16_t, TensorAllocator<std::uint16_t>>;
+
+  private:
+    Storage data_;
+    int rows_ = 0;
+    int cols_ = 0;
+    DType dtype_ = DType::BFloat16;
+
+  public:
+    HalfTensor() = default;
+
+    // round the elements of src to dtype
+    HalfTensor(const TensorView &src, DType dtype);
+
+    // re-round src into this tensor, reusing the buffer when the size matches
+    void assign(const TensorView &src);
+
+    // widen back to fp32
+    Tensor toFloat() const;
+
+    const std::uint16_t *data() const { return data_.data(); }
+
+    int rows() const { return rows_; }
+
+    int cols() const { return cols_; }
+
+    int size() const { return rows_ * cols_; }
+
+    DType dtype() const { return dtype_; }
+
+    std::size_t bytes() const { return data_.size() * sizeof(std::uint16_t); }
+  };
+
+  // gemmStrided for operands stored as fp32 or a 16 bit type, data points at elements of
+  // the given type; both are widened to fp32 while being packed, so the micro-kernel and
+  // all accumulation stay fp32 and only the memory traffic shrinks
+  void gemmMixed(int M, int N, int K,
+                 const void *A, DType typeA, int rsA, int csA,
+                 const void *B, DType typeB, int rsB, int csB,
+                 float *C, int ldc,
+                 const GemmEpilogue &epilogue = GemmEpilogue());
+
+  // a * w + bias with reduced precision weights, fp32 result
+  Tensor matMulBias(const TensorView &a, const HalfTensor &w, const TensorView &bias, Activation activation = Activation::None);
+
+  // the same with reduced precision activations
+  Tensor matMulBias(const HalfTensor &a, const HalfTensor &w, const TensorView &bias, Activation activation = Activation::None);
+
+  // a * w^T, w read in place
+  Tensor matMulTranspose(const TensorView &a, const HalfTensor &w);
+
+} // namespace myNN
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef INFERENCE_SERVER
+#define INFERENCE_SERVER
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iosfwd>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Network.hpp"
+
+namespace myNN
+{
+
+  // settings for InferenceServer
+  struct ServerOptions
+  {
+    int maxBatch = 32;                       // rows per batched forward pass
+    std::chrono::microseconds maxWait{2000}; // longest a request waits for others to join it
+  };
+
+  // counts of values in buckets with growing upper bounds, the last bucket takes
+  // everything above the second to last bound
+  struct Histogram
+  {
+    std::vector<double> bounds; // upper bound of each bucket
+    std::vector<long> counts;
+    long total = 0;
+
+    void add(double value);
+
+    // upper bound of the bucket holding the p-quantile (p in [0, 1]), 0 if empty
+    double percentile(double p) const;
+  };
+
+  // what an InferenceServer has done since it started or since resetStats
+  struct ServerStats
+  {
+    long requests = 0;
+    long batches = 0;
+    double p50Us = 0.0; // request latency from submit to the result being set
+    double p99Us = 0.0;
+    double maxUs = 0.0;
+    Histogram latencyUs;  // quarter octave buckets from 1 us, so percentiles are within 19%
+    Histogram batchSizes; // one bucket per batch size 1..maxBatch
+
+    double meanBatchSize() const { return batches > 0 ? static_cast<double>(requests) / batches : 0.0; }
+  };
+
+  // asynchronous in-process front end for serving single samples: submit() queues one
+  // row and returns a future, a scheduler thread gathers the waiting rows into one
+  // batched predict of up to maxBatch rows, or fewer once the oldest has waited maxWait,
+  // and hands every caller its own output row
+  // the server runs a private copy of the network, so the original can go on training
+  class InferenceServer
+  {
+  private:
+    struct Request
+    {
+      Tensor input; // 1 x inputSize
+      std::promise<Tensor> result;
+      std::chrono::steady_clock::time_point submitted;
+    };
+
+    Network net_;
+    ServerOptions options_;
+    int inputSize_;
+
+    std::thread scheduler_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<Request> queue_;
+    bool stop_ = false;
+
+    // owned by the scheduler, the batch is sized for maxBatch rows once
+    std::vector<Request> running_;
+    Tensor batch_;
+
+    mutable std::mutex statsMutex_;
+    ServerStats stats_;
+
+    void schedulerLoop();
+    void runBatch();
+    void record(const std::vector<double> &latencies, int batchRows);
+
+  public:
+    InferenceServer(const Network &net, const ServerOptions &options = ServerOptions());
+
+    // answers the requests still queued, then stops the scheduler
+    ~InferenceServer();
+    InferenceServer(const InferenceServer &) = delete;
+    InferenceServer &operator=(const InferenceServer &) = delete;
+
+    int inputSize() const { return inputSize_; }
+
+    const ServerOptions &options() const { return options_; }
+
+    // queue one sample (1 x inputSize, copied) and return the future 1 x outputSize result;
+    // safe to call from any number of threads, errors of the forward pass end up in the future
+    std::future<Tensor> submit(const TensorView &sample);
+
+    ServerStats stats() const;
+
+    void resetStats();
+
+    // request count, mean batch size, latency percentiles and the batch size histogram
+    void printStats(std::ostream &out) const;
+  };
+
+} // namespace myNN
+
+#endif
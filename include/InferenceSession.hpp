@@ -0,0 +1,61 @@
+#ifndef INFERENCE_SESSION
+#define INFERENCE_SESSION
+
+#include <vector>
+
+#include "Checkpoint.hpp"
+#include "Network.hpp"
+#include "Sparse.hpp"
+
+namespace myNN
+{
+
+  // frozen, inference-only copy of a trained Network
+  // only weights and biases are kept (no gradients), and two activation buffers sized
+  // for the widest layer at maxBatch rows are allocated once; layers ping-pong between
+  // them and pruned layers share scratch planned with the buffers, so run() does no
+  // allocation at all
+  class InferenceSession
+  {
+  private:
+    std::vector<Tensor> params_; // owned copies, empty when running from a mapped checkpoint
+    std::vector<TensorView> weights_; // shape only for sparse layers
+    std::vector<SparseTensor> sparse_; // nonzero weights of pruned layers, as w^T
+    std::vector<TensorView> bias_;
+    std::vector<Activation> activations_;
+    int maxBatch_;
+    int maxWidth_ = 0;
+    Tensor buffers_[2];
+    SparseScratch scratch_;
+
+    void planBuffers();
+
+  public:
+    // copy the parameters out of net, which can be destroyed afterwards; sparse layers
+    // only bring their nonzero weights
+    InferenceSession(const Network &net, int maxBatch);
+
+    // run on weights mapped from a checkpoint, without copying them
+    // the checkpoint must outlive the session
+    InferenceSession(const MappedCheckpoint &checkpoint, int maxBatch);
+
+    int maxBatch() const { return maxBatch_; }
+
+    int numLayers() const { return static_cast<int>(weights_.size()); }
+
+    int inputSize() const { return weights_.empty() ? 0 : weights_.front().rows(); }
+
+    int outputSize() const { return weights_.empty() ? 0 : weights_.back().cols(); }
+
+    // bytes held by the session: owned parameters, sparse ones with their indices, plus
+    // the two activation buffers and the scratch of the sparse layers
+    std::size_t memoryBytes() const;
+
+    // forward pass for up to maxBatch rows; the result points into the session's
+    // buffers and stays valid until the next call
+    TensorView run(const TensorView &input);
+  };
+
+} // namespace myNN
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef LAYER
+#define LAYER
+
+#include <memory>
+
+#include "Optimizer.hpp"
+#include "Tensor.hpp"
+
+namespace myNN
+{
+
+  // common interface of everything a Network can run as a node of its graph
+  class Layer
+  {
+  public:
+    virtual ~Layer() = default;
+
+    virtual std::unique_ptr<Layer> clone() const = 0;
+
+    virtual const char *name() const = 0;
+
+    // number of output columns for an input with inputSize columns, throws if the
+    // layer cannot take such an input
+    virtual int outputSize(int inputSize) const = 0;
+
+    // write the layer's output for input into out, a packed row-major buffer of
+    // input.rows() x outputSize(input.cols()) floats owned by the caller
+    virtual void forwardInto(const TensorView &input, float *out) const = 0;
+
+    // dL/dInput from dL/dOutput, storing any parameter gradients in the layer, or adding
+    // them to the stored ones if accumulate is set
+    // input and output are what forwardInto saw and wrote; Network only keeps the ones
+    // declared as needed below alive until the backward pass, the others may be empty
+    virtual Tensor backwardFrom(const Tensor &dOut, const TensorView &input, const TensorView &output, bool accumulate) = 0;
+
+    virtual bool backwardNeedsInput() const { return true; }
+
+    virtual bool backwardNeedsOutput() const { return false; }
+
+    // the elementwise activation this layer computes, if it is one; Network fuses such
+    // layers into the GEMM epilogue of a DenseLayer right before them
+    virtual Activation activation() const { return Activation::None; }
+
+    // apply the stored gradients to the parameters, layers without any ignore it
+    virtual void step(const OptimizerConfig &, float) {}
+
+    // plain SGD step
+    void updateParameters(float lr) { step(OptimizerConfig(), lr); }
+
+    virtual void zeroGrad() {}
+
+    // RMSE easiest cost function
+    float rmse(const Tensor &pred, const TensorView &target) const;
+
+    // derivative of RMSE (weird naming)
+    Tensor dL_dY(const Tensor &pred, const TensorView &target) const;
+  };
+
+  // grad *= activation'(.) where output is the activation's result, in place
+  // ReLU only needs the sign of its output, so its input does not have to be kept
+  void activationBackward(Activation activation, const TensorView &output, Tensor &grad);
+
+} // namespace myNN
+
+#endif
@@ -1,37 +1,211 @@
 #ifndef NETWORK
 #define NETWORK
 
+#include <functional>
+#include <memory>
+
 #include "DenseLayer.hpp"
+#include "Dataset.hpp"
 
 namespace myNN
 {
+  // settings for Network::fit
+  struct FitOptions
+  {
+    int epochs = 1;
+    int batchSize = 32;
+    float learningRate = 0.01f;
+    OptimizerConfig optimizer; // plain SGD unless set
+    int microBatchSize = 0; // run batches in slices of this many rows and accumulate their
+                            // gradients into one step, 0 runs whole batches
+    bool shuffle = true;   // visit rows in a new random order every epoch
+    unsigned seed = 0;     // seed for the shuffle
+    bool verbose = false;  // print loss and throughput after every epoch
+  };
+
+  // what happened during one epoch of Network::fit
+  struct EpochStats
+  {
+    int epoch = 0;
+    float loss = 0.0f; // mean RMSE over the batches, weighted by batch size
+    double seconds = 0.0;
+    double samplesPerSec = 0.0;
+  };
+
+  // what the graph planner made of a network for one batch size
+  struct PlanStats
+  {
+    int steps = 0;  // layers run after fusion
+    int fused = 0;  // activations folded into the preceding DenseLayer
+    int buffers = 0;
+    std::size_t activationBytes = 0; // held by the shared buffers
+    std::size_t unsharedBytes = 0;   // one tensor per layer output, as without planning
+  };
+
   class Network
   {
   private:
+    // the Dense layers in graph order; they own the parameters the other parts of the
+    // library (checkpoints, quantization, inference sessions) work on
     std::vector<DenseLayer> layers_;
 
+    // graph nodes in execution order, either a Dense layer (index into layers_) or an
+    // owned layer of any other kind
+    struct Node
+    {
+      int dense = -1;
+      std::unique_ptr<Layer> layer;
+    };
+    std::vector<Node> nodes_;
+
+    // node run by a step, with the activation node after it fused in if any
+    // value 0 is the network input, step k reads value k and writes value k + 1
+    struct Step
+    {
+      int node = 0;
+      Activation fused = Activation::None;
+      int width = 0; // output columns
+    };
+
+    // compiled form of the graph for a given input width; values that are dead
+    // share buffers, in training everything backward reads stays alive to the end
+    struct Plan
+    {
+      bool valid = false;
+      bool training = false;
+      int inputSize = 0;
+      std::vector<Step> steps;
+      std::vector<int> slot; // buffer of each value, -1 for the input and a returned output
+      std::vector<int> slotWidth;
+      std::vector<Tensor> buffers;
+      std::vector<TensorView> values; // views from the latest run
+    };
+    Plan trainPlan_;
+    Plan inferPlan_;
+
+    Layer &nodeLayer(const Node &node) { return node.dense >= 0 ? static_cast<Layer &>(layers_[node.dense]) : *node.layer; }
+
+    const Layer &nodeLayer(const Node &node) const { return node.dense >= 0 ? static_cast<const Layer &>(layers_[node.dense]) : *node.layer; }
+
+    // fuse Dense + activation pairs and assign values to buffers by liveness
+    Plan compile(int inputSize, bool training) const;
+
+    // sparseInput, if set, is the input and input only gives its shape
+    Tensor run(Plan &plan, const TensorView &input, bool training, const SparseTensor *sparseInput = nullptr);
+
+    void invalidatePlans();
+
+    // forward, backward and update on one batch, returns the batch RMSE
+    float trainBatch(const TensorView &x, const TensorView &y, const FitOptions &options);
+
+    // record and optionally print the stats of a finished epoch
+    EpochStats finishEpoch(int epoch, double lossSum, int nSamples, double seconds, bool verbose) const;
+
   public:
+    // trains on one batch and returns its RMSE
+    using BatchTrainer = std::function<float(const TensorView &x, const TensorView &y)>;
+
+    // called by backProp as soon as a Dense layer's gradients are final, last layer first
+    using GradientHook = std::function<void(DenseLayer &layer)>;
+
     // default constructor
     Network() = default;
 
-    // forwrard pass
-    Tensor forwardPass(const Tensor &input);
+    Network(const Network &other);
+    Network &operator=(const Network &other);
+    Network(Network &&) = default;
+    Network &operator=(Network &&) = default;
 
-    // backward propagation
-    Tensor backProp(const Tensor &dL_dY, const Tensor &lastInput);
+    // forwrard pass, keeps what backProp needs
+    Tensor forwardPass(const TensorView &input);
+
+    // inference only forward pass; intermediate results ping-pong between shared buffers
+    Tensor predict(const TensorView &input);
+
+    // forward passes on sparse input rows, which the first node, a Dense layer, takes
+    // without densifying them
+    Tensor forwardPass(const SparseTensor &input);
+
+    Tensor predict(const SparseTensor &input);
+
+    // backward propagation, lastInput is the input of the latest forwardPass
+    // with accumulate the gradients are added to the stored ones, so several
+    // micro-batches can make up one step; gradientsReady is called after each Dense layer
+    Tensor backProp(const Tensor &dL_dY, const TensorView &lastInput, bool accumulate = false,
+                    const GradientHook &gradientsReady = GradientHook());
+
+    // backProp after a forwardPass on sparse input: the first layer gets a row sparse
+    // weight gradient (see DenseLayer::dW) and no input gradient is formed, so the
+    // returned Tensor is empty
+    Tensor backProp(const Tensor &dL_dY, const SparseTensor &lastInput, bool accumulate = false,
+                    const GradientHook &gradientsReady = GradientHook());
+
+    // forward and backward over the rows of x, in slices of microBatchSize rows if set,
+    // leaving in the layers the gradients of the MSE of a batch of batchRows rows that x
+    // is part of; returns the squared error of x summed over rows (RMSE^2 * rows)
+    // gradientsReady is passed to the backProp of the last slice
+    double computeGradients(const TensorView &x, const TensorView &y, int microBatchSize, int batchRows,
+                            const GradientHook &gradientsReady = GradientHook());
+
+    // make every Dense layer read its parameters from the matching layer of owner, which
+    // must have the same structure and outlive this network; used for replicas that only
+    // keep their own gradients and activations
+    void shareParameters(const Network &owner);
 
     // add a new Layer to network
     void addLayer(const DenseLayer &layer);
 
-    // get network layers
-    std::vector<DenseLayer> getLayers() { return layers_; }
+    // add any other kind of layer, e.g. a ReLuLayer, as the next node of the graph
+    void addLayer(const Layer &layer);
+
+    // get the Dense layers (activations are not in this list)
+    std::vector<DenseLayer> &getLayers() { return layers_; }
+
+    const std::vector<DenseLayer> &getLayers() const { return layers_; }
+
+    // every node of the graph in order
+    int numNodes() const { return static_cast<int>(nodes_.size()); }
+
+    const Layer &node(int i) const { return nodeLayer(nodes_[i]); }
 
-    // update parameters for each layer
+    // activation node that directly follows Dense layer i, None if there is none
+    Activation activationAfter(int denseIndex) const;
+
+    // true if every non-Dense node is an activation right after a Dense layer, i.e. the
+    // network is fully described by its Dense layers plus activationAfter
+    bool activationsFoldIntoDense() const;
+
+    // how the planner runs this network for a batch of batchRows x inputSize
+    PlanStats planStats(int inputSize, int batchRows, bool training) const;
+
+    // one optimizer step for each layer from the gradients of the latest backProp;
+    // the optimizer state stays in the layers, so keep the config the same between steps
+    void step(const OptimizerConfig &optimizer, float lr);
+
+    // plain SGD step for each layer
     void updateParameters(float lr);
 
     void zeroGrad();
+
+    // train on rows of X with targets in the matching rows of Y using mini-batches
+    std::vector<EpochStats> fit(const Tensor &X, const Tensor &Y, const FitOptions &options = FitOptions());
+
+    // train on a streamed dataset, batch size and shuffling come from the loader; every
+    // epoch starts the loader over, wherever an earlier pass left it
+    std::vector<EpochStats> fit(BatchLoader &loader, const FitOptions &options = FitOptions());
+
+    // the epoch and batch loops of fit with every batch handed to train, e.g. a
+    // DataParallelTrainer; learning rate and optimizer are up to train
+    std::vector<EpochStats> fit(const Tensor &X, const Tensor &Y, const FitOptions &options, const BatchTrainer &train);
+
+    std::vector<EpochStats> fit(BatchLoader &loader, const FitOptions &options, const BatchTrainer &train);
+
+  private:
+    // both backProps, sparseInput set when the last forwardPass was on sparse input
+    Tensor backPropFrom(const Tensor &dL_dY, const TensorView &lastInput, const SparseTensor *sparseInput,
+                        bool accumulate, const GradientHook &gradientsReady);
   };
 
 } // myNN
 
-#endif
\ No newline at end of file
+#endif
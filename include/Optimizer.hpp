@@ -0,0 +1,68 @@
+#ifndef OPTIMIZER
+#define OPTIMIZER
+
+#include <cstddef>
+
+#include "Tensor.hpp"
+
+namespace myNN
+{
+
+  struct SparseRows;
+
+  enum class OptimizerKind
+  {
+    SGD,
+    Momentum, // SGD with (heavy ball) momentum
+    Adam,
+    AdamW // Adam with weight decay decoupled from the gradient
+  };
+
+  // hyperparameters of an update rule; the learning rate is passed to every step
+  // separately so it can follow a schedule
+  struct OptimizerConfig
+  {
+    OptimizerKind kind = OptimizerKind::SGD;
+    float momentum = 0.9f; // Momentum
+    float beta1 = 0.9f;    // Adam, AdamW
+    float beta2 = 0.999f;
+    float epsilon = 1e-8f;
+    float weightDecay = 0.0f; // L2 added to the gradient, decoupled for AdamW; never applied to biases
+    bool clearGradients = false; // zero the gradients in the same pass, for accumulating them between steps
+  };
+
+  // state kept next to one parameter tensor: the velocity for Momentum, the first and
+  // second moments for Adam and AdamW; empty until the first step that needs it
+  struct OptimizerState
+  {
+    Tensor m;
+    Tensor v;
+    OptimizerKind kind = OptimizerKind::SGD;
+    int steps = 0;
+
+    // drop the moments, e.g. after the parameters were replaced
+    void reset();
+  };
+
+  // update param in place from grad with one fused pass over the n values; the
+  // moments in state are allocated on first use and the pass runs on the thread pool
+  // weightDecay overrides config.weightDecay so biases can be left out
+  void optimizerStep(const OptimizerConfig &config, float lr, float weightDecay, float *param, float *grad,
+                     std::size_t n, OptimizerState &state);
+
+  // optimizerStep on a parameter tensor and its gradient, which must have the same size
+  void optimizerStep(const OptimizerConfig &config, float lr, float weightDecay, Tensor &param, Tensor &grad,
+                     OptimizerState &state);
+
+  // optimizerStep on the rows of param that grad stores, the others keep their values and
+  // moments (a lazy update, as for embeddings); Adam's bias correction still follows the
+  // number of steps taken on the whole tensor
+  void optimizerStep(const OptimizerConfig &config, float lr, float weightDecay, Tensor &param, SparseRows &grad,
+                     OptimizerState &state);
+
+  // name of the update kernel picked for this CPU
+  const char *optimizerKernelName();
+
+} // namespace myNN
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef PROFILER
+#define PROFILER
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace myNN
+{
+
+  // one timed call of an instrumented op
+  struct ProfileEvent
+  {
+    const char *name = "";
+    const char *category = ""; // "tensor", "layer" or "network"
+    int layer = -1;            // index of the Network layer being run, -1 outside of one
+    std::uint32_t thread = 0;
+    double startUs = 0.0; // since the profiler was created
+    double durationUs = 0.0;
+    double flops = 0.0;
+    double bytes = 0.0;          // bytes the op has to read and write at least once
+    std::size_t allocations = 0; // Tensor allocations made during the call
+  };
+
+  // events with the same layer and name added up
+  struct ProfileStats
+  {
+    std::string name;
+    int layer = -1;
+    long calls = 0;
+    double totalUs = 0.0;
+    double flops = 0.0;
+    double bytes = 0.0;
+    std::size_t allocations = 0;
+  };
+
+  // collects events from MYNN_PROFILE_SCOPE
+  // the scopes only exist when the library is built with MYNN_ENABLE_PROFILING (the
+  // MYNN_PROFILING CMake option); even then nothing is recorded until setEnabled(true),
+  // and a disabled scope costs one relaxed atomic load
+  class Profiler
+  {
+  private:
+    static std::atomic<bool> enabled_;
+
+    mutable std::mutex mutex_;
+    std::vector<ProfileEvent> events_;
+
+    Profiler() = default;
+
+  public:
+    static Profiler &instance();
+
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    void setEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+
+    void record(const ProfileEvent &event);
+
+    void clear();
+
+    std::vector<ProfileEvent> events() const;
+
+    // totals per layer and op, ordered by layer and then by time spent
+    std::vector<ProfileStats> summary() const;
+
+    // table of the summary with ms, GFLOP/s, GB/s and allocations
+    void printReport(std::ostream &out) const;
+
+    // write the events in the Chrome trace event format (chrome://tracing, Perfetto)
+    void writeChromeTrace(const std::string &path) const;
+  };
+
+  // times the enclosing block when the profiler is enabled
+  class ProfileScope
+  {
+  private:
+    ProfileEvent event_;
+    std::size_t requestsBefore_ = 0;
+    bool active_ = false;
+
+  public:
+    ProfileScope(const char *name, const char *category, double flops = 0.0, double bytes = 0.0);
+    ~ProfileScope();
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+  };
+
+  // marks the ops on this thread as belonging to a Network layer until the end of the block
+  class ProfileLayer
+  {
+  private:
+    int previous_;
+
+  public:
+    explicit ProfileLayer(int layer);
+    ~ProfileLayer();
+    ProfileLayer(const ProfileLayer &) = delete;
+    ProfileLayer &operator=(const ProfileLayer &) = delete;
+  };
+
+} // namespace myNN
+
+#define MYNN_PROFILE_CONCAT_(a, b) a##b
+#define MYNN_PROFILE_CONCAT(a, b) MYNN_PROFILE_CONCAT_(a, b)
+
+#ifdef MYNN_ENABLE_PROFILING
+#define MYNN_PROFILE_SCOPE(...) myNN::ProfileScope MYNN_PROFILE_CONCAT(mynnProfileScope_, __LINE__)(__VA_ARGS__)
+#define MYNN_PROFILE_LAYER(index) myNN::ProfileLayer MYNN_PROFILE_CONCAT(mynnProfileLayer_, __LINE__)(static_cast<int>(index))
+#else
+// compiled out: the arguments are not even evaluated
+#define MYNN_PROFILE_SCOPE(...) ((void)0)
+#define MYNN_PROFILE_LAYER(index) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef QUANTIZED
+#define QUANTIZED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Network.hpp"
+
+namespace myNN
+{
+
+  // C (M x N, int32) = A (M x K, int8, row-major) * B^T where B is N x K int8, row-major
+  // rows of A and B are stored with a stride of Kp = roundUpK(K) bytes and zero padded
+  // bRowSums holds the sum of each row of B and is used by the VNNI kernel
+  void qgemm(int M, int N, int Kp,
+             const std::int8_t *A, const std::int8_t *B, const std::int32_t *bRowSums,
+             std::int32_t *C);
+
+  // K rounded up to the int8 kernels' step
+  int roundUpK(int K);
+
+  // name of the int8 kernel picked for this CPU
+  const char *qgemmKernelName();
+
+  // names of every int8 kernel this CPU can run, the picked one first
+  std::vector<std::string> qgemmKernelNames();
+
+  // qgemm with the named kernel rather than the picked one, e.g. to check the kernels
+  // against each other; throws if this CPU cannot run it
+  void qgemmWith(const char *kernelName, int M, int N, int Kp,
+                 const std::int8_t *A, const std::int8_t *B, const std::int32_t *bRowSums,
+                 std::int32_t *C);
+
+  // Dense layer with int8 weights and one fp32 scale per output channel
+  struct QuantizedDense
+  {
+    int nInputs = 0;
+    int nOutputs = 0;
+    int paddedInputs = 0;               // nInputs rounded up for the kernels
+    std::vector<std::int8_t> weights;   // nOutputs x paddedInputs, i.e. w^T
+    std::vector<std::int32_t> rowSums;  // per output channel sum of the int8 weights
+    std::vector<float> scales;          // per output channel weight scale
+    std::vector<float> bias;
+    float inputScale = 0.0f; // calibrated activation scale, 0 means compute per batch
+    Activation activation = Activation::None;
+
+    // post-training quantization of a trained layer
+    explicit QuantizedDense(const DenseLayer &layer, Activation activation = Activation::None);
+  };
+
+  // how far the quantized outputs are from the fp32 ones
+  struct QuantizationError
+  {
+    float maxAbs = 0.0f;
+    float rms = 0.0f;
+    float relativeRms = 0.0f; // rms error divided by the rms of the fp32 output
+  };
+
+  // int8 copy of a trained Network for serving
+  class QuantizedNetwork
+  {
+  private:
+    std::vector<QuantizedDense> layers_;
+
+  public:
+    explicit QuantizedNetwork(const Network &net);
+
+    int numLayers() const { return static_cast<int>(layers_.size()); }
+
+    const QuantizedDense &layer(int i) const { return layers_[i]; }
+
+    // fix each layer's activation scale from the ranges seen when running samples
+    // through the fp32 network, instead of measuring every batch
+    void calibrate(const Network &net, const TensorView &samples);
+
+    // back to per-batch (dynamic) activation scales
+    void clearCalibration();
+
+    Tensor forward(const TensorView &input) const;
+
+    // error of forward against the fp32 forwardPass of net on held out inputs
+    QuantizationError compare(Network &net, const TensorView &heldOut) const;
+
+    // bytes of int8 weights plus scales and biases
+    std::size_t weightBytes() const;
+  };
+
+} // namespace myNN
+
+#endif
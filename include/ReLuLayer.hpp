@@ -11,8 +11,14 @@ namespace myNN
   public:
     Tensor forward(const Tensor &x) override;
     Tensor backward(const Tensor &dOut) override;
+
+    std::unique_ptr<Layer> clone() const override;
+    const char *name() const override { return "relu"; }
+    Activation activation() const override { return Activation::ReLU; }
+    void forwardInto(const TensorView &input, float *out) const override;
+    Tensor backwardFrom(const Tensor &dOut, const TensorView &input, const TensorView &output, bool accumulate) override;
   };
 
 }
 
-#endif
\ No newline at end of file
+#endif
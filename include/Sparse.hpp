@@ -0,0 +1,126 @@
+#ifndef SPARSE
+#define SPARSE
+
+#include <cstddef>
+#include <vector>
+
+#include "Allocator.hpp"
+#include "Gemm.hpp"
+#include "Tensor.hpp"
+#include "TensorView.hpp"
+
+namespace myNN
+{
+
+  // 2D fp32 matrix in compressed sparse row form: the nonzeros of row i are values()[p]
+  // at column colIndex()[p] for p in [rowStart()[i], rowStart()[i + 1])
+  class SparseTensor
+  {
+  public:
+    using Values = std::vector<float, TensorAllocator<float>>;
+    using Indices = std::vector<int, TensorAllocator<int>>;
+
+  private:
+    int rows_ = 0;
+    int cols_ = 0;
+    Indices rowStart_;
+    Indices colIndex_;
+    Values values_;
+
+  public:
+    SparseTensor() = default;
+
+    // the nonzero elements of src
+    explicit SparseTensor(const TensorView &src);
+
+    // take the values at the stored positions from src, which must have the same shape;
+    // elements of src outside the pattern are ignored
+    void assign(const TensorView &src);
+
+    // write the whole matrix, zeros included, to dense[i * rowStride + j * colStride]
+    void toDense(float *dense, int rowStride, int colStride) const;
+
+    Tensor toDense() const;
+
+    int rows() const { return rows_; }
+
+    int cols() const { return cols_; }
+
+    int nnz() const { return static_cast<int>(values_.size()); }
+
+    // fraction of the elements that are stored
+    double density() const { return rows_ * cols_ > 0 ? static_cast<double>(nnz()) / (static_cast<double>(rows_) * cols_) : 0.0; }
+
+    const int *rowStart() const { return rowStart_.data(); }
+
+    const int *colIndex() const { return colIndex_.data(); }
+
+    const float *values() const { return values_.data(); }
+
+    // values plus both index arrays
+    std::size_t bytes() const
+    {
+      return values_.size() * sizeof(float) + (rowStart_.size() + colIndex_.size()) * sizeof(int);
+    }
+  };
+
+  // matrix of totalRows rows of which only the listed ones are stored: row rows[r] is row
+  // r of values, every other row is zero; e.g. the weight gradient of a layer fed sparse
+  // inputs, where only the weights of features that occurred get a gradient
+  struct SparseRows
+  {
+    int totalRows = 0;
+    std::vector<int> rows; // ascending
+    Tensor values;         // rows.size() x cols
+  };
+
+  // zero the sparsity fraction of t's elements with the smallest magnitude, exactly
+  // sparsity * size of them, rounded; returns the magnitude of the largest zeroed element
+  float pruneByMagnitude(Tensor &t, float sparsity);
+
+  // working memory of sparseMatMulTranspose, planned up front so that repeated calls
+  // allocate nothing, e.g. in an InferenceSession
+  struct SparseScratch
+  {
+    Tensor transposed; // A^T when A is not stored column by column
+    Tensor products;   // plain sums of a block of outputs, one tile per parallel range
+
+    // grow the buffers for A of up to rows x k and B of n rows, never shrinks
+    void reserve(int rows, int k, int n);
+
+    std::size_t bytes() const { return (transposed.size() + products.size()) * sizeof(float); }
+  };
+
+  // C = A * B^T with B sparse, A is M x K, B is N x K and C is M x N; the epilogue is
+  // applied as for gemm. A dense layer keeps its K x N weights as this B, one sparse row
+  // per output, so only the stored weights are multiplied
+  // without scratch, or with one too small, the working memory is allocated per call
+  void sparseMatMulTranspose(const TensorView &a, const SparseTensor &b, float *c, int ldc,
+                             const GemmEpilogue &epilogue = GemmEpilogue(), SparseScratch *scratch = nullptr);
+
+  // a * b^T
+  Tensor matMulTranspose(const TensorView &a, const SparseTensor &b);
+
+  // a * b, e.g. dX = dY * W^T from the same transposed weights
+  Tensor matMul(const TensorView &a, const SparseTensor &b);
+
+  // C = A * B with A sparse, A is M x K, B is K x N and C is M x N; every stored element
+  // of A scales a row of B into a row of C, so an input with a few nonzeros per row only
+  // reads the matching rows of the weights
+  void sparseMatMul(const SparseTensor &a, const TensorView &b, float *c, int ldc,
+                    const GemmEpilogue &epilogue = GemmEpilogue());
+
+  // a * b
+  Tensor matMul(const SparseTensor &a, const TensorView &b);
+
+  // A^T * B into out, A sparse M x K and B dense M x N: only the rows of the result for
+  // columns that A uses are stored; with accumulate the result is added to out, whose
+  // rows are merged with the new ones
+  void transposeMatMulInto(const SparseTensor &a, const TensorView &b, SparseRows &out, bool accumulate = false);
+
+  // name of the sparse kernels picked for this CPU
+  const char *sparseKernelName();
+
+} // namespace myNN
+
+#endif
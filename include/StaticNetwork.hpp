@@ -0,0 +1,194 @@
+#ifndef STATIC_NETWORK
+#define STATIC_NETWORK
+
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#include "Network.hpp"
+
+namespace myNN
+{
+
+  // Dense layer with its shape fixed at compile time, for tiny models where the shape
+  // checks and heap storage of Tensor cost more than the arithmetic
+  // every loop has constant bounds, so the compiler can unroll and vectorise fully
+  template <int In, int Out, Activation Act = Activation::None>
+  class StaticDense
+  {
+    static_assert(In > 0 && Out > 0, "StaticDense needs positive dimensions");
+
+  public:
+    static constexpr int inputs = In;
+    static constexpr int outputs = Out;
+    static constexpr Activation activation = Act;
+
+  private:
+    // row-major In x Out like DenseLayer, so the inner loop runs over contiguous outputs
+    alignas(TENSOR_ALIGNMENT) std::array<float, In * Out> w_{};
+    alignas(TENSOR_ALIGNMENT) std::array<float, Out> b_{};
+
+  public:
+    StaticDense() = default;
+
+    // copy the parameters of a trained layer, throws if its shape is not In x Out
+    explicit StaticDense(const DenseLayer &layer)
+    {
+      const Tensor &w = layer.getWeights();
+      const Tensor &b = layer.getBias();
+      if (w.getShape()[0] != In || w.getShape()[1] != Out || b.size() != Out)
+        throw std::runtime_error("layer shape does not match StaticDense");
+
+      for (int i = 0; i < In * Out; i++)
+        w_[i] = w[i];
+      for (int j = 0; j < Out; j++)
+        b_[j] = b[j];
+    }
+
+    std::array<float, In * Out> &weights() { return w_; }
+
+    const std::array<float, In * Out> &weights() const { return w_; }
+
+    std::array<float, Out> &bias() { return b_; }
+
+    const std::array<float, Out> &bias() const { return b_; }
+
+    // y = act(x * w + b) for one sample, x holds In floats and y Out floats
+    void forward(const float *x, float *y) const
+    {
+      std::array<float, Out> acc = b_;
+      for (int k = 0; k < In; k++)
+      {
+        float xk = x[k];
+        const float *wk = w_.data() + k * Out;
+        for (int j = 0; j < Out; j++)
+          acc[j] += xk * wk[j];
+      }
+
+      for (int j = 0; j < Out; j++)
+      {
+        float v = acc[j];
+        if constexpr (Act == Activation::ReLU)
+          v = v > 0.0f ? v : 0.0f;
+        y[j] = v;
+      }
+    }
+
+    std::array<float, Out> forward(const std::array<float, In> &x) const
+    {
+      std::array<float, Out> y;
+      forward(x.data(), y.data());
+      return y;
+    }
+  };
+
+  // chain of StaticDense layers; the output width of each layer must match the input
+  // width of the next, which is checked at compile time
+  template <typename... Layers>
+  class StaticNetwork
+  {
+    static_assert(sizeof...(Layers) > 0, "StaticNetwork needs at least one layer");
+
+    using LayerTuple = std::tuple<Layers...>;
+
+    template <std::size_t I>
+    using LayerAt = std::tuple_element_t<I, LayerTuple>;
+
+    static constexpr std::size_t nLayers = sizeof...(Layers);
+
+    template <std::size_t... I>
+    static constexpr bool chained(std::index_sequence<I...>)
+    {
+      return ((LayerAt<I>::outputs == LayerAt<I + 1>::inputs) && ...);
+    }
+
+    static_assert(chained(std::make_index_sequence<nLayers - 1>()), "StaticNetwork layer widths do not chain");
+
+  public:
+    static constexpr int inputs = LayerAt<0>::inputs;
+    static constexpr int outputs = LayerAt<nLayers - 1>::outputs;
+
+    using Input = std::array<float, inputs>;
+    using Output = std::array<float, outputs>;
+
+  private:
+    LayerTuple layers_;
+
+    template <std::size_t... I>
+    static bool activationsMatch(const Network &net, std::index_sequence<I...>)
+    {
+      return ((net.activationAfter(static_cast<int>(I)) == LayerAt<I>::activation) && ...);
+    }
+
+    static const std::vector<DenseLayer> &checkedLayers(const Network &net)
+    {
+      if (net.getLayers().size() != nLayers)
+        throw std::runtime_error("network depth does not match StaticNetwork");
+      if (!net.activationsFoldIntoDense() || !activationsMatch(net, std::index_sequence_for<Layers...>()))
+        throw std::runtime_error("network activations do not match StaticNetwork");
+      return net.getLayers();
+    }
+
+    template <std::size_t... I>
+    static LayerTuple fromLayers(const std::vector<DenseLayer> &layers, std::index_sequence<I...>)
+    {
+      return LayerTuple(Layers(layers[I])...);
+    }
+
+    // intermediate activations live in std::arrays on the stack
+    template <std::size_t I>
+    void run(const float *x, float *y) const
+    {
+      if constexpr (I + 1 == nLayers)
+      {
+        std::get<I>(layers_).forward(x, y);
+      }
+      else
+      {
+        std::array<float, LayerAt<I>::outputs> hidden;
+        std::get<I>(layers_).forward(x, hidden.data());
+        run<I + 1>(hidden.data(), y);
+      }
+    }
+
+  public:
+    StaticNetwork() = default;
+
+    // copy a trained dynamic Network, throws if its depth, activations or any layer
+    // shape differ
+    explicit StaticNetwork(const Network &net)
+        : layers_(fromLayers(checkedLayers(net), std::index_sequence_for<Layers...>()))
+    {
+    }
+
+    template <std::size_t I>
+    LayerAt<I> &layer() { return std::get<I>(layers_); }
+
+    template <std::size_t I>
+    const LayerAt<I> &layer() const { return std::get<I>(layers_); }
+
+    void forward(const float *x, float *y) const
+    {
+      run<0>(x, y);
+    }
+
+    Output forward(const Input &x) const
+    {
+      Output y;
+      run<0>(x.data(), y.data());
+      return y;
+    }
+
+    // rows samples stored one after another, inputs and outputs floats each
+    void forwardBatch(const float *x, float *y, int rows) const
+    {
+      for (int i = 0; i < rows; i++)
+        run<0>(x + static_cast<std::size_t>(i) * inputs, y + static_cast<std::size_t>(i) * outputs);
+    }
+  };
+
+} // namespace myNN
+
+#endif
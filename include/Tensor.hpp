@@ -4,26 +4,47 @@
 #include <vector>
 #include <iostream>
 
+#include "Allocator.hpp"
+#include "Gemm.hpp"
+#include "TensorView.hpp"
+#include "ThreadPool.hpp"
+
 namespace myNN
 {
 
   class Tensor
   {
+  public:
+    // aligned storage drawn from the current default Allocator
+    using Storage = std::vector<float, TensorAllocator<float>>;
+
   private:
-    std::vector<float> data_;
+    Storage data_;
     std::vector<int> shape_;
 
   public:
+    // empty 0x0 tensor, e.g. for layers that cache their input
+    Tensor() : shape_{0, 0} {}
+
     // constructor with only shape, initialise with 0.0f or specify value
     Tensor(const std::vector<int> &shape, float value = 0.0f);
 
     // constructor from 1D vector and shape vector
     Tensor(const std::vector<float> &data, const std::vector<int> &shape);
 
+    // copy the elements of a view into a new row-major tensor
+    explicit Tensor(const TensorView &view);
+
     // for 1D
     Tensor(const std::vector<float> &data, int dim)
-        : data_(data), shape_{dim,
-                              1} {}
+        : data_(data.begin(), data.end()), shape_{dim,
+                                                  1} {}
+
+    // view of the whole tensor, e.g. to slice rows or transpose without copying
+    TensorView view() const;
+
+    // raw pointer to the row-major data
+    const float *data() const { return data_.data(); }
 
     // get number of total elements
     int size() const;
@@ -50,7 +71,7 @@ namespace myNN
     void print() const;
 
     // fill tensor with value a
-    void fill(float a) { std::fill(data_.begin(), data_.end(), a); }
+    void fill(float a);
 
     // fill tensor with zeros
     void zeros()
@@ -98,21 +119,32 @@ namespace myNN
     float mean() const;
 
     // return matMul of this and other
-    Tensor matMul(const Tensor &other) const;
+    Tensor matMul(const TensorView &other) const;
+
+    // return activation(this * other + bias) in a single pass, bias is a (1, N) row
+    Tensor matMulBias(const TensorView &other, const TensorView &bias, Activation activation = Activation::None) const;
+
+    // return this^T * other without materialising the transpose
+    Tensor transposeMatMul(const TensorView &other) const;
+
+    // return this * other^T without materialising the transpose
+    Tensor matMulTranspose(const TensorView &other) const;
 
     // return transposed tensor
     Tensor transpose() const;
 
-    // apply function to tensor
+    // apply function to tensor; above the pool's serial threshold func is called from
+    // several threads at once on different elements, so it must be safe to call
+    // concurrently: no rand() or other shared state, loop over getData() for those
     template <typename F>
     void apply(F func);
 
     // add broadcast option for adding vectors to rows or columns, and scalar to everything
-    Tensor addBroadcast(const Tensor &other) const;
+    Tensor addBroadcast(const TensorView &other) const;
 
     // probably we should return only references, right?
     //  return tensor data
-    std::vector<float> &getData() { return data_; }
+    Storage &getData() { return data_; }
 
     // return tensor shape
     const std::vector<int> &getShape() const { return shape_; }
@@ -123,13 +155,77 @@ namespace myNN
     void zeroGrad();
   };
 
-  template <typename F>
-  void Tensor::apply(F func)
+  // widest vector ISA the elementwise kernels were compiled for that this CPU has,
+  // checked once; SSE2 is the x86-64 baseline, so Portable means another architecture
+  enum class SimdLevel
+  {
+    Portable,
+    SSE2,
+    AVX2,
+    AVX512
+  };
+
+  SimdLevel simdLevel();
+
+  // name of the elementwise and reduction kernels picked for this CPU
+  const char *tensorKernelName();
+
+  namespace detail
   {
-    for (float &x : data_)
+    template <typename F>
+    inline __attribute__((always_inline)) void applyRange(float *data, int n, F &func)
     {
-      x = func(x);
+      for (int i = 0; i < n; i++)
+        data[i] = func(data[i]);
     }
+
+    template <typename F>
+    void applyPortable(float *data, int n, F &func) { applyRange(data, n, func); }
+
+#if defined(__x86_64__) || defined(__i386__)
+    // the same loop compiled for wider vectors; func is inlined into each, so a simple
+    // functor is vectorised at the width of the CPU rather than of the build
+    template <typename F>
+    __attribute__((target("avx2,fma"))) void applyAvx2(float *data, int n, F &func) { applyRange(data, n, func); }
+
+    template <typename F>
+    __attribute__((target("avx512f"))) void applyAvx512(float *data, int n, F &func) { applyRange(data, n, func); }
+#endif
+  } // namespace detail
+
+  // view based kernels, Tensors convert to views implicitly
+
+  // return a * b
+  Tensor matMul(const TensorView &a, const TensorView &b);
+
+  // return activation(a * b + bias) in a single pass, bias is a (1, N) row
+  Tensor matMulBias(const TensorView &a, const TensorView &b, const TensorView &bias, Activation activation = Activation::None);
+
+  // return sum over rows
+  Tensor sumRows(const TensorView &t);
+
+  // c = alpha * a * b + beta * c into an existing M x N tensor, nothing is allocated
+  // beta = 1 accumulates, e.g. gradients over several micro-batches
+  void matMulInto(const TensorView &a, const TensorView &b, Tensor &c, float alpha = 1.0f, float beta = 0.0f);
+
+  // out = alpha * sumRows(t) + beta * out into an existing (1, N) tensor
+  void sumRowsInto(const TensorView &t, Tensor &out, float alpha = 1.0f, float beta = 0.0f);
+
+  template <typename F>
+  void Tensor::apply(F func)
+  {
+    [[maybe_unused]] SimdLevel level = simdLevel();
+    float *data = data_.data();
+    parallelFor(0, size(), size(), [&](int lo, int hi)
+                {
+#if defined(__x86_64__) || defined(__i386__)
+                  if (level == SimdLevel::AVX512)
+                    return detail::applyAvx512(data + lo, hi - lo, func);
+                  if (level == SimdLevel::AVX2)
+                    return detail::applyAvx2(data + lo, hi - lo, func);
+#endif
+                  detail::applyPortable(data + lo, hi - lo, func);
+                });
   }
 
 } // namespace myNN
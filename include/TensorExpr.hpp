@@ -0,0 +1,294 @@
+#ifndef TENSOR_EXPR
+#define TENSOR_EXPR
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "Tensor.hpp"
+#include "ThreadPool.hpp"
+
+namespace myNN
+{
+
+  // lazy elementwise expressions over Tensors
+  // lazy(a) - lazy(b) builds a small tree instead of a temporary; the tree is only
+  // walked when it is evaluated or reduced, in one loop with no intermediate tensors
+  //   float loss = mean(square(lazy(pred) - lazy(target)));
+  //   Tensor grad = eval((lazy(pred) - lazy(target)) * 2.0f);
+  // the Tensors referenced by an expression must outlive it
+
+  template <typename E>
+  struct TensorExpr
+  {
+    const E &self() const { return static_cast<const E &>(*this); }
+
+    float operator[](int i) const { return self()[i]; }
+
+    int rows() const { return self().rows(); }
+
+    int cols() const { return self().cols(); }
+
+    int size() const { return rows() * cols(); }
+  };
+
+  // leaf referencing a tensor's data
+  class TensorRef : public TensorExpr<TensorRef>
+  {
+  private:
+    const float *data_;
+    int rows_;
+    int cols_;
+
+  public:
+    explicit TensorRef(const Tensor &t) : data_(t.data()), rows_(t.getShape()[0]), cols_(t.getShape()[1]) {}
+
+    explicit TensorRef(const TensorView &v) : data_(v.data()), rows_(v.rows()), cols_(v.cols())
+    {
+      if (!v.isContiguous())
+      {
+        throw std::runtime_error("lazy needs a contiguous view");
+      }
+    }
+
+    float operator[](int i) const { return data_[i]; }
+
+    int rows() const { return rows_; }
+
+    int cols() const { return cols_; }
+  };
+
+  // elementwise combination of two expressions
+  template <typename L, typename R, typename Op>
+  class BinaryExpr : public TensorExpr<BinaryExpr<L, R, Op>>
+  {
+  private:
+    L left_;
+    R right_;
+
+  public:
+    BinaryExpr(const L &left, const R &right) : left_(left), right_(right)
+    {
+      if (left.rows() != right.rows() || left.cols() != right.cols())
+      {
+        throw std::runtime_error("Expression shapes not compatible");
+      }
+    }
+
+    float operator[](int i) const { return Op::apply(left_[i], right_[i]); }
+
+    int rows() const { return left_.rows(); }
+
+    int cols() const { return left_.cols(); }
+  };
+
+  // expression combined with a scalar on the right
+  template <typename E, typename Op>
+  class ScalarExpr : public TensorExpr<ScalarExpr<E, Op>>
+  {
+  private:
+    E expr_;
+    float scalar_;
+
+  public:
+    ScalarExpr(const E &expr, float scalar) : expr_(expr), scalar_(scalar) {}
+
+    float operator[](int i) const { return Op::apply(expr_[i], scalar_); }
+
+    int rows() const { return expr_.rows(); }
+
+    int cols() const { return expr_.cols(); }
+  };
+
+  // function applied to every element of an expression
+  template <typename E, typename F>
+  class MapExpr : public TensorExpr<MapExpr<E, F>>
+  {
+  private:
+    E expr_;
+    F func_;
+
+  public:
+    MapExpr(const E &expr, F func) : expr_(expr), func_(func) {}
+
+    float operator[](int i) const { return func_(expr_[i]); }
+
+    int rows() const { return expr_.rows(); }
+
+    int cols() const { return expr_.cols(); }
+  };
+
+  struct AddOp
+  {
+    static float apply(float a, float b) { return a + b; }
+  };
+
+  struct SubOp
+  {
+    static float apply(float a, float b) { return a - b; }
+  };
+
+  struct MulOp
+  {
+    static float apply(float a, float b) { return a * b; }
+  };
+
+  struct DivOp
+  {
+    static float apply(float a, float b) { return a / b; }
+  };
+
+  struct SquareFn
+  {
+    float operator()(float x) const { return x * x; }
+  };
+
+  // start an expression from a tensor
+  inline TensorRef lazy(const Tensor &t)
+  {
+    return TensorRef(t);
+  }
+
+  // start an expression from a contiguous view, e.g. a row slice
+  inline TensorRef lazy(const TensorView &v)
+  {
+    return TensorRef(v);
+  }
+
+  template <typename L, typename R>
+  BinaryExpr<L, R, AddOp> operator+(const TensorExpr<L> &a, const TensorExpr<R> &b)
+  {
+    return BinaryExpr<L, R, AddOp>(a.self(), b.self());
+  }
+
+  template <typename L, typename R>
+  BinaryExpr<L, R, SubOp> operator-(const TensorExpr<L> &a, const TensorExpr<R> &b)
+  {
+    return BinaryExpr<L, R, SubOp>(a.self(), b.self());
+  }
+
+  // elementwise product
+  template <typename L, typename R>
+  BinaryExpr<L, R, MulOp> operator*(const TensorExpr<L> &a, const TensorExpr<R> &b)
+  {
+    return BinaryExpr<L, R, MulOp>(a.self(), b.self());
+  }
+
+  template <typename E>
+  ScalarExpr<E, AddOp> operator+(const TensorExpr<E> &a, float s)
+  {
+    return ScalarExpr<E, AddOp>(a.self(), s);
+  }
+
+  template <typename E>
+  ScalarExpr<E, SubOp> operator-(const TensorExpr<E> &a, float s)
+  {
+    return ScalarExpr<E, SubOp>(a.self(), s);
+  }
+
+  template <typename E>
+  ScalarExpr<E, MulOp> operator*(const TensorExpr<E> &a, float s)
+  {
+    return ScalarExpr<E, MulOp>(a.self(), s);
+  }
+
+  template <typename E>
+  ScalarExpr<E, MulOp> operator*(float s, const TensorExpr<E> &a)
+  {
+    return ScalarExpr<E, MulOp>(a.self(), s);
+  }
+
+  template <typename E>
+  ScalarExpr<E, DivOp> operator/(const TensorExpr<E> &a, float s)
+  {
+    return ScalarExpr<E, DivOp>(a.self(), s);
+  }
+
+  template <typename E>
+  MapExpr<E, SquareFn> square(const TensorExpr<E> &a)
+  {
+    return MapExpr<E, SquareFn>(a.self(), SquareFn());
+  }
+
+  // lazily apply func to every element
+  template <typename E, typename F>
+  MapExpr<E, F> map(const TensorExpr<E> &a, F func)
+  {
+    return MapExpr<E, F>(a.self(), func);
+  }
+
+  // write the expression into an existing tensor of the same size, no allocation
+  template <typename E>
+  void assign(Tensor &out, const TensorExpr<E> &e)
+  {
+    if (out.size() != e.size())
+    {
+      throw std::runtime_error("Expression shapes not compatible");
+    }
+    const E &expr = e.self();
+    float *dst = out.getData().data();
+    parallelFor(0, expr.size(), expr.size(), [&](int lo, int hi)
+                {
+                  for (int i = lo; i < hi; i++)
+                    dst[i] = expr[i];
+                });
+  }
+
+  // evaluate the expression into a new tensor in a single pass
+  template <typename E>
+  Tensor eval(const TensorExpr<E> &e)
+  {
+    Tensor out({e.rows(), e.cols()});
+    assign(out, e);
+    return out;
+  }
+
+  // elements per partial sum in sum(); the blocks do not depend on the pool and their
+  // sums are added in order, so the result is the same for any number of threads
+  constexpr int EXPR_SUM_BLOCK = 4096;
+
+  // blocks summed per parallel round, their partial sums live on the stack
+  constexpr int EXPR_SUM_ROUND = 64;
+
+  // sum of all elements of the expression without materialising it
+  template <typename E>
+  float sum(const TensorExpr<E> &e)
+  {
+    const E &expr = e.self();
+    int n = expr.size();
+    int nBlocks = (n + EXPR_SUM_BLOCK - 1) / EXPR_SUM_BLOCK;
+
+    float total = 0.0f;
+    for (int first = 0; first < nBlocks; first += EXPR_SUM_ROUND)
+    {
+      int count = std::min(EXPR_SUM_ROUND, nBlocks - first);
+      int begin = first * EXPR_SUM_BLOCK;
+      int end = std::min(n, (first + count) * EXPR_SUM_BLOCK);
+      float partial[EXPR_SUM_ROUND];
+      parallelFor(0, count, static_cast<std::size_t>(end - begin), [&](int lo, int hi)
+                  {
+                    for (int b = lo; b < hi; b++)
+                    {
+                      int blockEnd = std::min(end, begin + (b + 1) * EXPR_SUM_BLOCK);
+                      float s = 0.0f;
+                      for (int i = begin + b * EXPR_SUM_BLOCK; i < blockEnd; i++)
+                        s += expr[i];
+                      partial[b] = s;
+                    }
+                  });
+
+      for (int b = 0; b < count; b++)
+        total += partial[b];
+    }
+    return total;
+  }
+
+  // mean of all elements of the expression without materialising it
+  template <typename E>
+  float mean(const TensorExpr<E> &e)
+  {
+    return sum(e) / e.size();
+  }
+
+} // namespace myNN
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef TENSOR_VIEW
+#define TENSOR_VIEW
+
+namespace myNN
+{
+
+  class Tensor;
+
+  // non-owning, read-only 2D window onto Tensor data
+  // element (i, j) lives at data[i * rowStride + j * colStride], so row slices,
+  // transposes and reshapes are just different offsets and strides on the same buffer
+  // the viewed Tensor must outlive the view and must not be resized while it is used
+  class TensorView
+  {
+  private:
+    const float *data_;
+    int rows_;
+    int cols_;
+    int rowStride_;
+    int colStride_;
+
+  public:
+    // view of raw row-major or strided memory
+    TensorView(const float *data, int rows, int cols, int rowStride, int colStride)
+        : data_(data), rows_(rows), cols_(cols), rowStride_(rowStride), colStride_(colStride) {}
+
+    // view of a whole tensor, implicit so kernels taking views also take Tensors
+    TensorView(const Tensor &t);
+
+    const float *data() const { return data_; }
+
+    int rows() const { return rows_; }
+
+    int cols() const { return cols_; }
+
+    int size() const { return rows_ * cols_; }
+
+    int rowStride() const { return rowStride_; }
+
+    int colStride() const { return colStride_; }
+
+    // element at row i, column j
+    float operator()(int i, int j) const { return data_[i * rowStride_ + j * colStride_]; }
+
+    // rows [begin, end), e.g. a mini-batch out of a dataset
+    TensorView rowSlice(int begin, int end) const
+    {
+      return TensorView(data_ + begin * rowStride_, end - begin, cols_, rowStride_, colStride_);
+    }
+
+    // transposed view, no data is moved
+    TensorView transpose() const { return TensorView(data_, cols_, rows_, colStride_, rowStride_); }
+
+    // true if rows are packed back to back in memory
+    bool isContiguous() const { return colStride_ == 1 && (rowStride_ == cols_ || rows_ <= 1); }
+
+    // same data with a new shape, only valid for contiguous views
+    TensorView reshape(int rows, int cols) const;
+  };
+
+} // namespace myNN
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef THREAD_POOL
+#define THREAD_POOL
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace myNN
+{
+
+  class Allocator;
+
+  // library wide pool of worker threads used by the Tensor kernels
+  class ThreadPool
+  {
+  private:
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+
+    // current job, split into nChunks_ pieces that workers grab in order
+    const std::function<void(int)> *job_ = nullptr;
+    int nChunks_ = 0;
+    int nextChunk_ = 0;
+    int pendingChunks_ = 0;
+    unsigned long generation_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_; // first exception thrown by a chunk of the current job
+    Allocator *jobAllocator_ = nullptr; // default allocator of the thread that started the job
+
+    // written by setNumThreads while other threads may read it in parallelFor
+    std::atomic<int> nThreads_{1};
+    std::size_t serialThreshold_ = 1 << 16;
+
+    // serialises callers so only one job is in flight at a time
+    std::mutex submitMutex_;
+
+    ThreadPool();
+    void startWorkers(int nThreads);
+    void stopWorkers();
+    void workerLoop();
+    bool runChunk(std::unique_lock<std::mutex> &lock);
+
+  public:
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // the shared pool, sized from MYNN_NUM_THREADS or the number of cores
+    static ThreadPool &instance();
+
+    // number of threads taking part in a job, including the caller
+    int numThreads() const { return nThreads_; }
+
+    // resize the pool, n <= 0 means one thread per core
+    void setNumThreads(int n);
+
+    // jobs with less estimated work than this run on the calling thread
+    std::size_t serialThreshold() const { return serialThreshold_; }
+
+    void setSerialThreshold(std::size_t work) { serialThreshold_ = work; }
+
+    // run fn(chunk) for chunk in [0, nChunks) on the pool and wait for all of them
+    // if a chunk throws, the chunks not started yet are skipped and the first exception
+    // is rethrown here once every running chunk has finished
+    void run(int nChunks, const std::function<void(int)> &fn);
+
+    // true when called from inside a pool job
+    static bool inParallelRegion();
+  };
+
+  // split [begin, end) into contiguous ranges and call fn(rangeBegin, rangeEnd) on the pool
+  // work is the estimated cost of the whole loop (e.g. elements touched), small loops stay serial
+  template <typename F>
+  void parallelFor(int begin, int end, std::size_t work, F &&fn)
+  {
+    int n = end - begin;
+    if (n <= 0)
+      return;
+
+    ThreadPool &pool = ThreadPool::instance();
+    int nThreads = pool.numThreads();
+    if (nThreads <= 1 || n == 1 || work < pool.serialThreshold() || ThreadPool::inParallelRegion())
+    {
+      fn(begin, end);
+      return;
+    }
+
+    // never hand out chunks with less than a threshold worth of work
+    std::size_t maxChunks = work / pool.serialThreshold();
+    int nChunks = nThreads;
+    if (maxChunks < static_cast<std::size_t>(nChunks))
+      nChunks = static_cast<int>(maxChunks);
+    if (nChunks > n)
+      nChunks = n;
+    if (nChunks <= 1)
+    {
+      fn(begin, end);
+      return;
+    }
+
+    std::function<void(int)> chunk = [&](int c)
+    {
+      int lo = begin + static_cast<int>(static_cast<long long>(n) * c / nChunks);
+      int hi = begin + static_cast<int>(static_cast<long long>(n) * (c + 1) / nChunks);
+      fn(lo, hi);
+    };
+    pool.run(nChunks, chunk);
+  }
+
+} // namespace myNN
+
+#endif
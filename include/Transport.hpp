@@ -0,0 +1,95 @@
+#ifndef TRANSPORT
+#define TRANSPORT
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace myNN
+{
+
+  // link of one process into a ring of size processes; rank r sends to rank r + 1 and
+  // receives from rank r - 1 (mod size), which is all a ring all-reduce needs
+  class Transport
+  {
+  public:
+    virtual ~Transport() = default;
+
+    virtual int rank() const = 0;
+
+    virtual int size() const = 0;
+
+    // send sendBytes to the next rank while receiving recvBytes from the previous one;
+    // both directions progress together, so a whole ring can exchange without deadlock
+    // throws if a peer does not make progress within the transport's timeout
+    virtual void exchange(const void *send, std::size_t sendBytes, void *recv, std::size_t recvBytes) = 0;
+  };
+
+  // processes on the same host: one single-producer single-consumer byte ring per rank
+  // in a POSIX shared memory segment
+  // rank 0 creates the segment under name (e.g. "/myNN_job42") and removes the name once
+  // every rank has mapped it; the other ranks wait for it to appear
+  class SharedMemoryTransport : public Transport
+  {
+  private:
+    int rank_;
+    int size_;
+    std::string name_;
+    void *map_ = nullptr;
+    std::size_t mapSize_ = 0;
+    std::size_t capacity_ = 0; // bytes of each ring
+    bool unlinked_ = false;
+    double timeoutSeconds_;
+
+    struct Channel;
+    Channel *channel(int rank) const;
+
+  public:
+    SharedMemoryTransport(const std::string &name, int rank, int size, std::size_t channelBytes = 1 << 20,
+                          double timeoutSeconds = 60.0);
+    ~SharedMemoryTransport() override;
+    SharedMemoryTransport(const SharedMemoryTransport &) = delete;
+    SharedMemoryTransport &operator=(const SharedMemoryTransport &) = delete;
+
+    int rank() const override { return rank_; }
+
+    int size() const override { return size_; }
+
+    void exchange(const void *send, std::size_t sendBytes, void *recv, std::size_t recvBytes) override;
+  };
+
+  // TCP stand-in for processes on different hosts: rank r listens on basePort + r and
+  // connects to the next rank at nextHost:basePort + next
+  class TcpTransport : public Transport
+  {
+  private:
+    int rank_;
+    int size_;
+    int sendFd_ = -1; // to the next rank
+    int recvFd_ = -1; // from the previous rank
+    double timeoutSeconds_;
+
+    void close();
+
+  public:
+    TcpTransport(int rank, int size, int basePort, const std::string &nextHost = "127.0.0.1",
+                 double timeoutSeconds = 60.0);
+    ~TcpTransport() override;
+    TcpTransport(const TcpTransport &) = delete;
+    TcpTransport &operator=(const TcpTransport &) = delete;
+
+    int rank() const override { return rank_; }
+
+    int size() const override { return size_; }
+
+    void exchange(const void *send, std::size_t sendBytes, void *recv, std::size_t recvBytes) override;
+  };
+
+  // sum n floats over every rank of the ring, in place, so all ranks end with the same
+  // values: a reduce-scatter followed by an all-gather, each moving (size - 1) / size of
+  // the data per rank; scratch is resized as needed and can be reused between calls
+  void ringAllReduce(Transport &transport, float *data, std::size_t n, std::vector<float> &scratch);
+
+} // namespace myNN
+
+#endif
@@ -0,0 +1,167 @@
+#include "Allocator.hpp"
+
+#include <new>
+
+using namespace myNN;
+
+namespace
+{
+  void *alignedNew(std::size_t bytes)
+  {
+    return ::operator new(bytes, std::align_val_t(TENSOR_ALIGNMENT));
+  }
+
+  void alignedDelete(void *p)
+  {
+    ::operator delete(p, std::align_val_t(TENSOR_ALIGNMENT));
+  }
+
+  void noteAllocation(AllocStats &stats, std::size_t bytes)
+  {
+    stats.bytesInUse += bytes;
+    if (stats.bytesInUse > stats.peakBytesInUse)
+      stats.peakBytesInUse = stats.bytesInUse;
+  }
+
+  // per thread, so a Workspace on one thread leaves the others alone
+  thread_local Allocator *currentAllocator = nullptr;
+
+  Allocator &processDefault()
+  {
+    // never destroyed, Tensors with static storage may outlive any other object
+    static SystemAllocator *allocator = new SystemAllocator();
+    return *allocator;
+  }
+}
+
+void *SystemAllocator::allocate(std::size_t bytes)
+{
+  void *p = alignedNew(bytes);
+  requests_.fetch_add(1, std::memory_order_relaxed);
+  std::size_t inUse = bytesInUse_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  std::size_t peak = peakBytesInUse_.load(std::memory_order_relaxed);
+  while (inUse > peak && !peakBytesInUse_.compare_exchange_weak(peak, inUse, std::memory_order_relaxed))
+  {
+  }
+  return p;
+}
+
+void SystemAllocator::deallocate(void *p, std::size_t bytes)
+{
+  alignedDelete(p);
+  heapFrees_.fetch_add(1, std::memory_order_relaxed);
+  bytesInUse_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+AllocStats SystemAllocator::stats() const
+{
+  AllocStats stats;
+  stats.requests = requests_.load(std::memory_order_relaxed);
+  stats.heapAllocations = stats.requests;
+  stats.heapFrees = heapFrees_.load(std::memory_order_relaxed);
+  stats.bytesInUse = bytesInUse_.load(std::memory_order_relaxed);
+  stats.peakBytesInUse = peakBytesInUse_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+std::size_t PoolAllocator::sizeClass(std::size_t bytes, std::size_t &index)
+{
+  // up to 256 bytes: multiples of 64
+  if (bytes <= 4 * TENSOR_ALIGNMENT)
+  {
+    std::size_t n = bytes == 0 ? 1 : (bytes + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT;
+    index = n - 1;
+    return n * TENSOR_ALIGNMENT;
+  }
+
+  // above that, four classes per power of two so rounding wastes at most 25%
+  int e = 8;
+  while ((std::size_t(1) << (e + 1)) < bytes)
+    e++;
+  std::size_t base = std::size_t(1) << e;
+  std::size_t step = base / 4;
+  std::size_t n = (bytes - base + step - 1) / step;
+  index = 4 + static_cast<std::size_t>(e - 8) * 4 + (n - 1);
+  return base + n * step;
+}
+
+PoolAllocator::~PoolAllocator()
+{
+  release();
+}
+
+void *PoolAllocator::allocate(std::size_t bytes)
+{
+  std::size_t index;
+  std::size_t rounded = sizeClass(bytes, index);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.requests++;
+    noteAllocation(stats_, rounded);
+    if (index < freeLists_.size() && !freeLists_[index].empty())
+    {
+      void *p = freeLists_[index].back();
+      freeLists_[index].pop_back();
+      stats_.bytesCached -= rounded;
+      return p;
+    }
+    stats_.heapAllocations++;
+  }
+
+  return alignedNew(rounded);
+}
+
+void PoolAllocator::deallocate(void *p, std::size_t bytes)
+{
+  std::size_t index;
+  std::size_t rounded = sizeClass(bytes, index);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (index >= freeLists_.size())
+    freeLists_.resize(index + 1);
+  freeLists_[index].push_back(p);
+  stats_.bytesInUse -= rounded;
+  stats_.bytesCached += rounded;
+}
+
+AllocStats PoolAllocator::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void PoolAllocator::release()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &list : freeLists_)
+  {
+    for (void *p : list)
+    {
+      alignedDelete(p);
+      stats_.heapFrees++;
+    }
+    list.clear();
+  }
+  stats_.bytesCached = 0;
+}
+
+Allocator &myNN::defaultAllocator()
+{
+  return currentAllocator ? *currentAllocator : processDefault();
+}
+
+void myNN::setDefaultAllocator(Allocator *allocator)
+{
+  currentAllocator = allocator;
+}
+
+Workspace::Workspace(Allocator &allocator) : previous_(&defaultAllocator())
+{
+  setDefaultAllocator(&allocator);
+}
+
+Workspace::~Workspace()
+{
+  setDefaultAllocator(previous_);
+}
@@ -0,0 +1,300 @@
+#include "Checkpoint.hpp"
+#include "ReLuLayer.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace myNN;
+
+namespace
+{
+  const char CHECKPOINT_MAGIC[8] = {'M', 'Y', 'N', 'N', 'C', 'K', 'P', 'T'};
+  constexpr std::uint32_t CHECKPOINT_VERSION = 1;
+  constexpr std::uint64_t CHECKPOINT_ALIGNMENT = 64;
+
+  std::uint64_t alignUp(std::uint64_t x)
+  {
+    return (x + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+  }
+
+  struct PendingTensor
+  {
+    CheckpointEntry entry;
+    const Tensor *tensor;
+  };
+
+  void addTensor(std::vector<PendingTensor> &out, std::uint32_t layer, CheckpointTensor kind, const Tensor &t)
+  {
+    CheckpointEntry e;
+    std::memset(&e, 0, sizeof(e));
+    e.layer = layer;
+    e.kind = static_cast<std::uint32_t>(kind);
+    e.rows = static_cast<std::uint32_t>(t.getShape()[0]);
+    e.cols = static_cast<std::uint32_t>(t.getShape()[1]);
+    out.push_back({e, &t});
+  }
+
+  // moments of one parameter; the kind and step count go into the parameter's own entry
+  void addState(std::vector<PendingTensor> &out, std::uint32_t layer, CheckpointTensor moment,
+                CheckpointTensor secondMoment, const OptimizerState &state)
+  {
+    CheckpointEntry &param = out.back().entry;
+    param.optimizer = static_cast<std::uint32_t>(state.kind);
+    param.optimizerSteps = static_cast<std::uint32_t>(state.steps);
+    if (state.m.size() > 0)
+      addTensor(out, layer, moment, state.m);
+    if (state.v.size() > 0)
+      addTensor(out, layer, secondMoment, state.v);
+  }
+
+  void writeAll(std::FILE *file, const void *data, size_t bytes)
+  {
+    if (bytes > 0 && std::fwrite(data, 1, bytes, file) != bytes)
+      throw std::runtime_error("failed to write checkpoint");
+  }
+}
+
+void myNN::saveCheckpoint(const Network &net, const std::string &path, bool includeState)
+{
+  if (!net.activationsFoldIntoDense())
+    throw std::runtime_error("checkpoint needs every activation right after a Dense layer");
+
+  const std::vector<DenseLayer> &layers = net.getLayers();
+
+  std::vector<PendingTensor> tensors;
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    std::uint32_t layer = static_cast<std::uint32_t>(i);
+    addTensor(tensors, layer, CheckpointTensor::Weights, layers[i].getWeights());
+    tensors.back().entry.activation = static_cast<std::uint32_t>(net.activationAfter(static_cast<int>(i)));
+    if (includeState)
+      addState(tensors, layer, CheckpointTensor::WeightMoment, CheckpointTensor::WeightSecondMoment,
+               layers[i].getWeightState());
+    addTensor(tensors, layer, CheckpointTensor::Bias, layers[i].getBias());
+    if (includeState)
+    {
+      addState(tensors, layer, CheckpointTensor::BiasMoment, CheckpointTensor::BiasSecondMoment,
+               layers[i].getBiasState());
+      addTensor(tensors, layer, CheckpointTensor::WeightGrad, layers[i].getdW_());
+      addTensor(tensors, layer, CheckpointTensor::BiasGrad, layers[i].getdB_());
+    }
+  }
+
+  CheckpointHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  header.version = CHECKPOINT_VERSION;
+  header.nLayers = static_cast<std::uint32_t>(layers.size());
+  header.nTensors = static_cast<std::uint32_t>(tensors.size());
+  header.flags = includeState ? CHECKPOINT_HAS_STATE : 0;
+
+  // lay the data out after the table, each tensor on its own aligned offset
+  std::uint64_t offset = sizeof(CheckpointHeader) + tensors.size() * sizeof(CheckpointEntry);
+  for (auto &t : tensors)
+  {
+    offset = alignUp(offset);
+    t.entry.offset = offset;
+    offset += static_cast<std::uint64_t>(t.tensor->size()) * sizeof(float);
+  }
+
+  std::FILE *file = std::fopen(path.c_str(), "wb");
+  if (!file)
+    throw std::runtime_error("cannot open checkpoint for writing: " + path);
+
+  try
+  {
+    writeAll(file, &header, sizeof(header));
+    for (const auto &t : tensors)
+      writeAll(file, &t.entry, sizeof(t.entry));
+
+    std::uint64_t written = sizeof(CheckpointHeader) + tensors.size() * sizeof(CheckpointEntry);
+    const char padding[CHECKPOINT_ALIGNMENT] = {};
+    for (const auto &t : tensors)
+    {
+      writeAll(file, padding, t.entry.offset - written);
+      size_t bytes = static_cast<size_t>(t.tensor->size()) * sizeof(float);
+      writeAll(file, t.tensor->data(), bytes);
+      written = t.entry.offset + bytes;
+    }
+  }
+  catch (...)
+  {
+    std::fclose(file);
+    throw;
+  }
+
+  if (std::fclose(file) != 0)
+    throw std::runtime_error("failed to write checkpoint");
+}
+
+Network myNN::loadCheckpoint(const std::string &path)
+{
+  MappedCheckpoint mapped(path);
+
+  Network net;
+  for (int i = 0; i < mapped.numLayers(); i++)
+  {
+    TensorView w = mapped.weights(i);
+    DenseLayer layer(w.rows(), w.cols());
+    layer.getWeights() = Tensor(w);
+    layer.getBias() = Tensor(mapped.bias(i));
+    if (mapped.hasState())
+    {
+      layer.getdW_() = Tensor(mapped.tensor(i, CheckpointTensor::WeightGrad));
+      layer.getdB_() = Tensor(mapped.tensor(i, CheckpointTensor::BiasGrad));
+      layer.getWeightState() = mapped.optimizerState(i, false);
+      layer.getBiasState() = mapped.optimizerState(i, true);
+    }
+    net.addLayer(layer);
+    if (mapped.activation(i) == Activation::ReLU)
+      net.addLayer(ReLuLayer());
+  }
+  return net;
+}
+
+MappedCheckpoint::MappedCheckpoint(const std::string &path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("cannot open checkpoint: " + path);
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CheckpointHeader))
+  {
+    ::close(fd);
+    throw std::runtime_error("checkpoint is too small: " + path);
+  }
+  mapSize_ = static_cast<size_t>(st.st_size);
+
+  map_ = ::mmap(nullptr, mapSize_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map_ == MAP_FAILED)
+  {
+    map_ = nullptr;
+    throw std::runtime_error("cannot map checkpoint: " + path);
+  }
+
+  auto fail = [&](const char *what)
+  {
+    ::munmap(map_, mapSize_);
+    map_ = nullptr;
+    throw std::runtime_error(std::string(what) + ": " + path);
+  };
+
+  const char *base = static_cast<const char *>(map_);
+  std::memcpy(&header_, base, sizeof(header_));
+  if (std::memcmp(header_.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+    fail("not a checkpoint file");
+  if (header_.version != CHECKPOINT_VERSION)
+    fail("unsupported checkpoint version");
+  if (sizeof(CheckpointHeader) + static_cast<std::uint64_t>(header_.nTensors) * sizeof(CheckpointEntry) > mapSize_)
+    fail("truncated checkpoint");
+
+  entries_.resize(header_.nTensors);
+  std::memcpy(entries_.data(), base + sizeof(CheckpointHeader), entries_.size() * sizeof(CheckpointEntry));
+
+  weightEntry_.assign(header_.nLayers, -1);
+  biasEntry_.assign(header_.nLayers, -1);
+  for (size_t i = 0; i < entries_.size(); i++)
+  {
+    const CheckpointEntry &e = entries_[i];
+    // compared without sums or products that could wrap for hostile sizes and offsets;
+    // shapes are handed out as int
+    std::uint64_t elements = static_cast<std::uint64_t>(e.rows) * e.cols;
+    if (e.layer >= header_.nLayers || e.rows > INT_MAX || e.cols > INT_MAX ||
+        e.offset % CHECKPOINT_ALIGNMENT != 0 || e.offset > mapSize_ ||
+        elements > (mapSize_ - e.offset) / sizeof(float) ||
+        e.activation > static_cast<std::uint32_t>(Activation::ReLU) ||
+        e.optimizer > static_cast<std::uint32_t>(OptimizerKind::AdamW))
+      fail("corrupt checkpoint entry");
+
+    if (e.kind == static_cast<std::uint32_t>(CheckpointTensor::Weights))
+      weightEntry_[e.layer] = static_cast<int>(i);
+    else if (e.kind == static_cast<std::uint32_t>(CheckpointTensor::Bias))
+      biasEntry_[e.layer] = static_cast<int>(i);
+  }
+
+  for (std::uint32_t l = 0; l < header_.nLayers; l++)
+  {
+    if (weightEntry_[l] < 0 || biasEntry_[l] < 0)
+      fail("checkpoint layer without weights or bias");
+  }
+}
+
+MappedCheckpoint::~MappedCheckpoint()
+{
+  if (map_)
+    ::munmap(map_, mapSize_);
+}
+
+TensorView MappedCheckpoint::entryView(const CheckpointEntry &e) const
+{
+  const float *data = reinterpret_cast<const float *>(static_cast<const char *>(map_) + e.offset);
+  int rows = static_cast<int>(e.rows);
+  int cols = static_cast<int>(e.cols);
+  return TensorView(data, rows, cols, cols, 1);
+}
+
+TensorView MappedCheckpoint::weights(int layer) const
+{
+  return entryView(entries_.at(weightEntry_.at(layer)));
+}
+
+TensorView MappedCheckpoint::bias(int layer) const
+{
+  return entryView(entries_.at(biasEntry_.at(layer)));
+}
+
+Activation MappedCheckpoint::activation(int layer) const
+{
+  return static_cast<Activation>(entries_.at(weightEntry_.at(layer)).activation);
+}
+
+TensorView MappedCheckpoint::tensor(int layer, CheckpointTensor kind) const
+{
+  for (const CheckpointEntry &e : entries_)
+  {
+    if (static_cast<int>(e.layer) == layer && e.kind == static_cast<std::uint32_t>(kind))
+      return entryView(e);
+  }
+  throw std::runtime_error("tensor not stored in checkpoint");
+}
+
+OptimizerState MappedCheckpoint::optimizerState(int layer, bool bias) const
+{
+  const CheckpointEntry &param = entries_.at(bias ? biasEntry_.at(layer) : weightEntry_.at(layer));
+  OptimizerState state;
+  state.kind = static_cast<OptimizerKind>(param.optimizer);
+  state.steps = static_cast<int>(param.optimizerSteps);
+
+  CheckpointTensor moment = bias ? CheckpointTensor::BiasMoment : CheckpointTensor::WeightMoment;
+  CheckpointTensor secondMoment = bias ? CheckpointTensor::BiasSecondMoment : CheckpointTensor::WeightSecondMoment;
+  if (state.kind != OptimizerKind::SGD)
+    state.m = Tensor(tensor(layer, moment));
+  if (state.kind == OptimizerKind::Adam || state.kind == OptimizerKind::AdamW)
+    state.v = Tensor(tensor(layer, secondMoment));
+  return state;
+}
+
+Tensor MappedCheckpoint::forward(const TensorView &input) const
+{
+  if (numLayers() == 0)
+    return Tensor(input);
+
+  Tensor x;
+  TensorView current = input;
+  for (int i = 0; i < numLayers(); i++)
+  {
+    x = matMulBias(current, weights(i), bias(i), activation(i));
+    current = x;
+  }
+  return x;
+}
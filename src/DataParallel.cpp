@@ -0,0 +1,193 @@
+#include "DataParallel.hpp"
+#include "Allocator.hpp"
+#include "Profiler.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+
+using namespace myNN;
+
+namespace
+{
+  constexpr int LINE_FLOATS = static_cast<int>(TENSOR_ALIGNMENT / sizeof(float));
+
+  // slices are summed in tiles small enough to stay in L1 across the replicas
+  constexpr int TILE_FLOATS = 1024;
+
+  // dst[i] += src[r][i] for every replica r, with dst and all sources split at the same
+  // cache line boundaries; tensor storage is TENSOR_ALIGNMENT aligned, so a slice of
+  // whole lines never shares a line with its neighbour
+  void reduceInto(float *dst, const std::vector<const float *> &srcs, int n)
+  {
+    int nLines = (n + LINE_FLOATS - 1) / LINE_FLOATS;
+    std::size_t work = static_cast<std::size_t>(n) * srcs.size();
+    parallelFor(0, nLines, work, [&](int lo, int hi)
+                {
+                  int begin = lo * LINE_FLOATS;
+                  int end = std::min(hi * LINE_FLOATS, n);
+                  for (int tile = begin; tile < end; tile += TILE_FLOATS)
+                  {
+                    int tileEnd = std::min(tile + TILE_FLOATS, end);
+                    for (const float *src : srcs)
+                    {
+                      for (int i = tile; i < tileEnd; i++)
+                        dst[i] += src[i];
+                    }
+                  }
+                });
+  }
+}
+
+DataParallelTrainer::DataParallelTrainer(Network &net, int replicas) : net_(net)
+{
+  if (replicas <= 0)
+    replicas = ThreadPool::instance().numThreads();
+
+  replicas_.reserve(replicas - 1);
+  for (int r = 1; r < replicas; r++)
+  {
+    replicas_.push_back(net);
+    replicas_.back().shareParameters(net);
+  }
+  shards_.resize(replicas);
+}
+
+void DataParallelTrainer::reduceGradients(int nShards)
+{
+  MYNN_PROFILE_SCOPE("dataParallel.reduce", "network");
+  std::vector<const float *> srcs(nShards - 1);
+  std::vector<DenseLayer> &layers = net_.getLayers();
+  for (size_t l = 0; l < layers.size(); l++)
+  {
+    for (int r = 1; r < nShards; r++)
+      srcs[r - 1] = replicas_[r - 1].getLayers()[l].getdW_().data();
+    reduceInto(layers[l].getdW_().getData().data(), srcs, layers[l].getdW_().size());
+
+    for (int r = 1; r < nShards; r++)
+      srcs[r - 1] = replicas_[r - 1].getLayers()[l].getdB_().data();
+    reduceInto(layers[l].getdB_().getData().data(), srcs, layers[l].getdB_().size());
+  }
+}
+
+float DataParallelTrainer::trainBatch(const TensorView &x, const TensorView &y, const FitOptions &options)
+{
+  MYNN_PROFILE_SCOPE("dataParallel.trainBatch", "network");
+  int rows = x.rows();
+  if (y.rows() != rows)
+    throw std::runtime_error("trainBatch needs one target row per input row");
+  if (rows == 0)
+    return 0.0f;
+
+  // contiguous shards of the batch, never an empty one
+  int nShards = std::min(numReplicas(), rows);
+  std::vector<std::exception_ptr> errors(nShards);
+
+  auto shard = [&](int r)
+  {
+    try
+    {
+      int lo = static_cast<int>(static_cast<long long>(rows) * r / nShards);
+      int hi = static_cast<int>(static_cast<long long>(rows) * (r + 1) / nShards);
+      Network &replica = r == 0 ? net_ : replicas_[r - 1];
+      shards_[r].squaredError = replica.computeGradients(x.rowSlice(lo, hi), y.rowSlice(lo, hi),
+                                                         options.microBatchSize, rows);
+    }
+    catch (...)
+    {
+      errors[r] = std::current_exception();
+    }
+  };
+
+  // the kernels inside a shard stay serial, as they run inside a pool job; called from
+  // a pool job itself the shards run one after the other, as parallelFor would
+  if (ThreadPool::inParallelRegion())
+  {
+    for (int r = 0; r < nShards; r++)
+      shard(r);
+  }
+  else
+    ThreadPool::instance().run(nShards, shard);
+  for (const std::exception_ptr &error : errors)
+  {
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  reduceGradients(nShards);
+  net_.step(options.optimizer, options.learningRate);
+
+  double squaredError = 0.0;
+  for (int r = 0; r < nShards; r++)
+    squaredError += shards_[r].squaredError;
+  return static_cast<float>(std::sqrt(squaredError / rows));
+}
+
+std::vector<EpochStats> DataParallelTrainer::fit(const Tensor &X, const Tensor &Y, const FitOptions &options)
+{
+  return net_.fit(X, Y, options, [&](const TensorView &x, const TensorView &y)
+                  { return trainBatch(x, y, options); });
+}
+
+std::vector<EpochStats> DataParallelTrainer::fit(BatchLoader &loader, const FitOptions &options)
+{
+  return net_.fit(loader, options, [&](const TensorView &x, const TensorView &y)
+                  { return trainBatch(x, y, options); });
+}
+
+std::vector<ScalingPoint> myNN::scalingReport(const Network &net, const Tensor &X, const Tensor &Y,
+                                              const FitOptions &options, int maxThreads, std::ostream *out)
+{
+  ThreadPool &pool = ThreadPool::instance();
+  int oldThreads = pool.numThreads();
+
+  std::vector<ScalingPoint> points;
+  for (int threads = 1; threads <= maxThreads; threads++)
+  {
+    pool.setNumThreads(threads);
+
+    // every run starts from the same weights
+    Network copy = net;
+    DataParallelTrainer trainer(copy, threads);
+    std::vector<EpochStats> history = trainer.fit(X, Y, options);
+
+    double seconds = 0.0;
+    double samples = 0.0;
+    for (const EpochStats &epoch : history)
+    {
+      seconds += epoch.seconds;
+      samples += epoch.samplesPerSec * epoch.seconds;
+    }
+
+    ScalingPoint point;
+    point.threads = threads;
+    point.samplesPerSec = seconds > 0.0 ? samples / seconds : 0.0;
+    if (!points.empty() && points.front().samplesPerSec > 0.0)
+    {
+      point.speedup = point.samplesPerSec / points.front().samplesPerSec;
+      point.efficiency = point.speedup / threads;
+    }
+    points.push_back(point);
+  }
+  pool.setNumThreads(oldThreads);
+
+  if (out)
+  {
+    *out << std::setw(8) << "threads" << std::setw(14) << "samples/s" << std::setw(10) << "speedup"
+         << std::setw(12) << "efficiency" << "\n"
+         << std::fixed;
+    for (const ScalingPoint &p : points)
+    {
+      *out << std::setw(8) << p.threads
+           << std::setw(14) << std::setprecision(0) << p.samplesPerSec
+           << std::setw(10) << std::setprecision(2) << p.speedup
+           << std::setw(12) << std::setprecision(2) << p.efficiency << "\n";
+    }
+    *out << std::defaultfloat;
+  }
+  return points;
+}
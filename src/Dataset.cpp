@@ -0,0 +1,274 @@
+#include "Dataset.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace myNN;
+
+namespace
+{
+  const char DATASET_MAGIC[8] = {'M', 'Y', 'N', 'N', 'D', 'A', 'T', 'A'};
+  constexpr std::uint32_t DATASET_VERSION = 1;
+
+  // append row i of v to buf
+  void gatherRow(const TensorView &v, int i, std::vector<float> &buf)
+  {
+    for (int j = 0; j < v.cols(); j++)
+      buf.push_back(v(i, j));
+  }
+
+  // copy rows [begin, begin + n) of a strided view into a row-major tensor of n rows
+  void copyRows(const TensorView &src, Tensor &dst, int n)
+  {
+    if (dst.getShape()[0] != n || dst.getShape()[1] != src.cols())
+      dst = Tensor({n, src.cols()});
+
+    float *out = dst.getData().data();
+    for (int i = 0; i < n; i++)
+      std::memcpy(out + static_cast<size_t>(i) * src.cols(), src.data() + static_cast<size_t>(i) * src.rowStride(),
+                  sizeof(float) * src.cols());
+  }
+}
+
+DatasetWriter::DatasetWriter(const std::string &path, int features, int targets)
+{
+  file_ = std::fopen(path.c_str(), "wb");
+  if (!file_)
+    throw std::runtime_error("cannot open dataset for writing: " + path);
+
+  std::memset(&header_, 0, sizeof(header_));
+  std::memcpy(header_.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+  header_.version = DATASET_VERSION;
+  header_.dtype = 0;
+  header_.rows = 0;
+  header_.features = static_cast<std::uint32_t>(features);
+  header_.targets = static_cast<std::uint32_t>(targets);
+
+  // placeholder, rewritten with the final row count on close
+  if (std::fwrite(&header_, sizeof(header_), 1, file_) != 1)
+    throw std::runtime_error("failed to write dataset header");
+}
+
+DatasetWriter::~DatasetWriter()
+{
+  try
+  {
+    close();
+  }
+  catch (const std::exception &)
+  {
+  }
+}
+
+void DatasetWriter::append(const TensorView &X, const TensorView &Y)
+{
+  if (!file_)
+    throw std::runtime_error("dataset writer is closed");
+  if (X.cols() != static_cast<int>(header_.features) || Y.cols() != static_cast<int>(header_.targets) || X.rows() != Y.rows())
+    throw std::runtime_error("dataset rows do not match the header");
+
+  std::vector<float> row;
+  row.reserve(header_.features + header_.targets);
+  for (int i = 0; i < X.rows(); i++)
+  {
+    row.clear();
+    gatherRow(X, i, row);
+    gatherRow(Y, i, row);
+    if (std::fwrite(row.data(), sizeof(float), row.size(), file_) != row.size())
+      throw std::runtime_error("failed to write dataset");
+  }
+  header_.rows += static_cast<std::uint64_t>(X.rows());
+}
+
+void DatasetWriter::close()
+{
+  if (!file_)
+    return;
+
+  std::FILE *file = file_;
+  file_ = nullptr;
+  bool ok = std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header_, sizeof(header_), 1, file) == 1;
+  ok = std::fclose(file) == 0 && ok;
+  if (!ok)
+    throw std::runtime_error("failed to finish dataset");
+}
+
+void myNN::writeDataset(const std::string &path, const TensorView &X, const TensorView &Y)
+{
+  DatasetWriter writer(path, X.cols(), Y.cols());
+  writer.append(X, Y);
+  writer.close();
+}
+
+MappedDataset::MappedDataset(const std::string &path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("cannot open dataset: " + path);
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(DatasetHeader))
+  {
+    ::close(fd);
+    throw std::runtime_error("dataset is too small: " + path);
+  }
+  mapSize_ = static_cast<size_t>(st.st_size);
+
+  map_ = ::mmap(nullptr, mapSize_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map_ == MAP_FAILED)
+  {
+    map_ = nullptr;
+    throw std::runtime_error("cannot map dataset: " + path);
+  }
+
+  std::memcpy(&header_, map_, sizeof(header_));
+  // rows and widths are handed out as int, and the size check is a division so a
+  // hostile row count cannot wrap it
+  std::uint64_t width = static_cast<std::uint64_t>(header_.features) + header_.targets;
+  if (std::memcmp(header_.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC)) != 0 || header_.version != DATASET_VERSION ||
+      header_.dtype != 0 || width == 0 || width > INT_MAX || header_.rows > INT_MAX ||
+      header_.rows > (mapSize_ - sizeof(DatasetHeader)) / (width * sizeof(float)))
+  {
+    ::munmap(map_, mapSize_);
+    map_ = nullptr;
+    throw std::runtime_error("not a valid dataset file: " + path);
+  }
+
+  rows_ = reinterpret_cast<const float *>(static_cast<const char *>(map_) + sizeof(DatasetHeader));
+}
+
+MappedDataset::~MappedDataset()
+{
+  if (map_)
+    ::munmap(map_, mapSize_);
+}
+
+TensorView MappedDataset::inputs(int begin, int end) const
+{
+  int width = features() + targets();
+  return TensorView(rows_ + static_cast<size_t>(begin) * width, end - begin, features(), width, 1);
+}
+
+TensorView MappedDataset::outputs(int begin, int end) const
+{
+  int width = features() + targets();
+  return TensorView(rows_ + static_cast<size_t>(begin) * width + features(), end - begin, targets(), width, 1);
+}
+
+void MappedDataset::prefetch(int begin, int end) const
+{
+  // madvise wants page aligned addresses
+  size_t width = static_cast<size_t>(features() + targets()) * sizeof(float);
+  size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  size_t first = sizeof(DatasetHeader) + begin * width;
+  size_t last = sizeof(DatasetHeader) + end * width;
+  first -= first % page;
+  ::madvise(static_cast<char *>(map_) + first, last - first, MADV_WILLNEED);
+}
+
+BatchLoader::BatchLoader(const MappedDataset &data, int batchSize, bool shuffle, unsigned seed)
+    : data_(data), batchSize_(std::max(1, batchSize)), shuffle_(shuffle), seed_(seed)
+{
+  int nBatches = (data_.rows() + batchSize_ - 1) / batchSize_;
+  batchOrder_.resize(nBatches);
+  std::iota(batchOrder_.begin(), batchOrder_.end(), 0);
+  reset();
+}
+
+BatchLoader::~BatchLoader()
+{
+  stopProducer();
+}
+
+void BatchLoader::stopProducer()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  changed_.notify_all();
+  if (producer_.joinable())
+    producer_.join();
+}
+
+void BatchLoader::reset()
+{
+  stopProducer();
+
+  if (shuffle_)
+  {
+    std::mt19937 rng(seed_ + static_cast<unsigned>(epoch_));
+    std::shuffle(batchOrder_.begin(), batchOrder_.end(), rng);
+  }
+  epoch_++;
+
+  consumed_ = 0;
+  stop_ = false;
+  for (Slot &slot : slots_)
+    slot.ready = false;
+  producer_ = std::thread([this]
+                          { produce(); });
+}
+
+void BatchLoader::produce()
+{
+  for (int k = 0; k < numBatches(); k++)
+  {
+    Slot &slot = slots_[k % 2];
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [&]
+                    { return stop_ || !slot.ready; });
+      if (stop_)
+        return;
+    }
+
+    int begin = batchOrder_[k] * batchSize_;
+    int end = std::min(begin + batchSize_, data_.rows());
+
+    // ask for the batch after this one while we copy
+    if (k + 1 < numBatches())
+    {
+      int nextBegin = batchOrder_[k + 1] * batchSize_;
+      data_.prefetch(nextBegin, std::min(nextBegin + batchSize_, data_.rows()));
+    }
+
+    copyRows(data_.inputs(begin, end), slot.x, end - begin);
+    copyRows(data_.outputs(begin, end), slot.y, end - begin);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      slot.ready = true;
+    }
+    changed_.notify_all();
+  }
+}
+
+bool BatchLoader::next(Tensor &x, Tensor &y)
+{
+  if (consumed_ >= numBatches())
+    return false;
+
+  Slot &slot = slots_[consumed_ % 2];
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [&]
+                  { return slot.ready; });
+    std::swap(x, slot.x);
+    std::swap(y, slot.y);
+    slot.ready = false;
+  }
+  changed_.notify_all();
+  consumed_++;
+  return true;
+}
@@ -1,60 +1,217 @@
 #include "DenseLayer.hpp"
+#include "Profiler.hpp"
 #include "Tensor.hpp"
 
-#include <cmath>
+#include <stdexcept>
 
 using namespace myNN;
 
+namespace
+{
+    // dense += rows, row by row
+    void addRows(const SparseRows &rows, Tensor &dense)
+    {
+        int cols = dense.getShape()[1];
+        float *d = dense.getData().data();
+        const float *v = rows.values.data();
+        for (size_t r = 0; r < rows.rows.size(); r++)
+            for (int j = 0; j < cols; j++)
+                d[static_cast<size_t>(rows.rows[r]) * cols + j] += v[r * cols + j];
+    }
+}
+
 DenseLayer::DenseLayer(int nInputs, int nOutputs, bool initialiseGrads) : w_(Tensor({nInputs, nOutputs})),
                                                                           b_(Tensor({1, nOutputs})),
                                                                           dW_(Tensor({nInputs, nOutputs})),
                                                                           dB_(Tensor({1, nOutputs}))
 {
-    w_.apply([](float x)
-             { return ((float)rand() / RAND_MAX - 0.5f); });
+    // rand() is not thread safe, so initialise serially rather than through apply
+    auto randomise = [](Tensor &t)
+    {
+        for (float &x : t.getData())
+            x = ((float)rand() / RAND_MAX - 0.5f);
+    };
+
+    randomise(w_);
 
     if (initialiseGrads)
     {
-        dW_.apply([](float x)
-                  { return ((float)rand() / RAND_MAX - 0.5f); });
-        dB_.apply([](float x)
-                  { return ((float)rand() / RAND_MAX - 0.5f); });
+        randomise(dW_);
+        randomise(dB_);
+    }
+}
+
+Tensor DenseLayer::forward(const TensorView &input) const
+{
+    return forward(input, Activation::None);
+}
+
+Tensor DenseLayer::forward(const TensorView &input, Activation activation) const
+{
+    MYNN_PROFILE_SCOPE("dense.forward", "layer");
+    const DenseLayer &p = params();
+    if (p.sparse_)
+    {
+        Tensor out({input.rows(), p.wSparse_.rows()});
+        forwardInto(input, out.getData().data(), activation);
+        return out;
+    }
+    if (p.precision_ != DType::Float32)
+        return matMulBias(input, p.wLow_, p.b_, activation);
+    return matMulBias(input, p.w_, p.b_, activation);
+}
+
+Tensor DenseLayer::forward(const HalfTensor &input, Activation activation) const
+{
+    const DenseLayer &p = params();
+    if (p.sparse_)
+        return forward(input.toFloat(), activation);
+    if (p.precision_ != DType::Float32)
+        return matMulBias(input, p.wLow_, p.b_, activation);
+    return matMulBias(input.toFloat(), p.w_, p.b_, activation);
+}
+
+Tensor DenseLayer::forward(const SparseTensor &input, Activation activation) const
+{
+    Tensor out({input.rows(), outputSize(input.cols())});
+    forwardInto(input, out.getData().data(), activation);
+    return out;
+}
+
+void DenseLayer::forwardInto(const SparseTensor &input, float *out, Activation activation) const
+{
+    int n = outputSize(input.cols());
+    const DenseLayer &p = params();
+    MYNN_PROFILE_SCOPE("dense.forwardSparse", "layer", 2.0 * input.nnz() * n,
+                       4.0 * (static_cast<double>(input.nnz()) * n + static_cast<double>(input.rows()) * n) + input.bytes());
+
+    GemmEpilogue epilogue;
+    epilogue.bias = p.b_.data();
+    epilogue.activation = activation;
+    sparseMatMul(input, p.w_, out, n, epilogue);
+}
+
+void DenseLayer::setPrecision(DType precision)
+{
+    if (shared_)
+    {
+        throw std::runtime_error("set the precision on the layer that owns the parameters");
+    }
+    if (sparse_ && precision != DType::Float32)
+    {
+        throw std::runtime_error("sparse weights are fp32 only");
+    }
+    precision_ = precision;
+    if (precision_ == DType::Float32)
+        wLow_ = HalfTensor();
+    else
+        wLow_ = HalfTensor(w_, precision_);
+}
+
+void DenseLayer::syncWeights()
+{
+    if (precision_ != DType::Float32)
+        wLow_.assign(w_);
+    if (sparse_)
+    {
+        // pick up the updated weights in the pattern and zero the rest again
+        wSparse_.assign(w_.view().transpose());
+        wSparse_.toDense(w_.getData().data(), 1, w_.getShape()[1]);
+    }
+}
+
+float DenseLayer::prune(float sparsity)
+{
+    if (shared_)
+    {
+        throw std::runtime_error("prune the layer that owns the parameters");
     }
+    float threshold = pruneByMagnitude(w_, sparsity);
+    // a layer that was sparse already gets the new, smaller pattern
+    setSparse(false);
+    setSparse(true);
+    return threshold;
 }
 
-Tensor DenseLayer::forward(const Tensor &input) const
+void DenseLayer::setSparse(bool sparse)
 {
-    return input.matMul(w_).addBroadcast(b_);
+    if (shared_)
+    {
+        throw std::runtime_error("set sparse weights on the layer that owns the parameters");
+    }
+    if (sparse && precision_ != DType::Float32)
+    {
+        throw std::runtime_error("sparse weights are fp32 only");
+    }
+    if (sparse == sparse_)
+        return;
+    sparse_ = sparse;
+    wSparse_ = sparse ? SparseTensor(w_.view().transpose()) : SparseTensor();
 }
 
-float DenseLayer::rmse(const Tensor &pred, const Tensor &target) const
+void DenseLayer::shareParameters(const DenseLayer &owner)
 {
-    Tensor diff = pred - target;
-    diff.apply([](float x)
-               { return x * x; });
-    float mse = diff.mean();
-    return std::sqrt(mse);
+    if (owner.shared_ || owner.w_.getShape() != dW_.getShape())
+    {
+        throw std::runtime_error("cannot share parameters of a different layer shape");
+    }
+    shared_ = &owner;
+    w_ = Tensor();
+    b_ = Tensor();
+    wLow_ = HalfTensor();
+    precision_ = DType::Float32;
+    sparse_ = false;
+    wSparse_ = SparseTensor();
+    wState_.reset();
+    bState_.reset();
 }
 
-Tensor DenseLayer::dL_dY(const Tensor &pred, const Tensor &target) const
+void DenseLayer::dW(const Tensor &dL_dY, const TensorView &input, bool accumulate)
 {
-    Tensor diff = pred - target;
-    return diff.mul(2.0 / pred.size());
+    MYNN_PROFILE_SCOPE("dense.dW", "layer");
+    // a row gradient accumulated so far becomes dense first
+    if (accumulate && rowGrad_)
+    {
+        dW_.zeros();
+        addRows(dWRows_, dW_);
+    }
+    // the buffer is reused, the transpose of input is only a view
+    matMulInto(input.transpose(), dL_dY, dW_, 1.0f, accumulate ? 1.0f : 0.0f);
+    rowGrad_ = false;
 }
 
-void DenseLayer::dW(const Tensor &dL_dY, const Tensor &input)
+void DenseLayer::dW(const Tensor &dL_dY, const SparseTensor &input, bool accumulate)
 {
-    dW_ = input.transpose().matMul(dL_dY);
+    MYNN_PROFILE_SCOPE("dense.dWSparse", "layer");
+    if (input.cols() != dW_.getShape()[0] || dL_dY.getShape()[1] != dW_.getShape()[1])
+    {
+        throw std::runtime_error("input shape not compatible");
+    }
+    transposeMatMulInto(input, dL_dY, dWRows_, accumulate && rowGrad_);
+    // accumulated onto a dense gradient the rows are added to it, which stays dense
+    if (accumulate && !rowGrad_)
+    {
+        addRows(dWRows_, dW_);
+        return;
+    }
+    rowGrad_ = true;
 }
 
-void DenseLayer::dB(const Tensor &dL_dY)
+void DenseLayer::dB(const Tensor &dL_dY, bool accumulate)
 {
-    dB_ = dL_dY.sumRows();
+    MYNN_PROFILE_SCOPE("dense.dB", "layer");
+    sumRowsInto(dL_dY, dB_, 1.0f, accumulate ? 1.0f : 0.0f);
 }
 
 Tensor DenseLayer::dX(const Tensor &dL_dY)
 {
-    return dL_dY.matMul(w_.transpose());
+    MYNN_PROFILE_SCOPE("dense.dX", "layer");
+    const DenseLayer &p = params();
+    if (p.sparse_)
+        return matMul(dL_dY, p.wSparse_);
+    if (p.precision_ != DType::Float32)
+        return matMulTranspose(dL_dY, p.wLow_);
+    return dL_dY.matMulTranspose(p.w_);
 }
 
 Tensor DenseLayer::backward(const Tensor &dL_dY)
@@ -65,11 +222,82 @@ Tensor DenseLayer::backward(const Tensor &dL_dY)
     return dX;
 }
 
-void DenseLayer::updateParameters(float lr)
+void DenseLayer::step(const OptimizerConfig &config, float lr)
+{
+    MYNN_PROFILE_SCOPE("dense.update", "layer");
+    if (shared_)
+    {
+        throw std::runtime_error("step the layer that owns the parameters");
+    }
+    if (rowGrad_)
+        optimizerStep(config, lr, config.weightDecay, w_, dWRows_, wState_);
+    else
+        optimizerStep(config, lr, config.weightDecay, w_, dW_, wState_);
+    optimizerStep(config, lr, 0.0f, b_, dB_, bState_);
+
+    syncWeights();
+}
+
+void DenseLayer::zeroGrad()
 {
-    Tensor scaled_dW = dW_.mul(lr);
-    w_.sub(scaled_dW);
+    dW_.zeroGrad();
+    dB_.zeroGrad();
+    // an empty row gradient is a zero one
+    dWRows_.rows.clear();
+    dWRows_.values = Tensor();
+}
 
-    Tensor scaled_dB = dB_.mul(lr);
-    b_.sub(scaled_dB);
-}
\ No newline at end of file
+std::unique_ptr<Layer> DenseLayer::clone() const
+{
+    return std::make_unique<DenseLayer>(*this);
+}
+
+int DenseLayer::outputSize(int inputSize) const
+{
+    const Tensor &w = params().w_;
+    if (inputSize != w.getShape()[0])
+    {
+        throw std::runtime_error("input shape not compatible");
+    }
+    return w.getShape()[1];
+}
+
+void DenseLayer::forwardInto(const TensorView &input, float *out) const
+{
+    forwardInto(input, out, Activation::None);
+}
+
+void DenseLayer::forwardInto(const TensorView &input, float *out, Activation activation) const
+{
+    int n = outputSize(input.cols());
+    const DenseLayer &p = params();
+    // a sparse layer only reads and multiplies its stored weights
+    MYNN_PROFILE_SCOPE("dense.forward", "layer",
+                       2.0 * input.rows() * (p.sparse_ ? p.wSparse_.nnz() : static_cast<double>(n) * input.cols()),
+                       4.0 * (static_cast<double>(input.size()) + static_cast<double>(input.rows()) * n) +
+                           (p.sparse_ ? p.wSparse_.bytes() : 4.0 * p.w_.size()));
+
+    GemmEpilogue epilogue;
+    epilogue.bias = p.b_.data();
+    epilogue.activation = activation;
+    if (p.sparse_)
+    {
+        sparseMatMulTranspose(input, p.wSparse_, out, n, epilogue);
+        return;
+    }
+    if (p.precision_ != DType::Float32)
+    {
+        gemmMixed(input.rows(), n, input.cols(), input.data(), DType::Float32, input.rowStride(), input.colStride(),
+                  p.wLow_.data(), p.wLow_.dtype(), n, 1, out, n, epilogue);
+        return;
+    }
+    gemmStrided(input.rows(), n, input.cols(), input.data(), input.rowStride(), input.colStride(),
+                p.w_.data(), n, 1, out, n, epilogue);
+}
+
+Tensor DenseLayer::backwardFrom(const Tensor &dOut, const TensorView &input, const TensorView &, bool accumulate)
+{
+    dB(dOut, accumulate);
+    dW(dOut, input, accumulate);
+    return dX(dOut);
+}
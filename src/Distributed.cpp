@@ -0,0 +1,176 @@
+#include "Distributed.hpp"
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace myNN;
+
+DistributedTrainer::DistributedTrainer(Network &net, Transport &transport, std::size_t bucketBytes)
+    : net_(net), transport_(transport), bucketFloats_(std::max<std::size_t>(1, bucketBytes / sizeof(float)))
+{
+  worker_ = std::thread([this]
+                        { workerLoop(); });
+}
+
+DistributedTrainer::~DistributedTrainer()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  worker_.join();
+}
+
+void DistributedTrainer::gradientsReady(DenseLayer &layer)
+{
+  // the bias gradient is finished together with the weights
+  for (Tensor *grad : {&layer.getdW_(), &layer.getdB_()})
+  {
+    filling_.push_back({grad->getData().data(), static_cast<std::size_t>(grad->size())});
+    fillingFloats_ += static_cast<std::size_t>(grad->size());
+  }
+  if (fillingFloats_ >= bucketFloats_)
+    submit();
+}
+
+void DistributedTrainer::submit()
+{
+  if (filling_.empty())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(filling_));
+    inFlight_++;
+  }
+  wake_.notify_one();
+  filling_.clear();
+  fillingFloats_ = 0;
+}
+
+void DistributedTrainer::wait()
+{
+  submit();
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [&]
+             { return inFlight_ == 0; });
+  if (error_)
+  {
+    std::exception_ptr error = error_;
+    error_ = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+void DistributedTrainer::workerLoop()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true)
+  {
+    wake_.wait(lock, [&]
+               { return stop_ || !queue_.empty(); });
+    if (queue_.empty())
+      return;
+
+    std::vector<Span> bucket = std::move(queue_.front());
+    queue_.pop_front();
+    // once the ring has failed the remaining buckets are dropped
+    bool failed = error_ != nullptr;
+    lock.unlock();
+
+    std::exception_ptr error;
+    if (!failed)
+    {
+      try
+      {
+        allReduceBucket(bucket);
+      }
+      catch (...)
+      {
+        error = std::current_exception();
+      }
+    }
+
+    lock.lock();
+    if (error)
+      error_ = error;
+    if (--inFlight_ == 0)
+      done_.notify_all();
+  }
+}
+
+void DistributedTrainer::allReduceBucket(const std::vector<Span> &bucket)
+{
+  std::size_t n = 0;
+  for (const Span &span : bucket)
+    n += span.n;
+  MYNN_PROFILE_SCOPE("distributed.allReduce", "network", static_cast<double>(n), 8.0 * n);
+
+  // one contiguous message per bucket rather than one per tensor
+  buffer_.resize(n);
+  float *packed = buffer_.data();
+  for (const Span &span : bucket)
+  {
+    std::memcpy(packed, span.data, span.n * sizeof(float));
+    packed += span.n;
+  }
+
+  ringAllReduce(transport_, buffer_.data(), n, scratch_);
+
+  // the sum over ranks becomes the mean, i.e. the gradient of the global batch
+  float scale = 1.0f / transport_.size();
+  packed = buffer_.data();
+  for (const Span &span : bucket)
+  {
+    for (std::size_t i = 0; i < span.n; i++)
+      span.data[i] = packed[i] * scale;
+    packed += span.n;
+  }
+}
+
+void DistributedTrainer::broadcastParameters()
+{
+  // everybody but rank 0 contributes zeros, so the sum is rank 0's values exactly
+  std::vector<float> scratch;
+  for (DenseLayer &layer : net_.getLayers())
+  {
+    for (Tensor *param : {&layer.getWeights(), &layer.getBias()})
+    {
+      if (rank() != 0)
+        param->zeros();
+      ringAllReduce(transport_, param->getData().data(), static_cast<std::size_t>(param->size()), scratch);
+    }
+    layer.syncWeights();
+  }
+}
+
+float DistributedTrainer::trainBatch(const TensorView &x, const TensorView &y, const FitOptions &options)
+{
+  MYNN_PROFILE_SCOPE("distributed.trainBatch", "network");
+  double squaredError = net_.computeGradients(x, y, options.microBatchSize, x.rows(), [this](DenseLayer &layer)
+                                              { gradientsReady(layer); });
+  wait();
+
+  // the communication thread is idle now, so the loss can use the ring directly
+  float totals[2] = {static_cast<float>(squaredError), static_cast<float>(x.rows())};
+  std::vector<float> scratch;
+  ringAllReduce(transport_, totals, 2, scratch);
+
+  net_.step(options.optimizer, options.learningRate);
+  return totals[1] > 0.0f ? std::sqrt(totals[0] / totals[1]) : 0.0f;
+}
+
+std::vector<EpochStats> DistributedTrainer::fit(const Tensor &X, const Tensor &Y, const FitOptions &options)
+{
+  return net_.fit(X, Y, options, [&](const TensorView &x, const TensorView &y)
+                  { return trainBatch(x, y, options); });
+}
+
+std::vector<EpochStats> DistributedTrainer::fit(BatchLoader &loader, const FitOptions &options)
+{
+  return net_.fit(loader, options, [&](const TensorView &x, const TensorView &y)
+                  { return trainBatch(x, y, options); });
+}
@@ -0,0 +1,586 @@
+#include "Gemm.hpp"
+#include "Half.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MYNN_X86 1
+#endif
+
+using namespace myNN;
+
+namespace
+{
+  // register tile computed by one micro-kernel call
+  constexpr int MR = 6;
+  constexpr int NR = 16;
+
+  // cache blocking: an MC x KC block of A stays in L2, a KC x NR sliver of B in L1,
+  // and the KC x NC panel of B in L3
+  constexpr int MC = 144;
+  constexpr int KC = 256;
+  constexpr int NC = 4096;
+
+  // computes a full MR x NR tile of C from packed slivers of A and B
+  // stores the product plus beta * C, C is not read when beta is 0; bias (NR values,
+  // may be null) and activation are only passed for the last block of K
+  using MicroKernel = void (*)(int kc, const float *a, const float *b, float *c, int ldc, float beta,
+                               const float *bias, Activation activation);
+
+  void microKernelPortable(int kc, const float *a, const float *b, float *c, int ldc, float beta,
+                           const float *bias, Activation activation)
+  {
+    float acc[MR][NR] = {};
+    for (int p = 0; p < kc; p++)
+    {
+      for (int i = 0; i < MR; i++)
+      {
+        float ai = a[i];
+        for (int j = 0; j < NR; j++)
+        {
+          acc[i][j] += ai * b[j];
+        }
+      }
+      a += MR;
+      b += NR;
+    }
+
+    for (int i = 0; i < MR; i++)
+    {
+      for (int j = 0; j < NR; j++)
+      {
+        float v = beta != 0.0f ? beta * c[i * ldc + j] + acc[i][j] : acc[i][j];
+        if (bias)
+          v += bias[j];
+        if (activation == Activation::ReLU)
+          v = v > 0.0f ? v : 0.0f;
+        c[i * ldc + j] = v;
+      }
+    }
+  }
+
+#ifdef MYNN_X86
+  __attribute__((target("avx2,fma"))) void microKernelAvx2(int kc, const float *a, const float *b, float *c, int ldc, float beta,
+                                                           const float *bias, Activation activation)
+  {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+    for (int p = 0; p < kc; p++)
+    {
+      __m256 b0 = _mm256_loadu_ps(b);
+      __m256 b1 = _mm256_loadu_ps(b + 8);
+      __m256 ai;
+
+      ai = _mm256_broadcast_ss(a + 0);
+      c00 = _mm256_fmadd_ps(ai, b0, c00);
+      c01 = _mm256_fmadd_ps(ai, b1, c01);
+      ai = _mm256_broadcast_ss(a + 1);
+      c10 = _mm256_fmadd_ps(ai, b0, c10);
+      c11 = _mm256_fmadd_ps(ai, b1, c11);
+      ai = _mm256_broadcast_ss(a + 2);
+      c20 = _mm256_fmadd_ps(ai, b0, c20);
+      c21 = _mm256_fmadd_ps(ai, b1, c21);
+      ai = _mm256_broadcast_ss(a + 3);
+      c30 = _mm256_fmadd_ps(ai, b0, c30);
+      c31 = _mm256_fmadd_ps(ai, b1, c31);
+      ai = _mm256_broadcast_ss(a + 4);
+      c40 = _mm256_fmadd_ps(ai, b0, c40);
+      c41 = _mm256_fmadd_ps(ai, b1, c41);
+      ai = _mm256_broadcast_ss(a + 5);
+      c50 = _mm256_fmadd_ps(ai, b0, c50);
+      c51 = _mm256_fmadd_ps(ai, b1, c51);
+
+      a += MR;
+      b += NR;
+    }
+
+    __m256 bias0 = bias ? _mm256_loadu_ps(bias) : _mm256_setzero_ps();
+    __m256 bias1 = bias ? _mm256_loadu_ps(bias + 8) : _mm256_setzero_ps();
+    bool relu = activation == Activation::ReLU;
+    __m256 zero = _mm256_setzero_ps();
+    __m256 betaV = _mm256_set1_ps(beta);
+
+    __m256 rows[MR][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+    for (int i = 0; i < MR; i++)
+    {
+      float *ci = c + i * ldc;
+      if (beta != 0.0f)
+      {
+        rows[i][0] = _mm256_fmadd_ps(betaV, _mm256_loadu_ps(ci), rows[i][0]);
+        rows[i][1] = _mm256_fmadd_ps(betaV, _mm256_loadu_ps(ci + 8), rows[i][1]);
+      }
+      rows[i][0] = _mm256_add_ps(rows[i][0], bias0);
+      rows[i][1] = _mm256_add_ps(rows[i][1], bias1);
+      if (relu)
+      {
+        rows[i][0] = _mm256_max_ps(rows[i][0], zero);
+        rows[i][1] = _mm256_max_ps(rows[i][1], zero);
+      }
+      _mm256_storeu_ps(ci, rows[i][0]);
+      _mm256_storeu_ps(ci + 8, rows[i][1]);
+    }
+  }
+#endif
+
+  // products with fewer rows than a register tile skip packing: B is streamed as
+  // stored, GEMV_NB columns of C at a time, with A copied GEMV_KC elements at a time
+  constexpr int GEMV_NB = 64;
+  constexpr int GEMV_KC = 1024;
+
+  // acc[j] += sum_p a[p] * b[p * ldb + j] for j < n, rows of B are contiguous
+  using GemvKernel = void (*)(int k, int n, const float *a, const float *b, int ldb, float *acc);
+
+  inline __attribute__((always_inline)) void gemvRowsAny(int k, int n, const float *a, const float *b, int ldb,
+                                                         float *__restrict acc)
+  {
+    for (int p = 0; p < k; p++)
+    {
+      float ap = a[p];
+      const float *__restrict bp = b + static_cast<size_t>(p) * ldb;
+      for (int j = 0; j < n; j++)
+        acc[j] += ap * bp[j];
+    }
+  }
+
+  // acc[j] += sum_p a[p] * b[j * ldb + p] for j < n, columns of B are contiguous;
+  // one running sum per lane so the dot products vectorise without reassociating
+  constexpr int DOT_LANES = 16;
+
+  inline __attribute__((always_inline)) void gemvColumnsAny(int k, int n, const float *a, const float *b, int ldb,
+                                                            float *__restrict acc)
+  {
+    for (int j = 0; j < n; j++)
+    {
+      const float *__restrict bj = b + static_cast<size_t>(j) * ldb;
+      float lanes[DOT_LANES] = {};
+      int p = 0;
+      for (; p + DOT_LANES <= k; p += DOT_LANES)
+      {
+        for (int l = 0; l < DOT_LANES; l++)
+          lanes[l] += a[p + l] * bj[p + l];
+      }
+      for (int l = 0; p < k; p++, l++)
+        lanes[l] += a[p] * bj[p];
+
+      for (int width = DOT_LANES / 2; width > 0; width /= 2)
+      {
+        for (int l = 0; l < width; l++)
+          lanes[l] += lanes[l + width];
+      }
+      acc[j] += lanes[0];
+    }
+  }
+
+  void gemvRowsPortable(int k, int n, const float *a, const float *b, int ldb, float *acc)
+  {
+    gemvRowsAny(k, n, a, b, ldb, acc);
+  }
+
+  void gemvColumnsPortable(int k, int n, const float *a, const float *b, int ldb, float *acc)
+  {
+    gemvColumnsAny(k, n, a, b, ldb, acc);
+  }
+
+#ifdef MYNN_X86
+  __attribute__((target("avx2,fma"))) void gemvRowsAvx2(int k, int n, const float *a, const float *b, int ldb,
+                                                         float *acc)
+  {
+    gemvRowsAny(k, n, a, b, ldb, acc);
+  }
+
+  __attribute__((target("avx2,fma"))) void gemvColumnsAvx2(int k, int n, const float *a, const float *b, int ldb,
+                                                            float *acc)
+  {
+    gemvColumnsAny(k, n, a, b, ldb, acc);
+  }
+#endif
+
+  struct KernelChoice
+  {
+    MicroKernel kernel;
+    GemvKernel gemvRows;
+    GemvKernel gemvColumns;
+    const char *name;
+  };
+
+  KernelChoice pickKernel()
+  {
+#ifdef MYNN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return {microKernelAvx2, gemvRowsAvx2, gemvColumnsAvx2, "avx2+fma"};
+#endif
+    return {microKernelPortable, gemvRowsPortable, gemvColumnsPortable, "portable"};
+  }
+
+  const KernelChoice &kernelChoice()
+  {
+    static const KernelChoice choice = pickKernel();
+    return choice;
+  }
+
+  // reads elements of a stored operand as fp32; row copies n contiguous elements
+  struct FloatSource
+  {
+    const float *data;
+
+    float operator()(size_t i) const { return data[i]; }
+
+    void row(size_t i, int n, float *dst) const { std::memcpy(dst, data + i, sizeof(float) * n); }
+  };
+
+  template <DType T>
+  struct HalfSource
+  {
+    const std::uint16_t *data;
+
+    float operator()(size_t i) const { return T == DType::BFloat16 ? bf16ToFloat(data[i]) : halfToFloat(data[i]); }
+
+    void row(size_t i, int n, float *dst) const { toFloat(data + i, dst, n, T); }
+  };
+
+  // copy an mc x kc block of A, scaled by alpha, into slivers of MR rows, stored column
+  // by column; rows past mc are zero padded so the micro-kernel never needs bounds checks
+  // element (i, p) of the block is A(base + i * rs + p * cs)
+  template <typename Source>
+  void packA(int mc, int kc, const Source &A, size_t base, int rs, int cs, float alpha, float *dst)
+  {
+    for (int ir = 0; ir < mc; ir += MR)
+    {
+      int mr = std::min(MR, mc - ir);
+      for (int p = 0; p < kc; p++)
+      {
+        for (int i = 0; i < mr; i++)
+          dst[i] = alpha * A(base + static_cast<size_t>(ir + i) * rs + static_cast<size_t>(p) * cs);
+        for (int i = mr; i < MR; i++)
+          dst[i] = 0.0f;
+        dst += MR;
+      }
+    }
+  }
+
+  // copy a kc x nc block of B into slivers of NR columns, stored row by row
+  // element (p, j) of the block is B(base + p * rs + j * cs)
+  template <typename Source>
+  void packB(int kc, int nc, const Source &B, size_t base, int rs, int cs, float *dst)
+  {
+    for (int jr = 0; jr < nc; jr += NR)
+    {
+      int nr = std::min(NR, nc - jr);
+      for (int p = 0; p < kc; p++)
+      {
+        size_t src = base + static_cast<size_t>(p) * rs + static_cast<size_t>(jr) * cs;
+        if (cs == 1)
+        {
+          B.row(src, nr, dst);
+        }
+        else
+        {
+          for (int j = 0; j < nr; j++)
+            dst[j] = B(src + static_cast<size_t>(j) * cs);
+        }
+        for (int j = nr; j < NR; j++)
+          dst[j] = 0.0f;
+        dst += NR;
+      }
+    }
+  }
+
+  // per-thread buffer for packed blocks of A
+  std::vector<float> &packBufferA()
+  {
+    thread_local std::vector<float> buffer(static_cast<size_t>(MC) * KC);
+    return buffer;
+  }
+
+  // multiply a packed mc x kc block of A with a packed kc x nc panel of B into C
+  // bias points at the bias of the panel's first column and is null unless this is the last block of K
+  void macroKernel(int mc, int nc, int kc, const float *packedA, const float *packedB,
+                   float *C, int ldc, float beta, MicroKernel kernel,
+                   const float *bias, Activation activation)
+  {
+    for (int jr = 0; jr < nc; jr += NR)
+    {
+      int nr = std::min(NR, nc - jr);
+      for (int ir = 0; ir < mc; ir += MR)
+      {
+        int mr = std::min(MR, mc - ir);
+        const float *a = packedA + ir * kc;
+        const float *b = packedB + jr * kc;
+        float *c = C + ir * ldc + jr;
+
+        const float *biasTile = bias ? bias + jr : nullptr;
+
+        if (mr == MR && nr == NR)
+        {
+          kernel(kc, a, b, c, ldc, beta, biasTile, activation);
+          continue;
+        }
+
+        // edge tile: compute the full tile into scratch and copy the valid part
+        float tile[MR * NR];
+        kernel(kc, a, b, tile, NR, 0.0f, nullptr, Activation::None);
+        for (int i = 0; i < mr; i++)
+        {
+          for (int j = 0; j < nr; j++)
+          {
+            float v = tile[i * NR + j];
+            if (beta != 0.0f)
+              v += beta * c[i * ldc + j];
+            if (biasTile)
+              v += biasTile[j];
+            if (activation == Activation::ReLU)
+              v = v > 0.0f ? v : 0.0f;
+            c[i * ldc + j] = v;
+          }
+        }
+      }
+    }
+  }
+
+  // C = A * B for M < MR with B in fp32 and either its rows or its columns contiguous;
+  // returns false when B is stored any other way
+  template <typename SourceA, typename SourceB>
+  bool smallGemm(int M, int N, int K,
+                 const SourceA &A, int rsA, int csA,
+                 const SourceB &B, int rsB, int csB,
+                 float *C, int ldc,
+                 const GemmEpilogue &epilogue)
+  {
+    if constexpr (!std::is_same_v<SourceB, FloatSource>)
+    {
+      return false;
+    }
+    else
+    {
+      if (csB != 1 && rsB != 1)
+        return false;
+
+      bool rows = csB == 1;
+      GemvKernel kernel = rows ? kernelChoice().gemvRows : kernelChoice().gemvColumns;
+      int ldb = rows ? rsB : csB;
+      int nTiles = (N + GEMV_NB - 1) / GEMV_NB;
+
+      parallelFor(0, nTiles, static_cast<size_t>(M) * N * K, [&](int lo, int hi)
+                  {
+                    float a[GEMV_KC];
+                    for (int t = lo; t < hi; t++)
+                    {
+                      int j0 = t * GEMV_NB;
+                      int nb = std::min(GEMV_NB, N - j0);
+                      for (int i = 0; i < M; i++)
+                      {
+                        float acc[GEMV_NB] = {};
+                        for (int p0 = 0; p0 < K; p0 += GEMV_KC)
+                        {
+                          int kb = std::min(GEMV_KC, K - p0);
+                          for (int p = 0; p < kb; p++)
+                            a[p] = A(static_cast<size_t>(i) * rsA + static_cast<size_t>(p0 + p) * csA);
+                          const float *b = rows ? B.data + static_cast<size_t>(p0) * rsB + j0
+                                                : B.data + static_cast<size_t>(j0) * csB + p0;
+                          kernel(kb, nb, a, b, ldb, acc);
+                        }
+
+                        float *c = C + static_cast<size_t>(i) * ldc + j0;
+                        for (int j = 0; j < nb; j++)
+                        {
+                          float v = epilogue.alpha * acc[j];
+                          if (epilogue.beta != 0.0f)
+                            v += epilogue.beta * c[j];
+                          if (epilogue.bias)
+                            v += epilogue.bias[j0 + j];
+                          if (epilogue.activation == Activation::ReLU)
+                            v = v > 0.0f ? v : 0.0f;
+                          c[j] = v;
+                        }
+                      }
+                    }
+                  });
+      return true;
+    }
+  }
+
+  // blocked C = A * B, operands are read through their sources only while packing
+  template <typename SourceA, typename SourceB>
+  void gemmImpl(int M, int N, int K,
+                const SourceA &A, int rsA, int csA,
+                const SourceB &B, int rsB, int csB,
+                float *C, int ldc,
+                const GemmEpilogue &epilogue)
+  {
+    if (M <= 0 || N <= 0)
+      return;
+
+    if (K <= 0)
+    {
+      for (int i = 0; i < M; i++)
+      {
+        for (int j = 0; j < N; j++)
+        {
+          float v = epilogue.beta != 0.0f ? epilogue.beta * C[i * ldc + j] : 0.0f;
+          if (epilogue.bias)
+            v += epilogue.bias[j];
+          if (epilogue.activation == Activation::ReLU)
+            v = v > 0.0f ? v : 0.0f;
+          C[i * ldc + j] = v;
+        }
+      }
+      return;
+    }
+
+    if (M < MR && smallGemm(M, N, K, A, rsA, csA, B, rsB, csB, C, ldc, epilogue))
+      return;
+
+    MicroKernel kernel = kernelChoice().kernel;
+
+    // the packed panel of B is shared by all threads working on it; it only grows to
+    // the largest panel this thread has packed so far
+    thread_local std::vector<float> packedB;
+    size_t panelSize = static_cast<size_t>(std::min(K, KC)) * ((std::min(N, NC) + NR - 1) / NR * NR);
+    if (packedB.size() < panelSize)
+      packedB.resize(panelSize);
+
+    int nThreads = ThreadPool::instance().numThreads();
+
+    for (int jc = 0; jc < N; jc += NC)
+    {
+      int nc = std::min(NC, N - jc);
+      int nSlivers = (nc + NR - 1) / NR;
+
+      for (int pc = 0; pc < K; pc += KC)
+      {
+        int kc = std::min(KC, K - pc);
+        bool lastK = pc + kc >= K;
+        const float *bias = lastK && epilogue.bias ? epilogue.bias + jc : nullptr;
+        Activation activation = lastK ? epilogue.activation : Activation::None;
+        float beta = pc > 0 ? 1.0f : epilogue.beta;
+        float *panel = packedB.data();
+        size_t srcB = static_cast<size_t>(pc) * rsB + static_cast<size_t>(jc) * csB;
+
+        parallelFor(0, nSlivers, static_cast<size_t>(kc) * nc, [&](int lo, int hi)
+                    {
+                      int jr = lo * NR;
+                      int ncPart = std::min(hi * NR, nc) - jr;
+                      packB(kc, ncPart, B, srcB + static_cast<size_t>(jr) * csB, rsB, csB, panel + jr * kc);
+                    });
+
+        // tasks are (block of A rows, slice of the B panel) pairs; the panel is only
+        // split when there are fewer row blocks than threads
+        int mBlocks = (M + MC - 1) / MC;
+        int nSplit = std::min(nSlivers, std::max(1, (nThreads + mBlocks - 1) / mBlocks));
+        size_t work = static_cast<size_t>(M) * nc * kc;
+
+        parallelFor(0, mBlocks * nSplit, work, [&](int lo, int hi)
+                    {
+                      std::vector<float> &packedA = packBufferA();
+                      int packedBlock = -1;
+                      for (int t = lo; t < hi; t++)
+                      {
+                        int block = t / nSplit;
+                        int split = t % nSplit;
+                        int first = split * nSlivers / nSplit;
+                        int last = (split + 1) * nSlivers / nSplit;
+                        if (first == last)
+                          continue;
+
+                        int ic = block * MC;
+                        int mc = std::min(MC, M - ic);
+                        if (block != packedBlock)
+                        {
+                          packA(mc, kc, A, static_cast<size_t>(ic) * rsA + static_cast<size_t>(pc) * csA, rsA, csA, epilogue.alpha, packedA.data());
+                          packedBlock = block;
+                        }
+
+                        int jr = first * NR;
+                        int ncPart = std::min(last * NR, nc) - jr;
+                        macroKernel(mc, ncPart, kc, packedA.data(), panel + jr * kc,
+                                    C + ic * ldc + jc + jr, ldc, beta, kernel,
+                                    bias ? bias + jr : nullptr, activation);
+                      }
+                    });
+      }
+    }
+  }
+}
+
+void myNN::gemm(bool transA, bool transB,
+                int M, int N, int K,
+                const float *A, int lda,
+                const float *B, int ldb,
+                float *C, int ldc,
+                const GemmEpilogue &epilogue)
+{
+  // row and column strides of op(A) and op(B)
+  int rsA = transA ? 1 : lda;
+  int csA = transA ? lda : 1;
+  int rsB = transB ? 1 : ldb;
+  int csB = transB ? ldb : 1;
+
+  gemmStrided(M, N, K, A, rsA, csA, B, rsB, csB, C, ldc, epilogue);
+}
+
+void myNN::gemmStrided(int M, int N, int K,
+                       const float *A, int rsA, int csA,
+                       const float *B, int rsB, int csB,
+                       float *C, int ldc,
+                       const GemmEpilogue &epilogue)
+{
+  gemmImpl(M, N, K, FloatSource{A}, rsA, csA, FloatSource{B}, rsB, csB, C, ldc, epilogue);
+}
+
+namespace
+{
+  template <typename SourceA>
+  void gemmMixedB(int M, int N, int K, const SourceA &A, int rsA, int csA,
+                  const void *B, DType typeB, int rsB, int csB,
+                  float *C, int ldc, const GemmEpilogue &epilogue)
+  {
+    switch (typeB)
+    {
+    case DType::Float32:
+      gemmImpl(M, N, K, A, rsA, csA, FloatSource{static_cast<const float *>(B)}, rsB, csB, C, ldc, epilogue);
+      break;
+    case DType::BFloat16:
+      gemmImpl(M, N, K, A, rsA, csA, HalfSource<DType::BFloat16>{static_cast<const std::uint16_t *>(B)}, rsB, csB, C, ldc, epilogue);
+      break;
+    case DType::Float16:
+      gemmImpl(M, N, K, A, rsA, csA, HalfSource<DType::Float16>{static_cast<const std::uint16_t *>(B)}, rsB, csB, C, ldc, epilogue);
+      break;
+    }
+  }
+}
+
+void myNN::gemmMixed(int M, int N, int K,
+                     const void *A, DType typeA, int rsA, int csA,
+                     const void *B, DType typeB, int rsB, int csB,
+                     float *C, int ldc,
+                     const GemmEpilogue &epilogue)
+{
+  switch (typeA)
+  {
+  case DType::Float32:
+    gemmMixedB(M, N, K, FloatSource{static_cast<const float *>(A)}, rsA, csA, B, typeB, rsB, csB, C, ldc, epilogue);
+    break;
+  case DType::BFloat16:
+    gemmMixedB(M, N, K, HalfSource<DType::BFloat16>{static_cast<const std::uint16_t *>(A)}, rsA, csA, B, typeB, rsB, csB, C, ldc, epilogue);
+    break;
+  case DType::Float16:
+    gemmMixedB(M, N, K, HalfSource<DType::Float16>{static_cast<const std::uint16_t *>(A)}, rsA, csA, B, typeB, rsB, csB, C, ldc, epilogue);
+    break;
+  }
+}
+
+const char *myNN::gemmKernelName()
+{
+  return kernelChoice().name;
+}
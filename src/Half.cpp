@@ -0,0 +1,245 @@
+#include "Half.hpp"
+#include "Tensor.hpp"
+
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MYNN_X86 1
+#endif
+
+using namespace myNN;
+
+namespace
+{
+  using Widen = void (*)(const std::uint16_t *src, float *dst, int n);
+  using Narrow = void (*)(const float *src, std::uint16_t *dst, int n);
+
+  void bf16ToFloatPortable(const std::uint16_t *src, float *dst, int n)
+  {
+    for (int i = 0; i < n; i++)
+      dst[i] = bf16ToFloat(src[i]);
+  }
+
+  void bf16FromFloatPortable(const float *src, std::uint16_t *dst, int n)
+  {
+    for (int i = 0; i < n; i++)
+      dst[i] = floatToBf16(src[i]);
+  }
+
+  void halfToFloatPortable(const std::uint16_t *src, float *dst, int n)
+  {
+    for (int i = 0; i < n; i++)
+      dst[i] = halfToFloat(src[i]);
+  }
+
+  void halfFromFloatPortable(const float *src, std::uint16_t *dst, int n)
+  {
+    for (int i = 0; i < n; i++)
+      dst[i] = floatToHalf(src[i]);
+  }
+
+#ifdef MYNN_X86
+  // bf16 is the top half of an fp32, so widening is a zero extend and a shift
+  __attribute__((target("avx2"))) void bf16ToFloatAvx2(const std::uint16_t *src, float *dst, int n)
+  {
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+      __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+      _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(v, 16)));
+    }
+    bf16ToFloatPortable(src + i, dst + i, n - i);
+  }
+
+  __attribute__((target("avx2"))) void bf16FromFloatAvx2(const float *src, std::uint16_t *dst, int n)
+  {
+    const __m256i bias = _mm256_set1_epi32(0x7fff);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i quiet = _mm256_set1_epi32(0x400000);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+      __m256 f = _mm256_loadu_ps(src + i);
+      __m256i x = _mm256_castps_si256(f);
+
+      // round to nearest even, NaNs are kept quiet instead of rounded
+      __m256i rounded = _mm256_add_epi32(x, _mm256_add_epi32(bias, _mm256_and_si256(_mm256_srli_epi32(x, 16), one)));
+      __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(f, f, _CMP_UNORD_Q));
+      rounded = _mm256_blendv_epi8(rounded, _mm256_or_si256(x, quiet), nan);
+
+      // pack the high halves, packus works per 128 bit lane so fix the order afterwards
+      __m256i high = _mm256_srli_epi32(rounded, 16);
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(high, high), _MM_SHUFFLE(3, 1, 2, 0));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm256_castsi256_si128(packed));
+    }
+    bf16FromFloatPortable(src + i, dst + i, n - i);
+  }
+
+  __attribute__((target("avx,f16c"))) void halfToFloatF16c(const std::uint16_t *src, float *dst, int n)
+  {
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+      _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i))));
+    halfToFloatPortable(src + i, dst + i, n - i);
+  }
+
+  __attribute__((target("avx,f16c"))) void halfFromFloatF16c(const float *src, std::uint16_t *dst, int n)
+  {
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                       _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+    halfFromFloatPortable(src + i, dst + i, n - i);
+  }
+#endif
+
+  struct ConvertChoice
+  {
+    Widen bf16Widen;
+    Narrow bf16Narrow;
+    Widen halfWiden;
+    Narrow halfNarrow;
+  };
+
+  ConvertChoice pickConverters()
+  {
+    ConvertChoice choice = {bf16ToFloatPortable, bf16FromFloatPortable, halfToFloatPortable, halfFromFloatPortable};
+#ifdef MYNN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+      choice.bf16Widen = bf16ToFloatAvx2;
+      choice.bf16Narrow = bf16FromFloatAvx2;
+    }
+    if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+    {
+      choice.halfWiden = halfToFloatF16c;
+      choice.halfNarrow = halfFromFloatF16c;
+    }
+#endif
+    return choice;
+  }
+
+  const ConvertChoice &converters()
+  {
+    static const ConvertChoice choice = pickConverters();
+    return choice;
+  }
+}
+
+void myNN::toFloat(const std::uint16_t *src, float *dst, int n, DType dtype)
+{
+  switch (dtype)
+  {
+  case DType::BFloat16:
+    converters().bf16Widen(src, dst, n);
+    break;
+  case DType::Float16:
+    converters().halfWiden(src, dst, n);
+    break;
+  default:
+    throw std::runtime_error("toFloat needs a 16 bit dtype");
+  }
+}
+
+void myNN::fromFloat(const float *src, std::uint16_t *dst, int n, DType dtype)
+{
+  switch (dtype)
+  {
+  case DType::BFloat16:
+    converters().bf16Narrow(src, dst, n);
+    break;
+  case DType::Float16:
+    converters().halfNarrow(src, dst, n);
+    break;
+  default:
+    throw std::runtime_error("fromFloat needs a 16 bit dtype");
+  }
+}
+
+HalfTensor::HalfTensor(const TensorView &src, DType dtype) : dtype_(dtype)
+{
+  if (dtype == DType::Float32)
+    throw std::runtime_error("HalfTensor needs a 16 bit dtype");
+  assign(src);
+}
+
+void HalfTensor::assign(const TensorView &src)
+{
+  rows_ = src.rows();
+  cols_ = src.cols();
+  data_.resize(static_cast<size_t>(rows_) * cols_);
+
+  if (src.isContiguous())
+  {
+    fromFloat(src.data(), data_.data(), src.size(), dtype_);
+    return;
+  }
+  for (int i = 0; i < rows_; i++)
+    for (int j = 0; j < cols_; j++)
+      data_[static_cast<size_t>(i) * cols_ + j] = dtype_ == DType::BFloat16 ? floatToBf16(src(i, j)) : floatToHalf(src(i, j));
+}
+
+Tensor HalfTensor::toFloat() const
+{
+  Tensor result({rows_, cols_});
+  myNN::toFloat(data_.data(), result.getData().data(), size(), dtype_);
+  return result;
+}
+
+Tensor myNN::matMulBias(const TensorView &a, const HalfTensor &w, const TensorView &bias, Activation activation)
+{
+  if (a.cols() != w.rows())
+  {
+    throw std::runtime_error("matMul shapes not compatible");
+  }
+  if (bias.size() != w.cols() || !bias.isContiguous())
+  {
+    throw std::runtime_error("bias shape not compatible");
+  }
+
+  GemmEpilogue epilogue;
+  epilogue.bias = bias.data();
+  epilogue.activation = activation;
+
+  Tensor result({a.rows(), w.cols()});
+  gemmMixed(a.rows(), w.cols(), a.cols(), a.data(), DType::Float32, a.rowStride(), a.colStride(),
+            w.data(), w.dtype(), w.cols(), 1, result.getData().data(), w.cols(), epilogue);
+  return result;
+}
+
+Tensor myNN::matMulBias(const HalfTensor &a, const HalfTensor &w, const TensorView &bias, Activation activation)
+{
+  if (a.cols() != w.rows())
+  {
+    throw std::runtime_error("matMul shapes not compatible");
+  }
+  if (bias.size() != w.cols() || !bias.isContiguous())
+  {
+    throw std::runtime_error("bias shape not compatible");
+  }
+
+  GemmEpilogue epilogue;
+  epilogue.bias = bias.data();
+  epilogue.activation = activation;
+
+  Tensor result({a.rows(), w.cols()});
+  gemmMixed(a.rows(), w.cols(), a.cols(), a.data(), a.dtype(), a.cols(), 1,
+            w.data(), w.dtype(), w.cols(), 1, result.getData().data(), w.cols(), epilogue);
+  return result;
+}
+
+Tensor myNN::matMulTranspose(const TensorView &a, const HalfTensor &w)
+{
+  if (a.cols() != w.cols())
+  {
+    throw std::runtime_error("matMul shapes not compatible");
+  }
+
+  // element (p, j) of w^T is w[j * cols + p]
+  Tensor result({a.rows(), w.rows()});
+  gemmMixed(a.rows(), w.rows(), a.cols(), a.data(), DType::Float32, a.rowStride(), a.colStride(),
+            w.data(), w.dtype(), 1, w.cols(), result.getData().data(), w.rows());
+  return result;
+}
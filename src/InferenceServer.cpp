@@ -0,0 +1,223 @@
+#include "InferenceServer.hpp"
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+
+using namespace myNN;
+
+namespace
+{
+  // 1 us to about 70 s in quarter octaves
+  constexpr int LATENCY_BUCKETS = 105;
+
+  Histogram latencyHistogram()
+  {
+    Histogram h;
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+      h.bounds.push_back(std::pow(2.0, b / 4.0));
+    h.counts.assign(h.bounds.size(), 0);
+    return h;
+  }
+
+  Histogram batchHistogram(int maxBatch)
+  {
+    Histogram h;
+    for (int n = 1; n <= maxBatch; n++)
+      h.bounds.push_back(n);
+    h.counts.assign(h.bounds.size(), 0);
+    return h;
+  }
+}
+
+void Histogram::add(double value)
+{
+  std::size_t b = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+  counts[std::min(b, counts.size() - 1)]++;
+  total++;
+}
+
+double Histogram::percentile(double p) const
+{
+  if (total == 0)
+    return 0.0;
+
+  // rank of the quantile, counted from 1
+  long rank = std::max(1L, static_cast<long>(std::ceil(p * total)));
+  long seen = 0;
+  for (std::size_t b = 0; b < counts.size(); b++)
+  {
+    seen += counts[b];
+    if (seen >= rank)
+      return bounds[b];
+  }
+  return bounds.back();
+}
+
+InferenceServer::InferenceServer(const Network &net, const ServerOptions &options) : net_(net), options_(options)
+{
+  if (options_.maxBatch <= 0)
+    throw std::runtime_error("InferenceServer needs a positive batch size");
+  if (net_.getLayers().empty())
+    throw std::runtime_error("InferenceServer needs a network with a Dense layer");
+
+  inputSize_ = net_.getLayers().front().getWeights().getShape()[0];
+  batch_ = Tensor({options_.maxBatch, inputSize_});
+  running_.reserve(options_.maxBatch);
+  resetStats();
+
+  scheduler_ = std::thread([this]
+                           { schedulerLoop(); });
+}
+
+InferenceServer::~InferenceServer()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  scheduler_.join();
+}
+
+std::future<Tensor> InferenceServer::submit(const TensorView &sample)
+{
+  if (sample.rows() != 1 || sample.cols() != inputSize_)
+    throw std::runtime_error("InferenceServer takes one sample row of inputSize columns");
+
+  Request request;
+  request.input = Tensor(sample);
+  std::future<Tensor> result = request.result.get_future();
+  // the scheduler only needs waking for the first request of a batch and a full one
+  bool notify;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    request.submitted = std::chrono::steady_clock::now();
+    queue_.push_back(std::move(request));
+    notify = queue_.size() == 1 || queue_.size() >= static_cast<std::size_t>(options_.maxBatch);
+  }
+  if (notify)
+    wake_.notify_one();
+  return result;
+}
+
+void InferenceServer::schedulerLoop()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true)
+  {
+    wake_.wait(lock, [&]
+               { return stop_ || !queue_.empty(); });
+    if (queue_.empty())
+      return;
+
+    // wait for a full batch until the oldest request is due; when stopping, what is
+    // queued goes out right away
+    std::chrono::steady_clock::time_point due = queue_.front().submitted + options_.maxWait;
+    wake_.wait_until(lock, due, [&]
+                     { return stop_ || queue_.size() >= static_cast<std::size_t>(options_.maxBatch); });
+
+    std::size_t n = std::min(queue_.size(), static_cast<std::size_t>(options_.maxBatch));
+    for (std::size_t i = 0; i < n; i++)
+    {
+      running_.push_back(std::move(queue_.front()));
+      queue_.pop_front();
+    }
+    lock.unlock();
+    runBatch();
+    lock.lock();
+  }
+}
+
+void InferenceServer::runBatch()
+{
+  int rows = static_cast<int>(running_.size());
+  MYNN_PROFILE_SCOPE("server.batch", "network");
+
+  float *packed = batch_.getData().data();
+  for (int r = 0; r < rows; r++)
+    std::memcpy(packed + static_cast<std::size_t>(r) * inputSize_, running_[r].input.data(), inputSize_ * sizeof(float));
+
+  Tensor output;
+  std::exception_ptr error;
+  try
+  {
+    output = net_.predict(batch_.view().rowSlice(0, rows));
+  }
+  catch (...)
+  {
+    error = std::current_exception();
+  }
+
+  // recorded before any caller can see its result, so the stats cover every answered request
+  std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+  std::vector<double> latencies(rows);
+  for (int r = 0; r < rows; r++)
+    latencies[r] = std::chrono::duration<double, std::micro>(done - running_[r].submitted).count();
+  record(latencies, rows);
+
+  int cols = output.getShape()[1];
+  for (int r = 0; r < rows; r++)
+  {
+    // every request of a failed batch gets the same error
+    if (error)
+    {
+      running_[r].result.set_exception(error);
+      continue;
+    }
+    Tensor row({1, cols});
+    std::memcpy(row.getData().data(), output.data() + static_cast<std::size_t>(r) * cols, cols * sizeof(float));
+    running_[r].result.set_value(std::move(row));
+  }
+  running_.clear();
+}
+
+void InferenceServer::record(const std::vector<double> &latencies, int batchRows)
+{
+  std::lock_guard<std::mutex> lock(statsMutex_);
+  stats_.batches++;
+  stats_.batchSizes.add(batchRows);
+  for (double us : latencies)
+  {
+    stats_.requests++;
+    stats_.latencyUs.add(us);
+    stats_.maxUs = std::max(stats_.maxUs, us);
+  }
+}
+
+ServerStats InferenceServer::stats() const
+{
+  std::lock_guard<std::mutex> lock(statsMutex_);
+  ServerStats stats = stats_;
+  stats.p50Us = stats.latencyUs.percentile(0.50);
+  stats.p99Us = stats.latencyUs.percentile(0.99);
+  return stats;
+}
+
+void InferenceServer::resetStats()
+{
+  std::lock_guard<std::mutex> lock(statsMutex_);
+  stats_ = ServerStats();
+  stats_.latencyUs = latencyHistogram();
+  stats_.batchSizes = batchHistogram(options_.maxBatch);
+}
+
+void InferenceServer::printStats(std::ostream &out) const
+{
+  ServerStats s = stats();
+  out << std::fixed << std::setprecision(1)
+      << "requests " << s.requests << " in " << s.batches << " batches, mean batch " << s.meanBatchSize() << "\n"
+      << "latency us p50 " << s.p50Us << " p99 " << s.p99Us << " max " << s.maxUs << "\n";
+  out << std::setw(8) << "batch" << std::setw(10) << "count" << "\n";
+  for (std::size_t b = 0; b < s.batchSizes.counts.size(); b++)
+  {
+    if (s.batchSizes.counts[b] > 0)
+      out << std::setw(8) << static_cast<int>(s.batchSizes.bounds[b]) << std::setw(10) << s.batchSizes.counts[b] << "\n";
+  }
+  out << std::defaultfloat;
+}
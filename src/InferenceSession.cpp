@@ -0,0 +1,120 @@
+#include "InferenceSession.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace myNN;
+
+InferenceSession::InferenceSession(const Network &net, int maxBatch) : maxBatch_(maxBatch)
+{
+  if (!net.activationsFoldIntoDense())
+    throw std::runtime_error("InferenceSession needs every activation right after a Dense layer");
+
+  const std::vector<DenseLayer> &layers = net.getLayers();
+  params_.reserve(2 * layers.size());
+  sparse_.resize(layers.size());
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    if (layers[i].isSparse())
+    {
+      sparse_[i] = layers[i].getSparseWeights();
+      params_.push_back(Tensor());
+    }
+    else
+      params_.push_back(layers[i].getWeights());
+    params_.push_back(layers[i].getBias());
+  }
+
+  // views are taken after the vector stops growing
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    const Tensor &w = layers[i].getWeights();
+    if (layers[i].isSparse())
+      weights_.push_back(TensorView(nullptr, w.getShape()[0], w.getShape()[1], w.getShape()[1], 1));
+    else
+      weights_.push_back(params_[2 * i]);
+    bias_.push_back(params_[2 * i + 1]);
+    activations_.push_back(net.activationAfter(static_cast<int>(i)));
+  }
+  planBuffers();
+}
+
+InferenceSession::InferenceSession(const MappedCheckpoint &checkpoint, int maxBatch) : maxBatch_(maxBatch)
+{
+  for (int i = 0; i < checkpoint.numLayers(); i++)
+  {
+    weights_.push_back(checkpoint.weights(i));
+    bias_.push_back(checkpoint.bias(i));
+    activations_.push_back(checkpoint.activation(i));
+  }
+  sparse_.resize(weights_.size());
+  planBuffers();
+}
+
+void InferenceSession::planBuffers()
+{
+  if (maxBatch_ <= 0)
+    throw std::runtime_error("InferenceSession needs a positive batch size");
+
+  // run() hands these straight to the kernels, so a mapped checkpoint with shapes that
+  // do not chain must fail here rather than read past its tensors
+  for (size_t i = 0; i < weights_.size(); i++)
+  {
+    if (i > 0 && weights_[i].rows() != weights_[i - 1].cols())
+      throw std::runtime_error("InferenceSession layer shapes not compatible");
+    if (bias_[i].size() != weights_[i].cols() || !bias_[i].isContiguous())
+      throw std::runtime_error("InferenceSession bias shape not compatible");
+    maxWidth_ = std::max(maxWidth_, weights_[i].cols());
+    if (sparse_[i].rows() > 0)
+      scratch_.reserve(maxBatch_, weights_[i].rows(), weights_[i].cols());
+  }
+
+  // a single layer only ever writes the first buffer
+  buffers_[0] = Tensor({maxBatch_, maxWidth_});
+  if (weights_.size() > 1)
+    buffers_[1] = Tensor({maxBatch_, maxWidth_});
+}
+
+std::size_t InferenceSession::memoryBytes() const
+{
+  std::size_t floats = 0;
+  for (const Tensor &p : params_)
+    floats += p.size();
+  floats += buffers_[0].size() + buffers_[1].size();
+  std::size_t bytes = floats * sizeof(float);
+  for (const SparseTensor &s : sparse_)
+    bytes += s.bytes();
+  return bytes + scratch_.bytes();
+}
+
+TensorView InferenceSession::run(const TensorView &input)
+{
+  int n = input.rows();
+  if (n > maxBatch_)
+    throw std::runtime_error("batch larger than the session was planned for");
+  if (weights_.empty())
+    return input;
+  if (input.cols() != inputSize())
+    throw std::runtime_error("input shape not compatible");
+
+  TensorView x = input;
+  for (size_t i = 0; i < weights_.size(); i++)
+  {
+    const TensorView &w = weights_[i];
+    int width = w.cols();
+    float *out = buffers_[i % 2].getData().data();
+
+    GemmEpilogue epilogue;
+    epilogue.bias = bias_[i].data();
+    epilogue.activation = activations_[i];
+    if (sparse_[i].rows() > 0)
+      sparseMatMulTranspose(x, sparse_[i], out, width, epilogue, &scratch_);
+    else
+      gemmStrided(n, width, w.rows(), x.data(), x.rowStride(), x.colStride(),
+                  w.data(), w.rowStride(), w.colStride(), out, width, epilogue);
+
+    // the output is packed as n rows of width, not maxWidth
+    x = TensorView(out, n, width, width, 1);
+  }
+  return x;
+}
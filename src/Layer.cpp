@@ -0,0 +1,37 @@
+#include "Layer.hpp"
+#include "TensorExpr.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+using namespace myNN;
+
+float Layer::rmse(const Tensor &pred, const TensorView &target) const
+{
+  // fused into one loop, no difference tensor
+  float mse = mean(square(lazy(pred) - lazy(target)));
+  return std::sqrt(mse);
+}
+
+Tensor Layer::dL_dY(const Tensor &pred, const TensorView &target) const
+{
+  return eval((lazy(pred) - lazy(target)) * (2.0f / pred.size()));
+}
+
+void myNN::activationBackward(Activation activation, const TensorView &output, Tensor &grad)
+{
+  if (activation == Activation::None)
+    return;
+  if (output.rows() != grad.getShape()[0] || output.cols() != grad.getShape()[1])
+    throw std::runtime_error("activation gradient shape not compatible");
+
+  int N = output.cols();
+  float *g = grad.getData().data();
+  parallelFor(0, output.rows(), output.size(), [&](int lo, int hi)
+              {
+                for (int i = lo; i < hi; i++)
+                  for (int j = 0; j < N; j++)
+                    if (!(output(i, j) > 0.0f))
+                      g[i * N + j] = 0.0f;
+              });
+}
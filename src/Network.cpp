@@ -1,46 +1,576 @@
 #include "Network.hpp"
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <stdexcept>
 
 using namespace myNN;
 
-Tensor Network::forwardPass(const Tensor &input)
+Network::Network(const Network &other) : layers_(other.layers_)
+{
+    for (const Node &node : other.nodes_)
+    {
+        nodes_.push_back({node.dense, node.layer ? node.layer->clone() : nullptr});
+    }
+}
+
+Network &Network::operator=(const Network &other)
+{
+    if (this != &other)
+    {
+        Network copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+void Network::invalidatePlans()
+{
+    trainPlan_ = Plan();
+    inferPlan_ = Plan();
+}
+
+Network::Plan Network::compile(int inputSize, bool training) const
+{
+    Plan plan;
+    plan.valid = true;
+    plan.training = training;
+    plan.inputSize = inputSize;
+
+    // fusion: an activation right after a Dense layer goes into its GEMM epilogue
+    int width = inputSize;
+    for (size_t i = 0; i < nodes_.size(); i++)
+    {
+        Step step;
+        step.node = static_cast<int>(i);
+        width = nodeLayer(nodes_[i]).outputSize(width);
+        if (nodes_[i].dense >= 0 && i + 1 < nodes_.size() && nodes_[i + 1].dense < 0 &&
+            nodes_[i + 1].layer->activation() != Activation::None)
+        {
+            step.fused = nodes_[i + 1].layer->activation();
+            width = nodes_[i + 1].layer->outputSize(width);
+            i++;
+        }
+        step.width = width;
+        plan.steps.push_back(step);
+    }
+
+    // values backward reads have to survive until then
+    int nValues = static_cast<int>(plan.steps.size()) + 1;
+    std::vector<bool> keep(nValues, false);
+    if (training)
+    {
+        for (int k = 0; k + 1 < nValues; k++)
+        {
+            const Step &step = plan.steps[k];
+            const Layer &layer = nodeLayer(nodes_[step.node]);
+            keep[k] = keep[k] || layer.backwardNeedsInput();
+            keep[k + 1] = keep[k + 1] || layer.backwardNeedsOutput() || step.fused != Activation::None;
+        }
+    }
+
+    // liveness: a value dies once the step reading it has run, its buffer is then
+    // free for any later output; the last output goes straight into the returned Tensor
+    plan.slot.assign(nValues, -1);
+    std::vector<int> freeSlots;
+    for (int k = 0; k + 1 < nValues; k++)
+    {
+        int out = k + 1;
+        if (out < nValues - 1 || keep[out])
+        {
+            int slot;
+            if (freeSlots.empty())
+            {
+                slot = static_cast<int>(plan.slotWidth.size());
+                plan.slotWidth.push_back(0);
+            }
+            else
+            {
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+            }
+            plan.slotWidth[slot] = std::max(plan.slotWidth[slot], plan.steps[k].width);
+            plan.slot[out] = slot;
+        }
+
+        if (k > 0 && !keep[k])
+        {
+            freeSlots.push_back(plan.slot[k]);
+        }
+    }
+    return plan;
+}
+
+Tensor Network::run(Plan &plan, const TensorView &input, bool training, const SparseTensor *sparseInput)
+{
+    // the Dense layers may have been replaced through getLayers since planning
+    int width = input.cols();
+    bool stale = !plan.valid || plan.inputSize != width;
+    for (size_t k = 0; k < plan.steps.size() && !stale; k++)
+    {
+        const Step &step = plan.steps[k];
+        width = nodeLayer(nodes_[step.node]).outputSize(width);
+        if (step.fused != Activation::None)
+        {
+            width = nodes_[step.node + 1].layer->outputSize(width);
+        }
+        stale = width != step.width;
+    }
+    if (stale)
+    {
+        plan = compile(input.cols(), training);
+    }
+
+    int rows = input.rows();
+    plan.buffers.resize(plan.slotWidth.size());
+    for (size_t b = 0; b < plan.buffers.size(); b++)
+    {
+        if (plan.buffers[b].size() < rows * plan.slotWidth[b])
+        {
+            plan.buffers[b] = Tensor({rows, plan.slotWidth[b]});
+        }
+    }
+
+    plan.values.assign(plan.steps.size() + 1, TensorView(nullptr, 0, 0, 0, 1));
+    plan.values[0] = input;
+
+    Tensor result;
+    for (size_t k = 0; k < plan.steps.size(); k++)
+    {
+        const Step &step = plan.steps[k];
+        MYNN_PROFILE_LAYER(step.node);
+
+        float *out;
+        int slot = plan.slot[k + 1];
+        if (slot < 0)
+        {
+            result = Tensor({rows, step.width});
+            out = result.getData().data();
+        }
+        else
+        {
+            out = plan.buffers[slot].getData().data();
+        }
+
+        const Node &node = nodes_[step.node];
+        if (k == 0 && sparseInput)
+        {
+            if (node.dense < 0)
+            {
+                throw std::runtime_error("sparse input needs a Dense layer first");
+            }
+            layers_[node.dense].forwardInto(*sparseInput, out, step.fused);
+        }
+        else if (node.dense >= 0)
+        {
+            layers_[node.dense].forwardInto(plan.values[k], out, step.fused);
+        }
+        else
+        {
+            node.layer->forwardInto(plan.values[k], out);
+        }
+        plan.values[k + 1] = TensorView(out, rows, step.width, step.width, 1);
+    }
+
+    if (plan.slot.back() >= 0)
+    {
+        result = Tensor(plan.values.back());
+    }
+    else
+    {
+        // handed to the caller, backward does not read it
+        plan.values.back() = TensorView(nullptr, 0, 0, 0, 1);
+    }
+    return result;
+}
+
+Tensor Network::forwardPass(const TensorView &input)
+{
+    if (nodes_.empty())
+    {
+        return Tensor(input);
+    }
+
+    MYNN_PROFILE_SCOPE("forwardPass", "network");
+    return run(trainPlan_, input, true);
+}
+
+Tensor Network::predict(const TensorView &input)
 {
-    Tensor x = input;
-    for (auto &layer : layers_)
+    if (nodes_.empty())
     {
-        x = layer.forward(input);
+        return Tensor(input);
     }
-    return x;
+
+    MYNN_PROFILE_SCOPE("predict", "network");
+    return run(inferPlan_, input, false);
 }
 
-Tensor Network::backProp(const Tensor &dL_dY, const Tensor &lastInput)
+Tensor Network::forwardPass(const SparseTensor &input)
 {
+    if (nodes_.empty())
+    {
+        return input.toDense();
+    }
+
+    MYNN_PROFILE_SCOPE("forwardPass", "network");
+    return run(trainPlan_, TensorView(nullptr, input.rows(), input.cols(), input.cols(), 1), true, &input);
+}
+
+Tensor Network::predict(const SparseTensor &input)
+{
+    if (nodes_.empty())
+    {
+        return input.toDense();
+    }
+
+    MYNN_PROFILE_SCOPE("predict", "network");
+    return run(inferPlan_, TensorView(nullptr, input.rows(), input.cols(), input.cols(), 1), false, &input);
+}
+
+Tensor Network::backProp(const Tensor &dL_dY, const TensorView &lastInput, bool accumulate,
+                         const GradientHook &gradientsReady)
+{
+    return backPropFrom(dL_dY, lastInput, nullptr, accumulate, gradientsReady);
+}
+
+Tensor Network::backProp(const Tensor &dL_dY, const SparseTensor &lastInput, bool accumulate,
+                         const GradientHook &gradientsReady)
+{
+    TensorView shape(nullptr, lastInput.rows(), lastInput.cols(), lastInput.cols(), 1);
+    return backPropFrom(dL_dY, shape, &lastInput, accumulate, gradientsReady);
+}
+
+Tensor Network::backPropFrom(const Tensor &dL_dY, const TensorView &lastInput, const SparseTensor *sparseInput,
+                             bool accumulate, const GradientHook &gradientsReady)
+{
+    if (trainPlan_.values.empty())
+    {
+        throw std::runtime_error("backProp needs a forwardPass first");
+    }
+
+    MYNN_PROFILE_SCOPE("backProp", "network");
     Tensor dX = dL_dY;
-    for (auto layer = layers_.rbegin(); layer != layers_.rend(); ++layer)
+    for (size_t k = trainPlan_.steps.size(); k-- > 0;)
     {
-        layer->dB(dL_dY);
-        layer->dW(dL_dY, lastInput);
-        dX = layer->dX(dL_dY);
+        const Step &step = trainPlan_.steps[k];
+        MYNN_PROFILE_LAYER(step.node);
+
+        TensorView input = k == 0 ? lastInput : trainPlan_.values[k];
+        const TensorView &output = trainPlan_.values[k + 1];
+        if (step.fused != Activation::None)
+        {
+            activationBackward(step.fused, output, dX);
+        }
+        const Node &node = nodes_[step.node];
+        if (k == 0 && sparseInput)
+        {
+            // nothing upstream of a sparse input needs its gradient
+            DenseLayer &layer = layers_[node.dense];
+            layer.dB(dX, accumulate);
+            layer.dW(dX, *sparseInput, accumulate);
+            dX = Tensor();
+        }
+        else
+        {
+            dX = nodeLayer(node).backwardFrom(dX, input, output, accumulate);
+        }
+        if (gradientsReady && node.dense >= 0)
+        {
+            gradientsReady(layers_[node.dense]);
+        }
     }
     return dX;
 }
 
+void Network::shareParameters(const Network &owner)
+{
+    if (owner.layers_.size() != layers_.size() || owner.nodes_.size() != nodes_.size())
+    {
+        throw std::runtime_error("cannot share parameters of a different network");
+    }
+    for (size_t i = 0; i < layers_.size(); i++)
+    {
+        layers_[i].shareParameters(owner.layers_[i]);
+    }
+}
+
 void Network::addLayer(const DenseLayer &layer)
 {
     layers_.push_back(layer);
+    nodes_.push_back({static_cast<int>(layers_.size()) - 1, nullptr});
+    invalidatePlans();
 }
 
-void Network::updateParameters(float lr)
+void Network::addLayer(const Layer &layer)
+{
+    if (const DenseLayer *dense = dynamic_cast<const DenseLayer *>(&layer))
+    {
+        addLayer(*dense);
+        return;
+    }
+    nodes_.push_back({-1, layer.clone()});
+    invalidatePlans();
+}
+
+Activation Network::activationAfter(int denseIndex) const
+{
+    for (size_t i = 0; i + 1 < nodes_.size(); i++)
+    {
+        if (nodes_[i].dense == denseIndex && nodes_[i + 1].dense < 0)
+        {
+            return nodes_[i + 1].layer->activation();
+        }
+    }
+    return Activation::None;
+}
+
+bool Network::activationsFoldIntoDense() const
+{
+    for (size_t i = 0; i < nodes_.size(); i++)
+    {
+        if (nodes_[i].dense >= 0)
+        {
+            continue;
+        }
+        if (i == 0 || nodes_[i - 1].dense < 0 || nodes_[i].layer->activation() == Activation::None)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+PlanStats Network::planStats(int inputSize, int batchRows, bool training) const
 {
-    for (auto &layer : layers_)
+    Plan plan = compile(inputSize, training);
+
+    PlanStats stats;
+    stats.steps = static_cast<int>(plan.steps.size());
+    for (const Step &step : plan.steps)
+    {
+        stats.fused += step.fused != Activation::None;
+    }
+    stats.buffers = static_cast<int>(plan.slotWidth.size());
+    for (int width : plan.slotWidth)
     {
-        layer.updateParameters(lr);
+        stats.activationBytes += static_cast<std::size_t>(batchRows) * width * sizeof(float);
     }
+
+    // every node's output but the last in a tensor of its own
+    int width = inputSize;
+    for (size_t i = 0; i + 1 < nodes_.size(); i++)
+    {
+        width = nodeLayer(nodes_[i]).outputSize(width);
+        stats.unsharedBytes += static_cast<std::size_t>(batchRows) * width * sizeof(float);
+    }
+    return stats;
+}
+
+void Network::step(const OptimizerConfig &optimizer, float lr)
+{
+    MYNN_PROFILE_SCOPE("updateParameters", "network");
+    for (size_t i = 0; i < nodes_.size(); i++)
+    {
+        MYNN_PROFILE_LAYER(i);
+        nodeLayer(nodes_[i]).step(optimizer, lr);
+    }
+}
+
+void Network::updateParameters(float lr)
+{
+    step(OptimizerConfig(), lr);
 }
 
 void Network::zeroGrad()
 {
-    for (auto &layer : layers_)
+    for (Node &node : nodes_)
+    {
+        nodeLayer(node).zeroGrad();
+    }
+}
+
+namespace
+{
+    // copy the rows listed in idx into out, which has one row per index
+    void gatherRows(const Tensor &src, const int *idx, int n, Tensor &out)
+    {
+        int cols = src.getShape()[1];
+        float *dst = out.getData().data();
+        parallelFor(0, n, static_cast<size_t>(n) * cols, [&](int lo, int hi)
+                    {
+                        for (int r = lo; r < hi; r++)
+                            std::copy_n(src.data() + static_cast<size_t>(idx[r]) * cols, cols, dst + static_cast<size_t>(r) * cols);
+                    });
+    }
+}
+
+std::vector<EpochStats> Network::fit(const Tensor &X, const Tensor &Y, const FitOptions &options)
+{
+    return fit(X, Y, options, [&](const TensorView &x, const TensorView &y)
+               { return trainBatch(x, y, options); });
+}
+
+std::vector<EpochStats> Network::fit(BatchLoader &loader, const FitOptions &options)
+{
+    return fit(loader, options, [&](const TensorView &x, const TensorView &y)
+               { return trainBatch(x, y, options); });
+}
+
+std::vector<EpochStats> Network::fit(const Tensor &X, const Tensor &Y, const FitOptions &options,
+                                     const BatchTrainer &train)
+{
+    int nSamples = X.getShape()[0];
+    if (Y.getShape()[0] != nSamples)
+    {
+        throw std::runtime_error("fit needs one target row per input row");
+    }
+    if (nodes_.empty() || nSamples == 0)
+    {
+        return {};
+    }
+
+    int batchSize = std::max(1, std::min(options.batchSize, nSamples));
+    int tail = nSamples % batchSize;
+
+    // only the index list is shuffled, rows are gathered into reused batch buffers
+    std::vector<int> order(nSamples);
+    std::iota(order.begin(), order.end(), 0);
+    std::mt19937 rng(options.seed);
+
+    Tensor xBatch, yBatch, xTail, yTail;
+    if (options.shuffle)
+    {
+        xBatch = Tensor({batchSize, X.getShape()[1]});
+        yBatch = Tensor({batchSize, Y.getShape()[1]});
+        if (tail > 0)
+        {
+            xTail = Tensor({tail, X.getShape()[1]});
+            yTail = Tensor({tail, Y.getShape()[1]});
+        }
+    }
+
+    std::vector<EpochStats> history;
+    for (int epoch = 0; epoch < options.epochs; epoch++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (options.shuffle)
+        {
+            std::shuffle(order.begin(), order.end(), rng);
+        }
+
+        double lossSum = 0.0;
+        for (int first = 0; first < nSamples; first += batchSize)
+        {
+            int n = std::min(batchSize, nSamples - first);
+
+            // without shuffling a batch is just a view onto consecutive rows
+            TensorView xb = X.view().rowSlice(first, first + n);
+            TensorView yb = Y.view().rowSlice(first, first + n);
+            if (options.shuffle)
+            {
+                Tensor &xs = n == batchSize ? xBatch : xTail;
+                Tensor &ys = n == batchSize ? yBatch : yTail;
+                gatherRows(X, order.data() + first, n, xs);
+                gatherRows(Y, order.data() + first, n, ys);
+                xb = xs;
+                yb = ys;
+            }
+
+            lossSum += static_cast<double>(train(xb, yb)) * n;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        history.push_back(finishEpoch(epoch, lossSum, nSamples, seconds, options.verbose));
+    }
+    return history;
+}
+
+std::vector<EpochStats> Network::fit(BatchLoader &loader, const FitOptions &options, const BatchTrainer &train)
+{
+    if (nodes_.empty())
     {
-        layer.getdW_().zeroGrad();
+        return {};
     }
-}
\ No newline at end of file
+
+    Tensor x, y;
+    std::vector<EpochStats> history;
+    for (int epoch = 0; epoch < options.epochs; epoch++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        // also for the first epoch, the loader may have been used up by an earlier fit
+        loader.reset();
+
+        double lossSum = 0.0;
+        int nSamples = 0;
+        while (loader.next(x, y))
+        {
+            int n = x.getShape()[0];
+            lossSum += static_cast<double>(train(x, y)) * n;
+            nSamples += n;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        history.push_back(finishEpoch(epoch, lossSum, nSamples, seconds, options.verbose));
+    }
+    return history;
+}
+
+double Network::computeGradients(const TensorView &x, const TensorView &y, int microBatchSize, int batchRows,
+                                 const GradientHook &gradientsReady)
+{
+    const Layer &last = nodeLayer(nodes_.back());
+    int rows = x.rows();
+    int slice = microBatchSize > 0 ? std::min(microBatchSize, rows) : rows;
+
+    // dL_dY is the MSE gradient, so weighting each slice by its share of the batch makes
+    // the accumulated gradients those of the whole batch
+    double squaredError = 0.0;
+    for (int first = 0; first < rows; first += slice)
+    {
+        int n = std::min(slice, rows - first);
+        TensorView xs = x.rowSlice(first, first + n);
+        TensorView ys = y.rowSlice(first, first + n);
+
+        Tensor pred = forwardPass(xs);
+        float rmse = last.rmse(pred, ys);
+        squaredError += static_cast<double>(rmse) * rmse * n;
+        Tensor grad = last.dL_dY(pred, ys);
+        if (n < batchRows)
+        {
+            grad.mul_inplace(static_cast<float>(n) / batchRows);
+        }
+        bool lastSlice = first + n >= rows;
+        backProp(grad, xs, first > 0, lastSlice ? gradientsReady : GradientHook());
+    }
+    return squaredError;
+}
+
+float Network::trainBatch(const TensorView &x, const TensorView &y, const FitOptions &options)
+{
+    MYNN_PROFILE_SCOPE("trainBatch", "network");
+    double squaredError = computeGradients(x, y, options.microBatchSize, x.rows());
+    step(options.optimizer, options.learningRate);
+    return static_cast<float>(std::sqrt(squaredError / x.rows()));
+}
+
+EpochStats Network::finishEpoch(int epoch, double lossSum, int nSamples, double seconds, bool verbose) const
+{
+    EpochStats stats;
+    stats.epoch = epoch;
+    stats.loss = nSamples > 0 ? static_cast<float>(lossSum / nSamples) : 0.0f;
+    stats.seconds = seconds;
+    stats.samplesPerSec = seconds > 0.0 ? nSamples / seconds : 0.0;
+
+    if (verbose)
+    {
+        std::cout << "epoch " << epoch
+                  << " loss = " << stats.loss
+                  << " (" << stats.samplesPerSec << " samples/s)\n";
+    }
+    return stats;
+}
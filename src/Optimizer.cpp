@@ -0,0 +1,231 @@
+#include "Optimizer.hpp"
+#include "Sparse.hpp"
+#include "ThreadPool.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MYNN_X86 1
+#endif
+
+using namespace myNN;
+
+namespace
+{
+  // everything a pass needs besides the pointers, with the Adam bias corrections
+  // already turned into multipliers
+  struct StepArgs
+  {
+    float lr;
+    float decay;
+    float momentum;
+    float beta1;
+    float beta2;
+    float epsilon;
+    float correction1; // 1 / (1 - beta1^t)
+    float correction2; // 1 / (1 - beta2^t)
+    bool clear;
+  };
+
+  // one read and one write of every array; plain loops over restrict pointers, so the
+  // compiler vectorises them for whatever ISA the caller was built for
+  template <OptimizerKind K>
+  inline __attribute__((always_inline)) void updateRange(const StepArgs &a, float *__restrict p, float *__restrict g,
+                                                         float *__restrict m, float *__restrict v, int n)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      float grad = g[i];
+      if constexpr (K != OptimizerKind::AdamW)
+        grad += a.decay * p[i];
+
+      if constexpr (K == OptimizerKind::SGD)
+      {
+        p[i] -= a.lr * grad;
+      }
+      else if constexpr (K == OptimizerKind::Momentum)
+      {
+        float vel = a.momentum * m[i] + grad;
+        m[i] = vel;
+        p[i] -= a.lr * vel;
+      }
+      else
+      {
+        float m1 = a.beta1 * m[i] + (1.0f - a.beta1) * grad;
+        float m2 = a.beta2 * v[i] + (1.0f - a.beta2) * grad * grad;
+        m[i] = m1;
+        v[i] = m2;
+        float update = m1 * a.correction1 / (std::sqrt(m2 * a.correction2) + a.epsilon);
+        if constexpr (K == OptimizerKind::AdamW)
+          update += a.decay * p[i];
+        p[i] -= a.lr * update;
+      }
+
+      if (a.clear)
+        g[i] = 0.0f;
+    }
+  }
+
+  inline __attribute__((always_inline)) void updateAny(OptimizerKind kind, const StepArgs &a, float *p, float *g,
+                                                       float *m, float *v, int n)
+  {
+    switch (kind)
+    {
+    case OptimizerKind::SGD:
+      updateRange<OptimizerKind::SGD>(a, p, g, m, v, n);
+      break;
+    case OptimizerKind::Momentum:
+      updateRange<OptimizerKind::Momentum>(a, p, g, m, v, n);
+      break;
+    case OptimizerKind::Adam:
+      updateRange<OptimizerKind::Adam>(a, p, g, m, v, n);
+      break;
+    case OptimizerKind::AdamW:
+      updateRange<OptimizerKind::AdamW>(a, p, g, m, v, n);
+      break;
+    }
+  }
+
+  using UpdateKernel = void (*)(OptimizerKind kind, const StepArgs &a, float *p, float *g, float *m, float *v, int n);
+
+  void updatePortable(OptimizerKind kind, const StepArgs &a, float *p, float *g, float *m, float *v, int n)
+  {
+    updateAny(kind, a, p, g, m, v, n);
+  }
+
+#ifdef MYNN_X86
+  // the same loops compiled for 8 lanes; fp contraction is off in ISO C++ mode, so both
+  // kernels give bit identical results
+  __attribute__((target("avx2,fma"))) void updateAvx2(OptimizerKind kind, const StepArgs &a, float *p, float *g,
+                                                      float *m, float *v, int n)
+  {
+    updateAny(kind, a, p, g, m, v, n);
+  }
+#endif
+
+  struct UpdateChoice
+  {
+    UpdateKernel kernel;
+    const char *name;
+  };
+
+  UpdateChoice pickUpdate()
+  {
+#ifdef MYNN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return {updateAvx2, "avx2"};
+#endif
+    return {updatePortable, "portable"};
+  }
+
+  const UpdateChoice &updateChoice()
+  {
+    static const UpdateChoice choice = pickUpdate();
+    return choice;
+  }
+
+  // make sure state holds moments of n values for kind, starting from zero when the
+  // optimizer changed or the parameter was resized
+  void prepareState(OptimizerKind kind, std::size_t n, OptimizerState &state)
+  {
+    int moments = kind == OptimizerKind::SGD ? 0 : kind == OptimizerKind::Momentum ? 1 : 2;
+    int size = static_cast<int>(n);
+    bool fits = state.kind == kind && (moments < 1 || state.m.size() == size) && (moments < 2 || state.v.size() == size);
+    if (fits)
+      return;
+
+    state.reset();
+    state.kind = kind;
+    if (moments >= 1)
+      state.m = Tensor({1, size});
+    if (moments >= 2)
+      state.v = Tensor({1, size});
+  }
+
+  StepArgs stepArgs(const OptimizerConfig &config, float lr, float weightDecay, int steps)
+  {
+    StepArgs a;
+    a.lr = lr;
+    a.decay = weightDecay;
+    a.momentum = config.momentum;
+    a.beta1 = config.beta1;
+    a.beta2 = config.beta2;
+    a.epsilon = config.epsilon;
+    a.correction1 = static_cast<float>(1.0 / (1.0 - std::pow(static_cast<double>(config.beta1), steps)));
+    a.correction2 = static_cast<float>(1.0 / (1.0 - std::pow(static_cast<double>(config.beta2), steps)));
+    a.clear = config.clearGradients;
+    return a;
+  }
+}
+
+void OptimizerState::reset()
+{
+  m = Tensor();
+  v = Tensor();
+  kind = OptimizerKind::SGD;
+  steps = 0;
+}
+
+void myNN::optimizerStep(const OptimizerConfig &config, float lr, float weightDecay, float *param, float *grad,
+                         std::size_t n, OptimizerState &state)
+{
+  prepareState(config.kind, n, state);
+  state.steps++;
+  StepArgs a = stepArgs(config, lr, weightDecay, state.steps);
+
+  float *m = state.m.size() > 0 ? state.m.getData().data() : nullptr;
+  float *v = state.v.size() > 0 ? state.v.getData().data() : nullptr;
+  UpdateKernel kernel = updateChoice().kernel;
+  OptimizerKind kind = config.kind;
+
+  // ranges are disjoint, so each thread updates its slice of every array on its own
+  parallelFor(0, static_cast<int>(n), n * 4, [&](int lo, int hi)
+              { kernel(kind, a, param + lo, grad + lo, m ? m + lo : nullptr, v ? v + lo : nullptr, hi - lo); });
+}
+
+void myNN::optimizerStep(const OptimizerConfig &config, float lr, float weightDecay, Tensor &param, Tensor &grad,
+                         OptimizerState &state)
+{
+  if (param.size() != grad.size())
+    throw std::runtime_error("parameter and gradient sizes differ");
+  optimizerStep(config, lr, weightDecay, param.getData().data(), grad.getData().data(), static_cast<std::size_t>(param.size()), state);
+}
+
+void myNN::optimizerStep(const OptimizerConfig &config, float lr, float weightDecay, Tensor &param, SparseRows &grad,
+                         OptimizerState &state)
+{
+  int nRows = static_cast<int>(grad.rows.size());
+  int cols = nRows > 0 ? grad.values.size() / nRows : 0;
+  if (grad.totalRows != param.getShape()[0] || (nRows > 0 && cols != param.getShape()[1]))
+    throw std::runtime_error("parameter and gradient sizes differ");
+
+  std::size_t n = static_cast<std::size_t>(param.size());
+  prepareState(config.kind, n, state);
+  state.steps++;
+  StepArgs a = stepArgs(config, lr, weightDecay, state.steps);
+
+  float *p = param.getData().data();
+  float *g = grad.values.getData().data();
+  float *m = state.m.size() > 0 ? state.m.getData().data() : nullptr;
+  float *v = state.v.size() > 0 ? state.v.getData().data() : nullptr;
+  UpdateKernel kernel = updateChoice().kernel;
+  OptimizerKind kind = config.kind;
+
+  // one pass per stored row; the rows are distinct, so threads never share one
+  parallelFor(0, nRows, static_cast<std::size_t>(nRows) * cols * 4, [&](int lo, int hi)
+              {
+                for (int r = lo; r < hi; r++)
+                {
+                  std::size_t offset = static_cast<std::size_t>(grad.rows[r]) * cols;
+                  kernel(kind, a, p + offset, g + static_cast<std::size_t>(r) * cols, m ? m + offset : nullptr,
+                         v ? v + offset : nullptr, cols);
+                }
+              });
+}
+
+const char *myNN::optimizerKernelName()
+{
+  return updateChoice().name;
+}
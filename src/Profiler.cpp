@@ -0,0 +1,167 @@
+#include "Profiler.hpp"
+#include "Allocator.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+
+using namespace myNN;
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+
+  const Clock::time_point origin = Clock::now();
+
+  thread_local int currentLayer = -1;
+
+  double nowUs()
+  {
+    return std::chrono::duration<double, std::micro>(Clock::now() - origin).count();
+  }
+
+  // small stable ids read better in a trace than native thread handles
+  std::uint32_t threadId()
+  {
+    static std::atomic<std::uint32_t> next{0};
+    thread_local std::uint32_t id = next++;
+    return id;
+  }
+}
+
+std::atomic<bool> Profiler::enabled_{false};
+
+Profiler &Profiler::instance()
+{
+  static Profiler profiler;
+  return profiler;
+}
+
+void Profiler::record(const ProfileEvent &event)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.push_back(event);
+}
+
+void Profiler::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.clear();
+}
+
+std::vector<ProfileEvent> Profiler::events() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return events_;
+}
+
+std::vector<ProfileStats> Profiler::summary() const
+{
+  std::map<std::pair<int, std::string>, ProfileStats> totals;
+  for (const ProfileEvent &e : events())
+  {
+    ProfileStats &s = totals[{e.layer, e.name}];
+    s.name = e.name;
+    s.layer = e.layer;
+    s.calls++;
+    s.totalUs += e.durationUs;
+    s.flops += e.flops;
+    s.bytes += e.bytes;
+    s.allocations += e.allocations;
+  }
+
+  std::vector<ProfileStats> result;
+  for (auto &entry : totals)
+    result.push_back(entry.second);
+  std::stable_sort(result.begin(), result.end(), [](const ProfileStats &a, const ProfileStats &b)
+                   { return a.layer != b.layer ? a.layer < b.layer : a.totalUs > b.totalUs; });
+  return result;
+}
+
+void Profiler::printReport(std::ostream &out) const
+{
+  out << std::left << std::setw(7) << "layer" << std::setw(24) << "op" << std::right
+      << std::setw(8) << "calls" << std::setw(12) << "total ms" << std::setw(12) << "avg us"
+      << std::setw(10) << "GFLOP/s" << std::setw(10) << "GB/s" << std::setw(10) << "allocs" << "\n";
+
+  out << std::fixed;
+  for (const ProfileStats &s : summary())
+  {
+    // ns per op turns flops and bytes into GFLOP/s and GB/s
+    double ns = s.totalUs * 1e3;
+    out << std::left << std::setw(7) << (s.layer < 0 ? std::string("-") : std::to_string(s.layer))
+        << std::setw(24) << s.name << std::right
+        << std::setw(8) << s.calls
+        << std::setw(12) << std::setprecision(3) << s.totalUs * 1e-3
+        << std::setw(12) << std::setprecision(1) << s.totalUs / s.calls
+        << std::setw(10) << std::setprecision(2) << (ns > 0.0 ? s.flops / ns : 0.0)
+        << std::setw(10) << std::setprecision(2) << (ns > 0.0 ? s.bytes / ns : 0.0)
+        << std::setw(10) << s.allocations << "\n";
+  }
+  out << std::defaultfloat;
+}
+
+void Profiler::writeChromeTrace(const std::string &path) const
+{
+  std::FILE *file = std::fopen(path.c_str(), "w");
+  if (!file)
+    throw std::runtime_error("cannot open trace for writing: " + path);
+
+  // complete ("X") events, timestamps in microseconds
+  std::vector<ProfileEvent> all = events();
+  std::fprintf(file, "{\"traceEvents\": [\n");
+  for (std::size_t i = 0; i < all.size(); i++)
+  {
+    const ProfileEvent &e = all[i];
+    std::fprintf(file,
+                 "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %u, "
+                 "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"layer\": %d, \"flops\": %.0f, \"bytes\": %.0f, \"allocations\": %zu}}%s\n",
+                 e.name, e.category, e.thread, e.startUs, e.durationUs, e.layer, e.flops, e.bytes, e.allocations,
+                 i + 1 < all.size() ? "," : "");
+  }
+  std::fprintf(file, "], \"displayTimeUnit\": \"ms\"}\n");
+
+  if (std::fclose(file) != 0)
+    throw std::runtime_error("failed to write trace: " + path);
+}
+
+ProfileScope::ProfileScope(const char *name, const char *category, double flops, double bytes)
+{
+  if (!Profiler::enabled())
+    return;
+
+  active_ = true;
+  event_.name = name;
+  event_.category = category;
+  event_.layer = currentLayer;
+  event_.thread = threadId();
+  event_.flops = flops;
+  event_.bytes = bytes;
+  requestsBefore_ = defaultAllocator().stats().requests;
+  event_.startUs = nowUs();
+}
+
+ProfileScope::~ProfileScope()
+{
+  if (!active_)
+    return;
+
+  event_.durationUs = nowUs() - event_.startUs;
+  event_.allocations = defaultAllocator().stats().requests - requestsBefore_;
+  Profiler::instance().record(event_);
+}
+
+ProfileLayer::ProfileLayer(int layer) : previous_(currentLayer)
+{
+  currentLayer = layer;
+}
+
+ProfileLayer::~ProfileLayer()
+{
+  currentLayer = previous_;
+}
@@ -0,0 +1,335 @@
+#include "Quantized.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MYNN_X86 1
+#endif
+
+using namespace myNN;
+
+namespace
+{
+  constexpr int K_STEP = 32;
+
+  // one row of A against n rows of B, out[j] = dot(a, B_j)
+  using QgemmRow = void (*)(const std::int8_t *a, const std::int8_t *B, const std::int32_t *bRowSums,
+                            int n, int Kp, std::int32_t *out);
+
+  void qgemmRowPortable(const std::int8_t *a, const std::int8_t *B, const std::int32_t *,
+                        int n, int Kp, std::int32_t *out)
+  {
+    for (int j = 0; j < n; j++)
+    {
+      const std::int8_t *b = B + static_cast<size_t>(j) * Kp;
+      std::int32_t s = 0;
+      for (int k = 0; k < Kp; k++)
+        s += static_cast<std::int32_t>(a[k]) * b[k];
+      out[j] = s;
+    }
+  }
+
+#ifdef MYNN_X86
+  __attribute__((target("avx2"))) std::int32_t hsum(__m256i v)
+  {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+  }
+
+  // sign extend to 16 bit and multiply-add pairs into 32 bit lanes (vpmaddwd), which
+  // cannot saturate, unlike vpmaddubsw on full range int8 inputs
+  __attribute__((target("avx2"))) void qgemmRowAvx2(const std::int8_t *a, const std::int8_t *B, const std::int32_t *,
+                                                    int n, int Kp, std::int32_t *out)
+  {
+    for (int j = 0; j < n; j++)
+    {
+      const std::int8_t *b = B + static_cast<size_t>(j) * Kp;
+      __m256i acc0 = _mm256_setzero_si256();
+      __m256i acc1 = _mm256_setzero_si256();
+      for (int k = 0; k < Kp; k += K_STEP)
+      {
+        __m256i a0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + k)));
+        __m256i a1 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + k + 16)));
+        __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + k)));
+        __m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + k + 16)));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(a0, b0));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(a1, b1));
+      }
+      out[j] = hsum(_mm256_add_epi32(acc0, acc1));
+    }
+  }
+
+  // vpdpbusd multiplies unsigned by signed bytes, so activations are shifted to
+  // a + 128 and 128 * sum(b) is subtracted again at the end
+  __attribute__((target("avx2,avx512vnni,avx512vl"))) void qgemmRowVnni(const std::int8_t *a, const std::int8_t *B, const std::int32_t *bRowSums,
+                                                                         int n, int Kp, std::int32_t *out)
+  {
+    const __m256i flip = _mm256_set1_epi8(static_cast<char>(0x80));
+    for (int j = 0; j < n; j++)
+    {
+      const std::int8_t *b = B + static_cast<size_t>(j) * Kp;
+      __m256i acc = _mm256_setzero_si256();
+      for (int k = 0; k < Kp; k += K_STEP)
+      {
+        __m256i av = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + k)), flip);
+        __m256i bv = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + k));
+        acc = _mm256_dpbusd_epi32(acc, av, bv);
+      }
+      out[j] = hsum(acc) - 128 * bRowSums[j];
+    }
+  }
+#endif
+
+  struct QKernelChoice
+  {
+    QgemmRow kernel;
+    const char *name;
+  };
+
+  // every int8 kernel this CPU can run, the fastest first
+  std::vector<QKernelChoice> supportedQKernels()
+  {
+    std::vector<QKernelChoice> kernels;
+#ifdef MYNN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx2"))
+      kernels.push_back({qgemmRowVnni, "avx512-vnni"});
+    if (__builtin_cpu_supports("avx2"))
+      kernels.push_back({qgemmRowAvx2, "avx2"});
+#endif
+    kernels.push_back({qgemmRowPortable, "portable"});
+    return kernels;
+  }
+
+  QKernelChoice pickQKernel()
+  {
+    return supportedQKernels().front();
+  }
+
+  const QKernelChoice &qkernelChoice()
+  {
+    static const QKernelChoice choice = pickQKernel();
+    return choice;
+  }
+
+  void qgemmRun(QgemmRow kernel, int M, int N, int Kp,
+                const std::int8_t *A, const std::int8_t *B, const std::int32_t *bRowSums,
+                std::int32_t *C)
+  {
+    size_t work = static_cast<size_t>(M) * N * Kp;
+
+    // split over output channels so batch-1 requests still use every thread
+    parallelFor(0, N, work, [&](int lo, int hi)
+                {
+                  for (int i = 0; i < M; i++)
+                  {
+                    kernel(A + static_cast<size_t>(i) * Kp, B + static_cast<size_t>(lo) * Kp, bRowSums + lo,
+                           hi - lo, Kp, C + static_cast<size_t>(i) * N + lo);
+                  }
+                });
+  }
+
+  std::int8_t quantize(float x, float invScale)
+  {
+    float q = std::nearbyint(x * invScale);
+    q = std::min(127.0f, std::max(-127.0f, q));
+    return static_cast<std::int8_t>(q);
+  }
+
+  float maxAbs(const TensorView &x)
+  {
+    float m = 0.0f;
+    for (int i = 0; i < x.rows(); i++)
+      for (int j = 0; j < x.cols(); j++)
+        m = std::max(m, std::fabs(x(i, j)));
+    return m;
+  }
+}
+
+int myNN::roundUpK(int K)
+{
+  return (K + K_STEP - 1) / K_STEP * K_STEP;
+}
+
+const char *myNN::qgemmKernelName()
+{
+  return qkernelChoice().name;
+}
+
+std::vector<std::string> myNN::qgemmKernelNames()
+{
+  std::vector<std::string> names;
+  for (const QKernelChoice &choice : supportedQKernels())
+    names.push_back(choice.name);
+  return names;
+}
+
+void myNN::qgemm(int M, int N, int Kp,
+                 const std::int8_t *A, const std::int8_t *B, const std::int32_t *bRowSums,
+                 std::int32_t *C)
+{
+  qgemmRun(qkernelChoice().kernel, M, N, Kp, A, B, bRowSums, C);
+}
+
+void myNN::qgemmWith(const char *kernelName, int M, int N, int Kp,
+                     const std::int8_t *A, const std::int8_t *B, const std::int32_t *bRowSums,
+                     std::int32_t *C)
+{
+  for (const QKernelChoice &choice : supportedQKernels())
+  {
+    if (std::strcmp(kernelName, choice.name) == 0)
+      return qgemmRun(choice.kernel, M, N, Kp, A, B, bRowSums, C);
+  }
+  throw std::runtime_error(std::string("int8 kernel not available on this CPU: ") + kernelName);
+}
+
+QuantizedDense::QuantizedDense(const DenseLayer &layer, Activation activation) : activation(activation)
+{
+  const Tensor &w = layer.getWeights();
+  nInputs = w.getShape()[0];
+  nOutputs = w.getShape()[1];
+  paddedInputs = roundUpK(nInputs);
+
+  weights.assign(static_cast<size_t>(nOutputs) * paddedInputs, 0);
+  rowSums.assign(nOutputs, 0);
+  scales.assign(nOutputs, 0.0f);
+  bias.assign(layer.getBias().data(), layer.getBias().data() + nOutputs);
+
+  // symmetric, per output channel: the largest weight of a column maps to 127
+  for (int j = 0; j < nOutputs; j++)
+  {
+    float m = 0.0f;
+    for (int k = 0; k < nInputs; k++)
+      m = std::max(m, std::fabs(w(k, j)));
+    float scale = m > 0.0f ? m / 127.0f : 1.0f;
+    scales[j] = scale;
+
+    std::int8_t *row = weights.data() + static_cast<size_t>(j) * paddedInputs;
+    for (int k = 0; k < nInputs; k++)
+    {
+      row[k] = quantize(w(k, j), 1.0f / scale);
+      rowSums[j] += row[k];
+    }
+  }
+}
+
+QuantizedNetwork::QuantizedNetwork(const Network &net)
+{
+  if (!net.activationsFoldIntoDense())
+    throw std::runtime_error("QuantizedNetwork needs every activation right after a Dense layer");
+
+  const std::vector<DenseLayer> &layers = net.getLayers();
+  for (size_t i = 0; i < layers.size(); i++)
+    layers_.emplace_back(layers[i], net.activationAfter(static_cast<int>(i)));
+}
+
+void QuantizedNetwork::calibrate(const Network &net, const TensorView &samples)
+{
+  const std::vector<DenseLayer> &layers = net.getLayers();
+  if (layers.size() != layers_.size())
+    throw std::runtime_error("calibration network does not match");
+
+  Tensor x(samples);
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    float m = maxAbs(x);
+    layers_[i].inputScale = m > 0.0f ? m / 127.0f : 1.0f;
+    x = layers[i].forward(x, layers_[i].activation);
+  }
+}
+
+void QuantizedNetwork::clearCalibration()
+{
+  for (QuantizedDense &layer : layers_)
+    layer.inputScale = 0.0f;
+}
+
+Tensor QuantizedNetwork::forward(const TensorView &input) const
+{
+  if (layers_.empty())
+    return Tensor(input);
+
+  thread_local std::vector<std::int8_t> qx;
+  thread_local std::vector<std::int32_t> acc;
+
+  int M = input.rows();
+  Tensor x;
+  TensorView current = input;
+  for (const QuantizedDense &layer : layers_)
+  {
+    if (current.cols() != layer.nInputs)
+      throw std::runtime_error("input shape not compatible");
+
+    // dynamic or calibrated symmetric activation scale
+    float scale = layer.inputScale;
+    if (scale <= 0.0f)
+    {
+      float m = maxAbs(current);
+      scale = m > 0.0f ? m / 127.0f : 1.0f;
+    }
+
+    int Kp = layer.paddedInputs;
+    qx.assign(static_cast<size_t>(M) * Kp, 0);
+    for (int i = 0; i < M; i++)
+      for (int k = 0; k < layer.nInputs; k++)
+        qx[static_cast<size_t>(i) * Kp + k] = quantize(current(i, k), 1.0f / scale);
+
+    int N = layer.nOutputs;
+    acc.resize(static_cast<size_t>(M) * N);
+    qgemm(M, N, Kp, qx.data(), layer.weights.data(), layer.rowSums.data(), acc.data());
+
+    // dequantize, add the bias and apply the activation
+    Tensor out({M, N});
+    float *o = out.getData().data();
+    bool relu = layer.activation == Activation::ReLU;
+    for (int i = 0; i < M; i++)
+      for (int j = 0; j < N; j++)
+      {
+        float v = static_cast<float>(acc[static_cast<size_t>(i) * N + j]) * scale * layer.scales[j] + layer.bias[j];
+        o[i * N + j] = relu && v < 0.0f ? 0.0f : v;
+      }
+
+    x = std::move(out);
+    current = x;
+  }
+  return x;
+}
+
+QuantizationError QuantizedNetwork::compare(Network &net, const TensorView &heldOut) const
+{
+  Tensor reference = net.forwardPass(heldOut);
+  Tensor quantized = forward(heldOut);
+
+  double err2 = 0.0;
+  double ref2 = 0.0;
+  QuantizationError error;
+  for (int i = 0; i < reference.size(); i++)
+  {
+    float d = quantized[i] - reference[i];
+    error.maxAbs = std::max(error.maxAbs, std::fabs(d));
+    err2 += static_cast<double>(d) * d;
+    ref2 += static_cast<double>(reference[i]) * reference[i];
+  }
+  int n = std::max(1, reference.size());
+  error.rms = static_cast<float>(std::sqrt(err2 / n));
+  error.relativeRms = ref2 > 0.0 ? static_cast<float>(std::sqrt(err2 / ref2)) : 0.0f;
+  return error;
+}
+
+std::size_t QuantizedNetwork::weightBytes() const
+{
+  std::size_t bytes = 0;
+  for (const QuantizedDense &layer : layers_)
+  {
+    bytes += layer.weights.size() * sizeof(std::int8_t);
+    bytes += (layer.scales.size() + layer.bias.size()) * sizeof(float);
+    bytes += layer.rowSums.size() * sizeof(std::int32_t);
+  }
+  return bytes;
+}
@@ -1,4 +1,5 @@
 #include "ReLuLayer.hpp"
+#include "Profiler.hpp"
 
 using namespace myNN;
 
@@ -19,4 +20,32 @@ Tensor ReLuLayer::backward(const Tensor &dOut)
         dZ[i] = (lastInput_[i] > 0) ? dOut[i] : 0.0f;
     }
     return dZ;
-}
\ No newline at end of file
+}
+
+std::unique_ptr<Layer> ReLuLayer::clone() const
+{
+    return std::make_unique<ReLuLayer>(*this);
+}
+
+void ReLuLayer::forwardInto(const TensorView &input, float *out) const
+{
+    MYNN_PROFILE_SCOPE("relu.forward", "layer", input.size(), 8.0 * input.size());
+    int N = input.cols();
+    parallelFor(0, input.rows(), input.size(), [&](int lo, int hi)
+                {
+                    for (int i = lo; i < hi; i++)
+                        for (int j = 0; j < N; j++)
+                        {
+                            float v = input(i, j);
+                            out[i * N + j] = v > 0 ? v : 0.0f;
+                        }
+                });
+}
+
+Tensor ReLuLayer::backwardFrom(const Tensor &dOut, const TensorView &, const TensorView &output, bool)
+{
+    MYNN_PROFILE_SCOPE("relu.backward", "layer", output.size(), 12.0 * output.size());
+    Tensor dZ = dOut;
+    activationBackward(Activation::ReLU, output, dZ);
+    return dZ;
+}
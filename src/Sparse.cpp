@@ -0,0 +1,505 @@
+#include "Sparse.hpp"
+#include "Profiler.hpp"
+#include "Tensor.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MYNN_X86 1
+#endif
+
+using namespace myNN;
+
+namespace
+{
+  // output rows computed together, so their results can be written out row by row
+  constexpr int BLOCK_ROWS = 16;
+
+  // the sparse rows [jBegin, jEnd) of b against every row of a, which is given
+  // transposed: element (i, k) of a is at[k * ldAt + i]; row j - jBegin of tile gets
+  // the m products of output column j
+  // each stored weight is one axpy over the batch, so the weight and its index are
+  // loaded once per batch rather than once per row
+  inline __attribute__((always_inline)) void gatherRows(const int *rowStart, const int *colIndex, const float *values,
+                                                        const float *at, int ldAt, int m, int jBegin, int jEnd,
+                                                        float *tile)
+  {
+    for (int j = jBegin; j < jEnd; j++)
+    {
+      float *__restrict y = tile + static_cast<std::size_t>(j - jBegin) * m;
+      if (m == 1)
+      {
+        // a single row is a dot product with a gather
+        float sum = 0.0f;
+        for (int p = rowStart[j]; p < rowStart[j + 1]; p++)
+          sum += values[p] * at[static_cast<std::size_t>(colIndex[p]) * ldAt];
+        y[0] = sum;
+        continue;
+      }
+
+      for (int i = 0; i < m; i++)
+        y[i] = 0.0f;
+      for (int p = rowStart[j]; p < rowStart[j + 1]; p++)
+      {
+        const float *__restrict x = at + static_cast<std::size_t>(colIndex[p]) * ldAt;
+        float v = values[p];
+        for (int i = 0; i < m; i++)
+          y[i] += v * x[i];
+      }
+    }
+  }
+
+  // ct[k][i] += a[i][j] * b[j][k] for i in [iBegin, iEnd), with a given transposed as
+  // at[j * ld + i] and ct being c transposed with the same row stride
+  inline __attribute__((always_inline)) void scatterRows(const int *rowStart, const int *colIndex, const float *values,
+                                                         int nRows, const float *at, float *ct, int ld, int iBegin,
+                                                         int iEnd)
+  {
+    int m = iEnd - iBegin;
+    for (int j = 0; j < nRows; j++)
+    {
+      const float *__restrict x = at + static_cast<std::size_t>(j) * ld + iBegin;
+      for (int p = rowStart[j]; p < rowStart[j + 1]; p++)
+      {
+        float *__restrict y = ct + static_cast<std::size_t>(colIndex[p]) * ld + iBegin;
+        float v = values[p];
+        for (int i = 0; i < m; i++)
+          y[i] += v * x[i];
+      }
+    }
+  }
+
+  using GatherKernel = void (*)(const int *rowStart, const int *colIndex, const float *values, const float *at,
+                                int ldAt, int m, int jBegin, int jEnd, float *tile);
+  using ScatterKernel = void (*)(const int *rowStart, const int *colIndex, const float *values, int nRows,
+                                 const float *at, float *ct, int ld, int iBegin, int iEnd);
+
+  void gatherPortable(const int *rowStart, const int *colIndex, const float *values, const float *at, int ldAt, int m,
+                      int jBegin, int jEnd, float *tile)
+  {
+    gatherRows(rowStart, colIndex, values, at, ldAt, m, jBegin, jEnd, tile);
+  }
+
+  void scatterPortable(const int *rowStart, const int *colIndex, const float *values, int nRows, const float *at,
+                       float *ct, int ld, int iBegin, int iEnd)
+  {
+    scatterRows(rowStart, colIndex, values, nRows, at, ct, ld, iBegin, iEnd);
+  }
+
+#ifdef MYNN_X86
+  // the same loops compiled for avx2: the axpy over the batch vectorises to 8 lanes,
+  // the single row dot product stays a scalar loop over the stored indices
+  __attribute__((target("avx2,fma"))) void gatherAvx2(const int *rowStart, const int *colIndex, const float *values,
+                                                      const float *at, int ldAt, int m, int jBegin, int jEnd,
+                                                      float *tile)
+  {
+    gatherRows(rowStart, colIndex, values, at, ldAt, m, jBegin, jEnd, tile);
+  }
+
+  __attribute__((target("avx2,fma"))) void scatterAvx2(const int *rowStart, const int *colIndex, const float *values,
+                                                       int nRows, const float *at, float *ct, int ld, int iBegin,
+                                                       int iEnd)
+  {
+    scatterRows(rowStart, colIndex, values, nRows, at, ct, ld, iBegin, iEnd);
+  }
+#endif
+
+  struct SparseChoice
+  {
+    GatherKernel gather;
+    ScatterKernel scatter;
+    const char *name;
+  };
+
+  SparseChoice pickSparse()
+  {
+#ifdef MYNN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return {gatherAvx2, scatterAvx2, "avx2"};
+#endif
+    return {gatherPortable, scatterPortable, "portable"};
+  }
+
+  const SparseChoice &sparseChoice()
+  {
+    static const SparseChoice choice = pickSparse();
+    return choice;
+  }
+
+  // the epilogue on one output row, products holds the plain sums for row[0, n)
+  void storeRow(const GemmEpilogue &epilogue, const float *products, float *row, int n)
+  {
+    for (int j = 0; j < n; j++)
+    {
+      float x = epilogue.alpha * products[j];
+      if (epilogue.beta != 0.0f)
+        x += epilogue.beta * row[j];
+      if (epilogue.bias)
+        x += epilogue.bias[j];
+      if (epilogue.activation == Activation::ReLU && x < 0.0f)
+        x = 0.0f;
+      row[j] = x;
+    }
+  }
+}
+
+SparseTensor::SparseTensor(const TensorView &src) : rows_(src.rows()), cols_(src.cols())
+{
+  rowStart_.reserve(rows_ + 1);
+  rowStart_.push_back(0);
+  for (int i = 0; i < rows_; i++)
+  {
+    for (int j = 0; j < cols_; j++)
+    {
+      float x = src(i, j);
+      if (x != 0.0f)
+      {
+        colIndex_.push_back(j);
+        values_.push_back(x);
+      }
+    }
+    rowStart_.push_back(static_cast<int>(values_.size()));
+  }
+}
+
+void SparseTensor::assign(const TensorView &src)
+{
+  if (src.rows() != rows_ || src.cols() != cols_)
+    throw std::runtime_error("sparse tensor shape not compatible");
+
+  parallelFor(0, rows_, values_.size(), [&](int lo, int hi)
+              {
+                for (int i = lo; i < hi; i++)
+                  for (int p = rowStart_[i]; p < rowStart_[i + 1]; p++)
+                    values_[p] = src(i, colIndex_[p]);
+              });
+}
+
+void SparseTensor::toDense(float *dense, int rowStride, int colStride) const
+{
+  for (int i = 0; i < rows_; i++)
+  {
+    for (int j = 0; j < cols_; j++)
+      dense[i * rowStride + j * colStride] = 0.0f;
+    for (int p = rowStart_[i]; p < rowStart_[i + 1]; p++)
+      dense[i * rowStride + colIndex_[p] * colStride] = values_[p];
+  }
+}
+
+Tensor SparseTensor::toDense() const
+{
+  Tensor t({rows_, cols_});
+  toDense(t.getData().data(), cols_, 1);
+  return t;
+}
+
+float myNN::pruneByMagnitude(Tensor &t, float sparsity)
+{
+  if (sparsity < 0.0f || sparsity > 1.0f)
+    throw std::runtime_error("sparsity must be between 0 and 1");
+
+  Tensor::Storage &data = t.getData();
+  std::size_t n = data.size();
+  std::size_t k = static_cast<std::size_t>(std::llround(static_cast<double>(sparsity) * n));
+  if (k == 0)
+    return 0.0f;
+
+  std::vector<float> magnitudes(n);
+  for (std::size_t i = 0; i < n; i++)
+    magnitudes[i] = std::fabs(data[i]);
+  std::nth_element(magnitudes.begin(), magnitudes.begin() + (k - 1), magnitudes.end());
+  float threshold = magnitudes[k - 1];
+
+  // everything below the threshold goes, then ties until exactly k are zero
+  std::size_t below = 0;
+  for (std::size_t i = 0; i < n; i++)
+    below += std::fabs(data[i]) < threshold;
+  std::size_t ties = k - below;
+  for (std::size_t i = 0; i < n; i++)
+  {
+    float magnitude = std::fabs(data[i]);
+    if (magnitude < threshold)
+      data[i] = 0.0f;
+    else if (magnitude == threshold && ties > 0)
+    {
+      data[i] = 0.0f;
+      ties--;
+    }
+  }
+  return threshold;
+}
+
+namespace
+{
+  // ranges the output blocks of sparseMatMulTranspose are split into, each with its own
+  // tile of products; at most one per thread, so the tiles stay in cache
+  int productSlots(int n)
+  {
+    int blocks = (n + BLOCK_ROWS - 1) / BLOCK_ROWS;
+    return std::max(1, std::min(ThreadPool::instance().numThreads(), blocks));
+  }
+}
+
+void SparseScratch::reserve(int rows, int k, int n)
+{
+  if (transposed.size() < rows * k)
+    transposed = Tensor({k, rows});
+  int slots = productSlots(n);
+  if (products.size() < slots * BLOCK_ROWS * rows)
+    products = Tensor({slots * BLOCK_ROWS, rows});
+}
+
+void myNN::sparseMatMulTranspose(const TensorView &a, const SparseTensor &b, float *c, int ldc,
+                                 const GemmEpilogue &epilogue, SparseScratch *scratch)
+{
+  int m = a.rows();
+  int n = b.rows();
+  int k = a.cols();
+  if (k != b.cols())
+    throw std::runtime_error("sparse matMul shape not compatible");
+  MYNN_PROFILE_SCOPE("sparseMatMul", "tensor", 2.0 * m * b.nnz(),
+                     4.0 * (static_cast<double>(a.size()) + static_cast<double>(m) * n) + b.bytes());
+
+  // the batch has to run along contiguous memory, a single row is fine as it is
+  bool transpose = m > 1 && a.rowStride() != 1;
+  SparseScratch local;
+  SparseScratch &work = scratch ? *scratch : local;
+  work.reserve(m, transpose ? k : 0, n);
+
+  const float *at = a.data();
+  int ldAt = a.colStride();
+  if (transpose)
+  {
+    float *t = work.transposed.getData().data();
+    parallelFor(0, k, a.size(), [&](int lo, int hi)
+                {
+                  for (int kk = lo; kk < hi; kk++)
+                    for (int i = 0; i < m; i++)
+                      t[static_cast<std::size_t>(kk) * m + i] = a(i, kk);
+                });
+    at = t;
+    ldAt = m;
+  }
+
+  const SparseChoice &kernels = sparseChoice();
+  std::size_t cost = static_cast<std::size_t>(b.nnz()) * m + static_cast<std::size_t>(n) * m;
+  int blocks = (n + BLOCK_ROWS - 1) / BLOCK_ROWS;
+  int slots = productSlots(n);
+  parallelFor(0, slots, cost, [&](int lo, int hi)
+              {
+                // ranges of slots are disjoint, so the tile of a range's first slot is its own
+                float *products = work.products.getData().data() + static_cast<std::size_t>(lo) * BLOCK_ROWS * m;
+                int first = static_cast<int>(static_cast<long long>(blocks) * lo / slots);
+                int last = static_cast<int>(static_cast<long long>(blocks) * hi / slots);
+                for (int block = first; block < last; block++)
+                {
+                  int jBegin = block * BLOCK_ROWS;
+                  int jEnd = std::min(jBegin + BLOCK_ROWS, n);
+                  kernels.gather(b.rowStart(), b.colIndex(), b.values(), at, ldAt, m, jBegin, jEnd, products);
+
+                  for (int i = 0; i < m; i++)
+                  {
+                    float *row = c + static_cast<std::size_t>(i) * ldc;
+                    for (int j = jBegin; j < jEnd; j++)
+                    {
+                      float x = epilogue.alpha * products[(j - jBegin) * m + i];
+                      if (epilogue.beta != 0.0f)
+                        x += epilogue.beta * row[j];
+                      if (epilogue.bias)
+                        x += epilogue.bias[j];
+                      if (epilogue.activation == Activation::ReLU && x < 0.0f)
+                        x = 0.0f;
+                      row[j] = x;
+                    }
+                  }
+                }
+              });
+}
+
+Tensor myNN::matMulTranspose(const TensorView &a, const SparseTensor &b)
+{
+  Tensor c({a.rows(), b.rows()});
+  sparseMatMulTranspose(a, b, c.getData().data(), b.rows());
+  return c;
+}
+
+Tensor myNN::matMul(const TensorView &a, const SparseTensor &b)
+{
+  int m = a.rows();
+  int k = b.cols();
+  if (a.cols() != b.rows())
+    throw std::runtime_error("sparse matMul shape not compatible");
+  MYNN_PROFILE_SCOPE("sparseMatMul", "tensor", 2.0 * m * b.nnz(),
+                     4.0 * (static_cast<double>(a.size()) + static_cast<double>(m) * k) + b.bytes());
+
+  // both sides transposed, so every stored weight is one axpy along the batch
+  Tensor transposed;
+  const float *at = a.data();
+  if (m > 1 && !(a.rowStride() == 1 && a.colStride() == m))
+  {
+    transposed = Tensor(a.transpose());
+    at = transposed.data();
+  }
+  else if (m == 1 && a.colStride() != 1)
+  {
+    transposed = Tensor(a);
+    at = transposed.data();
+  }
+  Tensor ct({k, m});
+
+  // threads take disjoint ranges of the batch, so no two write the same element
+  const SparseChoice &kernels = sparseChoice();
+  parallelFor(0, m, static_cast<std::size_t>(b.nnz()) * m, [&](int lo, int hi)
+              { kernels.scatter(b.rowStart(), b.colIndex(), b.values(), b.rows(), at, ct.getData().data(), m, lo, hi); });
+
+  if (m == 1)
+  {
+    ct.reshape({1, k});
+    return ct;
+  }
+  return Tensor(ct.view().transpose());
+}
+
+void myNN::sparseMatMul(const SparseTensor &a, const TensorView &b, float *c, int ldc, const GemmEpilogue &epilogue)
+{
+  int m = a.rows();
+  int n = b.cols();
+  if (a.cols() != b.rows())
+    throw std::runtime_error("sparse matMul shape not compatible");
+  MYNN_PROFILE_SCOPE("sparseMatMul", "tensor", 2.0 * n * a.nnz(),
+                     4.0 * (static_cast<double>(a.nnz()) * n + static_cast<double>(m) * n) + a.bytes());
+
+  // rows of b are read whole, so they have to be contiguous
+  Tensor packed;
+  const float *rowsOfB = b.data();
+  int ldb = b.rowStride();
+  if (b.colStride() != 1 && n > 1)
+  {
+    packed = Tensor(b);
+    rowsOfB = packed.data();
+    ldb = n;
+  }
+
+  // each row of c is a sum of the rows of b its stored elements pick, the gather
+  // kernel with the roles of the operands swapped
+  const SparseChoice &kernels = sparseChoice();
+  std::size_t work = static_cast<std::size_t>(a.nnz()) * n + static_cast<std::size_t>(m) * n;
+  parallelFor(0, (m + BLOCK_ROWS - 1) / BLOCK_ROWS, work, [&](int lo, int hi)
+              {
+                Tensor tile({BLOCK_ROWS, n});
+                float *products = tile.getData().data();
+                for (int block = lo; block < hi; block++)
+                {
+                  int iBegin = block * BLOCK_ROWS;
+                  int iEnd = std::min(iBegin + BLOCK_ROWS, m);
+                  kernels.gather(a.rowStart(), a.colIndex(), a.values(), rowsOfB, ldb, n, iBegin, iEnd, products);
+                  for (int i = iBegin; i < iEnd; i++)
+                    storeRow(epilogue, products + static_cast<std::size_t>(i - iBegin) * n, c + static_cast<std::size_t>(i) * ldc, n);
+                }
+              });
+}
+
+Tensor myNN::matMul(const SparseTensor &a, const TensorView &b)
+{
+  Tensor c({a.rows(), b.cols()});
+  sparseMatMul(a, b, c.getData().data(), b.cols());
+  return c;
+}
+
+void myNN::transposeMatMulInto(const SparseTensor &a, const TensorView &b, SparseRows &out, bool accumulate)
+{
+  int m = a.rows();
+  int n = b.cols();
+  if (b.rows() != m)
+    throw std::runtime_error("sparse matMul shape not compatible");
+  MYNN_PROFILE_SCOPE("sparseTransposeMatMul", "tensor", 2.0 * n * a.nnz(),
+                     4.0 * (static_cast<double>(a.nnz()) * n + static_cast<double>(m) * n) + a.bytes());
+
+  // sorting the stored elements by column gives the result rows, the columns a uses, and
+  // the row each element adds to, for the scatter kernel in place of its column
+  int nnz = a.nnz();
+  std::vector<std::pair<int, int>> byColumn(nnz);
+  for (int p = 0; p < nnz; p++)
+    byColumn[p] = {a.colIndex()[p], p};
+  std::sort(byColumn.begin(), byColumn.end());
+  std::vector<int> rows;
+  std::vector<int> slots(nnz);
+  for (const std::pair<int, int> &element : byColumn)
+  {
+    if (rows.empty() || rows.back() != element.first)
+      rows.push_back(element.first);
+    slots[element.second] = static_cast<int>(rows.size()) - 1;
+  }
+
+  Tensor values;
+  bool keep = accumulate && out.totalRows == a.cols() && out.values.size() == static_cast<int>(out.rows.size()) * n;
+  if (keep)
+  {
+    // merge with the stored rows; old rows are copied to their new place and the
+    // elements are pointed at the merged rows
+    std::vector<int> merged;
+    std::vector<int> position(rows.size());
+    merged.reserve(out.rows.size() + rows.size());
+    std::vector<std::size_t> oldPlace;
+    oldPlace.reserve(out.rows.size());
+    std::size_t i = 0, j = 0;
+    while (i < out.rows.size() || j < rows.size())
+    {
+      bool takeOld = j == rows.size() || (i < out.rows.size() && out.rows[i] <= rows[j]);
+      bool takeNew = i == out.rows.size() || (j < rows.size() && rows[j] <= out.rows[i]);
+      int row = takeOld ? out.rows[i] : rows[j];
+      if (takeOld)
+      {
+        oldPlace.push_back(merged.size());
+        i++;
+      }
+      if (takeNew)
+      {
+        position[j] = static_cast<int>(merged.size());
+        j++;
+      }
+      merged.push_back(row);
+    }
+
+    if (merged.size() == out.rows.size())
+      values = std::move(out.values);
+    else
+    {
+      values = Tensor({static_cast<int>(merged.size()), n});
+      for (std::size_t old = 0; old < oldPlace.size(); old++)
+        std::copy_n(out.values.data() + old * n, n, values.getData().data() + oldPlace[old] * n);
+    }
+    for (int &slot : slots)
+      slot = position[slot];
+    rows = std::move(merged);
+  }
+  else
+    values = Tensor({static_cast<int>(rows.size()), n});
+
+  Tensor packed;
+  const float *rowsOfB = b.data();
+  if (b.colStride() != 1 || (b.rowStride() != n && m > 1))
+  {
+    packed = Tensor(b);
+    rowsOfB = packed.data();
+  }
+
+  // threads take disjoint column ranges, so no two write the same element
+  const SparseChoice &kernels = sparseChoice();
+  parallelFor(0, n, static_cast<std::size_t>(a.nnz()) * n, [&](int lo, int hi)
+              { kernels.scatter(a.rowStart(), slots.data(), a.values(), m, rowsOfB, values.getData().data(), n, lo, hi); });
+
+  out.totalRows = a.cols();
+  out.rows = std::move(rows);
+  out.values = std::move(values);
+}
+
+const char *myNN::sparseKernelName()
+{
+  return sparseChoice().name;
+}
@@ -1,10 +1,195 @@
 #include "Tensor.hpp"
+#include "Gemm.hpp"
+#include "Profiler.hpp"
+#include "ThreadPool.hpp"
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MYNN_X86 1
+#endif
 
 using namespace myNN;
 
-Tensor::Tensor(const std::vector<float> &data, const std::vector<int> &shape) : data_(data), shape_(shape) {};
+namespace
+{
+  enum class Op
+  {
+    Add,       // out = a + b
+    Sub,       // out = a - b
+    Mul,       // out = a * b
+    AddScalar, // out = a + s
+    SubScalar, // out = a - s
+    MulScalar, // out = a * s
+    Fill       // out = s
+  };
+
+  // plain loops the compiler vectorises for the ISA of the wrapper they are inlined into;
+  // out may be a for the in place operations
+  inline __attribute__((always_inline)) void elementwiseAny(Op op, float *out, const float *a, const float *b,
+                                                            float s, int n)
+  {
+    switch (op)
+    {
+    case Op::Add:
+      for (int i = 0; i < n; i++)
+        out[i] = a[i] + b[i];
+      break;
+    case Op::Sub:
+      for (int i = 0; i < n; i++)
+        out[i] = a[i] - b[i];
+      break;
+    case Op::Mul:
+      for (int i = 0; i < n; i++)
+        out[i] = a[i] * b[i];
+      break;
+    case Op::AddScalar:
+      for (int i = 0; i < n; i++)
+        out[i] = a[i] + s;
+      break;
+    case Op::SubScalar:
+      for (int i = 0; i < n; i++)
+        out[i] = a[i] - s;
+      break;
+    case Op::MulScalar:
+      for (int i = 0; i < n; i++)
+        out[i] = a[i] * s;
+      break;
+    case Op::Fill:
+      for (int i = 0; i < n; i++)
+        out[i] = s;
+      break;
+    }
+  }
+
+  // one running sum per lane of four 8 wide vectors: the loop vectorises without
+  // reassociating anything and keeps several additions in flight, and as the lanes are
+  // the same for every ISA the result does not depend on the CPU
+  constexpr int SUM_LANES = 32;
+
+  inline __attribute__((always_inline)) float sumAny(const float *a, int n)
+  {
+    float acc[SUM_LANES] = {};
+    int i = 0;
+    for (; i + SUM_LANES <= n; i += SUM_LANES)
+    {
+      for (int l = 0; l < SUM_LANES; l++)
+        acc[l] += a[i + l];
+    }
+    for (int l = 0; i < n; i++, l++)
+      acc[l] += a[i];
+
+    // pairwise, which also keeps the rounding error of long sums down
+    for (int width = SUM_LANES / 2; width > 0; width /= 2)
+    {
+      for (int l = 0; l < width; l++)
+        acc[l] += acc[l + width];
+    }
+    return acc[0];
+  }
+
+  using ElementwiseKernel = void (*)(Op op, float *out, const float *a, const float *b, float s, int n);
+  using SumKernel = float (*)(const float *a, int n);
+
+  void elementwisePortable(Op op, float *out, const float *a, const float *b, float s, int n)
+  {
+    elementwiseAny(op, out, a, b, s, n);
+  }
+
+  float sumPortable(const float *a, int n)
+  {
+    return sumAny(a, n);
+  }
+
+#ifdef MYNN_X86
+  // the same loops for 8 and 16 lanes; they only add, subtract and multiply, so every
+  // kernel gives bit identical results
+  __attribute__((target("avx2,fma"))) void elementwiseAvx2(Op op, float *out, const float *a, const float *b,
+                                                           float s, int n)
+  {
+    elementwiseAny(op, out, a, b, s, n);
+  }
+
+  __attribute__((target("avx2,fma"))) float sumAvx2(const float *a, int n)
+  {
+    return sumAny(a, n);
+  }
+
+  __attribute__((target("avx512f"))) void elementwiseAvx512(Op op, float *out, const float *a, const float *b,
+                                                            float s, int n)
+  {
+    elementwiseAny(op, out, a, b, s, n);
+  }
+
+  __attribute__((target("avx512f"))) float sumAvx512(const float *a, int n)
+  {
+    return sumAny(a, n);
+  }
+#endif
+
+  struct KernelChoice
+  {
+    ElementwiseKernel elementwise;
+    SumKernel sum;
+    SimdLevel level;
+    const char *name;
+  };
+
+  KernelChoice pickKernels()
+  {
+#ifdef MYNN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+      return {elementwiseAvx512, sumAvx512, SimdLevel::AVX512, "avx512"};
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return {elementwiseAvx2, sumAvx2, SimdLevel::AVX2, "avx2"};
+#endif
+#ifdef __SSE2__
+    return {elementwisePortable, sumPortable, SimdLevel::SSE2, "sse2"};
+#else
+    return {elementwisePortable, sumPortable, SimdLevel::Portable, "portable"};
+#endif
+  }
+
+  const KernelChoice &kernelChoice()
+  {
+    static const KernelChoice choice = pickKernels();
+    return choice;
+  }
+
+  // op over n elements in parallel ranges, b may be null for the scalar operations
+  void elementwise(Op op, float *out, const float *a, const float *b, float s, int n)
+  {
+    ElementwiseKernel kernel = kernelChoice().elementwise;
+    parallelFor(0, n, n, [&](int lo, int hi)
+                { kernel(op, out + lo, a ? a + lo : nullptr, b ? b + lo : nullptr, s, hi - lo); });
+  }
+}
+
+SimdLevel myNN::simdLevel()
+{
+  return kernelChoice().level;
+}
+
+const char *myNN::tensorKernelName()
+{
+  return kernelChoice().name;
+}
+
+Tensor::Tensor(const std::vector<float> &data, const std::vector<int> &shape) : data_(data.begin(), data.end()), shape_(shape) {};
+
+Tensor::Tensor(const TensorView &view) : data_(view.size()), shape_{view.rows(), view.cols()}
+{
+  int N = view.cols();
+  parallelFor(0, view.rows(), view.size(), [&](int lo, int hi)
+              {
+                for (int i = lo; i < hi; i++)
+                  for (int j = 0; j < N; j++)
+                    data_[i * N + j] = view(i, j);
+              });
+}
 
 Tensor::Tensor(const std::vector<int> &shape, float value) : shape_(shape)
 {
@@ -14,6 +199,23 @@ Tensor::Tensor(const std::vector<int> &shape, float value) : shape_(shape)
   data_.resize(tensor_size, value);
 };
 
+TensorView::TensorView(const Tensor &t)
+    : data_(t.data()), rows_(t.getShape()[0]), cols_(t.getShape()[1]), rowStride_(t.getShape()[1]), colStride_(1) {}
+
+TensorView TensorView::reshape(int rows, int cols) const
+{
+  if (!isContiguous() || rows * cols != size())
+  {
+    throw std::runtime_error("reshape needs a contiguous view of the same size");
+  }
+  return TensorView(data_, rows, cols, cols, 1);
+}
+
+TensorView Tensor::view() const
+{
+  return TensorView(*this);
+}
+
 int Tensor::size() const
 {
   return data_.size();
@@ -56,28 +258,25 @@ void Tensor::print() const
 
 void Tensor::add(const Tensor &other)
 {
-  for (int i = 0; i < size(); i++)
-  {
-    data_[i] += other.data_[i];
-  }
+  MYNN_PROFILE_SCOPE("add", "tensor", size(), 12.0 * size());
+  elementwise(Op::Add, data_.data(), data_.data(), other.data(), 0.0f, size());
 }
 
 void Tensor::add(float a)
 {
-  for (int i = 0; i < size(); i++)
-  {
-    data_[i] += a;
-  }
+  elementwise(Op::AddScalar, data_.data(), data_.data(), nullptr, a, size());
+}
+
+void Tensor::fill(float a)
+{
+  elementwise(Op::Fill, data_.data(), nullptr, nullptr, a, size());
 }
 
 float Tensor::sum() const
 {
-  float s = 0;
-  for (int i = 0; i < size(); i++)
-  {
-    s += data_[i];
-  }
-  return s;
+  // a single pass, so the result does not depend on the number of threads either
+  MYNN_PROFILE_SCOPE("sum", "tensor", size(), 4.0 * size());
+  return kernelChoice().sum(data_.data(), size());
 }
 
 float Tensor::mean() const
@@ -85,94 +284,151 @@ float Tensor::mean() const
   return sum() / size();
 }
 
-Tensor Tensor::matMul(const Tensor &other) const
+Tensor myNN::matMul(const TensorView &a, const TensorView &b)
 {
-  std::vector<int> out_shape = {shape_[0], other.shape_[1]};
-  Tensor result(out_shape);
+  Tensor result({a.rows(), b.cols()});
+  matMulInto(a, b, result);
+  return result;
+}
 
-  int m = shape_[0];
-  int n = other.shape_[1];
-  int k = shape_[1];
+void myNN::matMulInto(const TensorView &a, const TensorView &b, Tensor &c, float alpha, float beta)
+{
+  if (a.cols() != b.rows())
+  {
+    throw std::runtime_error("matMul shapes not compatible");
+  }
 
-  for (int i = 0; i < m; ++i)
+  int m = a.rows();
+  int n = b.cols();
+  int k = a.cols();
+  if (c.getShape().size() != 2 || c.getShape()[0] != m || c.getShape()[1] != n)
   {
-    for (int j = 0; j < n; ++j)
-    {
-      float sum = 0.0f;
-      for (int p = 0; p < k; ++p)
-      {
-        sum += data_[i * k + p] * other.data_[p * n + j];
-      }
-      result.data_[i * n + j] = sum;
-    }
+    throw std::runtime_error("matMul output shape not compatible");
   }
+  MYNN_PROFILE_SCOPE("matMul", "tensor", 2.0 * m * n * k, 4.0 * (static_cast<double>(m) * k + static_cast<double>(k) * n + static_cast<double>(m) * n));
 
-  return result;
+  GemmEpilogue epilogue;
+  epilogue.alpha = alpha;
+  epilogue.beta = beta;
+  gemmStrided(m, n, k, a.data(), a.rowStride(), a.colStride(), b.data(), b.rowStride(), b.colStride(),
+              c.getData().data(), n, epilogue);
 }
 
-Tensor Tensor::transpose() const
+Tensor myNN::matMulBias(const TensorView &a, const TensorView &b, const TensorView &bias, Activation activation)
 {
-  Tensor transposed({shape_[1], shape_[0]});
-  for (int i = 0; i < shape_[0]; i++)
+  if (a.cols() != b.rows())
   {
-    for (int j = 0; j < shape_[1]; j++)
-    {
-      transposed.data_[j * shape_[0] + i] = data_[i * shape_[1] + j];
-    }
+    throw std::runtime_error("matMul shapes not compatible");
   }
+  if (bias.size() != b.cols() || !bias.isContiguous())
+  {
+    throw std::runtime_error("bias shape not compatible");
+  }
+
+  int m = a.rows();
+  int n = b.cols();
+  int k = a.cols();
+  MYNN_PROFILE_SCOPE("matMulBias", "tensor", 2.0 * m * n * k, 4.0 * (static_cast<double>(m) * k + static_cast<double>(k) * n + static_cast<double>(m) * n));
+
+  GemmEpilogue epilogue;
+  epilogue.bias = bias.data();
+  epilogue.activation = activation;
+
+  Tensor result({m, n});
+  gemmStrided(m, n, k, a.data(), a.rowStride(), a.colStride(), b.data(), b.rowStride(), b.colStride(),
+              result.getData().data(), n, epilogue);
+
+  return result;
+}
+
+Tensor Tensor::matMul(const TensorView &other) const
+{
+  return myNN::matMul(*this, other);
+}
+
+Tensor Tensor::matMulBias(const TensorView &other, const TensorView &bias, Activation activation) const
+{
+  return myNN::matMulBias(*this, other, bias, activation);
+}
+
+Tensor Tensor::transposeMatMul(const TensorView &other) const
+{
+  return myNN::matMul(view().transpose(), other);
+}
+
+Tensor Tensor::matMulTranspose(const TensorView &other) const
+{
+  return myNN::matMul(*this, other.transpose());
+}
+
+Tensor Tensor::transpose() const
+{
+  MYNN_PROFILE_SCOPE("transpose", "tensor", 0.0, 8.0 * size());
+  int M = shape_[0];
+  int N = shape_[1];
+  Tensor transposed({N, M});
+
+  // copy in square tiles so both reads and writes stay within a few cache lines
+  constexpr int TILE = 32;
+  int rowTiles = (M + TILE - 1) / TILE;
+  parallelFor(0, rowTiles, size(), [&](int lo, int hi)
+              {
+                for (int ib = lo * TILE; ib < std::min(hi * TILE, M); ib += TILE)
+                {
+                  for (int jb = 0; jb < N; jb += TILE)
+                  {
+                    for (int i = ib; i < std::min(ib + TILE, M); i++)
+                    {
+                      for (int j = jb; j < std::min(jb + TILE, N); j++)
+                      {
+                        transposed.data_[j * M + i] = data_[i * N + j];
+                      }
+                    }
+                  }
+                }
+              });
 
   return transposed;
 }
 
 void Tensor::sub(const Tensor &other)
 {
-  for (int i = 0; i < size(); i++)
-  {
-    data_[i] -= other.data_[i];
-  }
+  MYNN_PROFILE_SCOPE("sub", "tensor", size(), 12.0 * size());
+  elementwise(Op::Sub, data_.data(), data_.data(), other.data(), 0.0f, size());
 }
 
 void Tensor::sub(float a)
 {
-  for (int i = 0; i < size(); i++)
-  {
-    data_[i] -= a;
-  }
+  elementwise(Op::SubScalar, data_.data(), data_.data(), nullptr, a, size());
 }
 
 void Tensor::mul_inplace(const Tensor &other)
 {
-  for (int i = 0; i < size(); i++)
-  {
-    data_[i] *= other.data_[i];
-  }
+  MYNN_PROFILE_SCOPE("mul_inplace", "tensor", size(), 12.0 * size());
+  elementwise(Op::Mul, data_.data(), data_.data(), other.data(), 0.0f, size());
 }
 
 void Tensor::mul_inplace(float a)
 {
-  for (int i = 0; i < size(); i++)
-  {
-    data_[i] *= a;
-  }
+  elementwise(Op::MulScalar, data_.data(), data_.data(), nullptr, a, size());
 }
 
 Tensor Tensor::mul(float a)
 {
+  MYNN_PROFILE_SCOPE("mul", "tensor", size(), 8.0 * size());
   Tensor result({shape_});
-  for (int i = 0; i < size(); i++)
-  {
-    result[i] = data_[i] * a;
-  }
+  elementwise(Op::MulScalar, result.data_.data(), data_.data(), nullptr, a, size());
   return result;
 }
 
-Tensor Tensor::addBroadcast(const Tensor &other) const
+Tensor Tensor::addBroadcast(const TensorView &other) const
 {
+  MYNN_PROFILE_SCOPE("addBroadcast", "tensor", size(), 8.0 * size());
   int M = shape_[0];
   int N = shape_[1];
 
-  int m = other.shape_[0];
-  int n = other.shape_[1];
+  int m = other.rows();
+  int n = other.cols();
 
   enum class Mode
   {
@@ -205,69 +461,99 @@ Tensor Tensor::addBroadcast(const Tensor &other) const
 
   Tensor out({M, N});
 
-  for (int i = 0; i < M; i++)
+  // materialise strided views so the loops below can assume row-major data
+  Tensor packed;
+  const float *b = other.data();
+  if (!other.isContiguous())
   {
-    for (int j = 0; j < N; j++)
-    {
-
-      float a = data_[i * N + j];
-      float b;
-
-      switch (mode)
-      {
-      case Mode::SCALAR:
-        b = other.data_[0];
-        break;
-
-      case Mode::ROW:
-        b = other.data_[j];
-        break;
-
-      case Mode::COL:
-        b = other.data_[i];
-        break;
-
-      case Mode::FULL:
-        b = other.data_[i * N + j];
-        break;
-      }
-
-      out.data_[i * N + j] = a + b;
-    }
+    packed = Tensor(other);
+    b = packed.data();
   }
 
+  // pick the loop once per row instead of branching on every element
+  parallelFor(0, M, size(), [&](int lo, int hi)
+              {
+                for (int i = lo; i < hi; i++)
+                {
+                  const float *a = data_.data() + i * N;
+                  float *o = out.data_.data() + i * N;
+
+                  switch (mode)
+                  {
+                  case Mode::SCALAR:
+                    for (int j = 0; j < N; j++)
+                      o[j] = a[j] + b[0];
+                    break;
+
+                  case Mode::ROW:
+                    for (int j = 0; j < N; j++)
+                      o[j] = a[j] + b[j];
+                    break;
+
+                  case Mode::COL:
+                    for (int j = 0; j < N; j++)
+                      o[j] = a[j] + b[i];
+                    break;
+
+                  case Mode::FULL:
+                    for (int j = 0; j < N; j++)
+                      o[j] = a[j] + b[i * N + j];
+                    break;
+                  }
+                }
+              });
+
   return out;
 }
 
 Tensor Tensor::operator-(const Tensor &a) const
 {
   Tensor result({a.getShape()});
-
-  for (int i = 0; i < size(); i++)
-  {
-    result[i] = data_[i] - a[i];
-  }
-
+  elementwise(Op::Sub, result.data_.data(), data_.data(), a.data(), 0.0f, size());
   return result;
 }
 
 Tensor Tensor::sumRows() const
 {
-  Tensor result({1, shape_[1]}); // 1xN output
+  return myNN::sumRows(*this);
+}
 
-  for (int j = 0; j < shape_[1]; j++)
+Tensor myNN::sumRows(const TensorView &t)
+{
+  Tensor result({1, t.cols()}); // 1xN output
+  sumRowsInto(t, result);
+  return result;
+}
+
+void myNN::sumRowsInto(const TensorView &t, Tensor &result, float alpha, float beta)
+{
+  MYNN_PROFILE_SCOPE("sumRows", "tensor", t.size(), 4.0 * t.size());
+  int M = t.rows();
+  int N = t.cols();
+  if (result.size() != N)
   {
-    float s = 0.0f;
-    for (int i = 0; i < shape_[0]; i++)
-    {
-      s += (*this)(i, j);
-    }
-    result(0, j) = s;
+    throw std::runtime_error("sumRows output shape not compatible");
   }
-  return result;
+  float *out = result.getData().data();
+
+  // each thread owns a range of columns and walks the rows in memory order
+  parallelFor(0, N, t.size(), [&](int lo, int hi)
+              {
+                for (int j = lo; j < hi; j++)
+                {
+                  out[j] = beta != 0.0f ? beta * out[j] : 0.0f;
+                }
+                for (int i = 0; i < M; i++)
+                {
+                  for (int j = lo; j < hi; j++)
+                  {
+                    out[j] += alpha * t(i, j);
+                  }
+                }
+              });
 }
 
 void Tensor::zeroGrad()
 {
-  std::fill(data_.begin(), data_.end(), 0.0f);
+  fill(0.0f);
 }
@@ -0,0 +1,171 @@
+#include "ThreadPool.hpp"
+#include "Allocator.hpp"
+
+#include <cstdlib>
+
+using namespace myNN;
+
+namespace
+{
+  thread_local bool insideJob = false;
+
+  int defaultThreadCount()
+  {
+    if (const char *env = std::getenv("MYNN_NUM_THREADS"))
+    {
+      int n = std::atoi(env);
+      if (n > 0)
+        return n;
+    }
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw > 0 ? static_cast<int>(hw) : 1;
+  }
+}
+
+ThreadPool::ThreadPool()
+{
+  startWorkers(defaultThreadCount());
+}
+
+ThreadPool::~ThreadPool()
+{
+  stopWorkers();
+}
+
+ThreadPool &ThreadPool::instance()
+{
+  static ThreadPool pool;
+  return pool;
+}
+
+bool ThreadPool::inParallelRegion()
+{
+  return insideJob;
+}
+
+void ThreadPool::setNumThreads(int n)
+{
+  if (n <= 0)
+    n = defaultThreadCount();
+
+  std::lock_guard<std::mutex> submit(submitMutex_);
+  if (n == nThreads_)
+    return;
+  stopWorkers();
+  startWorkers(n);
+}
+
+void ThreadPool::startWorkers(int nThreads)
+{
+  nThreads_ = nThreads;
+  stop_ = false;
+  // the calling thread takes part in every job, so spawn one worker less
+  for (int i = 1; i < nThreads; i++)
+  {
+    workers_.emplace_back([this]
+                          { workerLoop(); });
+  }
+}
+
+void ThreadPool::stopWorkers()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto &worker : workers_)
+  {
+    worker.join();
+  }
+  workers_.clear();
+}
+
+bool ThreadPool::runChunk(std::unique_lock<std::mutex> &lock)
+{
+  if (job_ == nullptr || nextChunk_ >= nChunks_)
+    return false;
+
+  int chunk = nextChunk_++;
+  const std::function<void(int)> *job = job_;
+  Allocator *allocator = jobAllocator_;
+  bool failed = error_ != nullptr;
+
+  lock.unlock();
+  std::exception_ptr error;
+  if (!failed)
+  {
+    bool outer = insideJob;
+    Allocator *outerAllocator = &defaultAllocator();
+    insideJob = true;
+    setDefaultAllocator(allocator);
+    try
+    {
+      (*job)(chunk);
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+    setDefaultAllocator(outerAllocator);
+    insideJob = outer;
+  }
+  lock.lock();
+
+  if (error && !error_)
+    error_ = error;
+
+  if (--pendingChunks_ == 0)
+    done_.notify_all();
+  return true;
+}
+
+void ThreadPool::workerLoop()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  unsigned long seen = generation_;
+  while (true)
+  {
+    wake_.wait(lock, [&]
+               { return stop_ || generation_ != seen; });
+    if (stop_)
+      return;
+    seen = generation_;
+
+    while (runChunk(lock))
+    {
+    }
+  }
+}
+
+void ThreadPool::run(int nChunks, const std::function<void(int)> &fn)
+{
+  if (nChunks <= 0)
+    return;
+
+  std::lock_guard<std::mutex> submit(submitMutex_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  job_ = &fn;
+  jobAllocator_ = &defaultAllocator();
+  nChunks_ = nChunks;
+  nextChunk_ = 0;
+  pendingChunks_ = nChunks;
+  generation_++;
+  wake_.notify_all();
+
+  // the caller works on chunks too instead of sleeping
+  while (runChunk(lock))
+  {
+  }
+
+  done_.wait(lock, [&]
+             { return pendingChunks_ == 0; });
+  job_ = nullptr;
+
+  if (error_)
+  {
+    std::exception_ptr error = error_;
+    error_ = nullptr;
+    std::rethrow_exception(error);
+  }
+}
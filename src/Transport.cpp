@@ -0,0 +1,407 @@
+#include "Transport.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace myNN;
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+
+  constexpr std::size_t LINE = 64;
+
+  std::size_t alignUp(std::size_t x)
+  {
+    return (x + LINE - 1) / LINE * LINE;
+  }
+
+  Clock::time_point deadlineAfter(double seconds)
+  {
+    return Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+  }
+
+  std::runtime_error systemError(const std::string &what)
+  {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+  }
+
+  // start of the segment, counts the ranks that have mapped it
+  struct SegmentHeader
+  {
+    alignas(LINE) std::atomic<std::uint32_t> arrived;
+  };
+
+  static_assert(std::atomic<std::uint32_t>::is_always_lock_free && std::atomic<std::uint64_t>::is_always_lock_free,
+                "shared memory rings need lock-free atomics");
+}
+
+// byte ring written by rank - 1 and read by rank; the producer and the consumer
+// counters live on separate cache lines, the data follows the struct
+struct SharedMemoryTransport::Channel
+{
+  alignas(LINE) std::atomic<std::uint64_t> head; // bytes written so far
+  alignas(LINE) std::atomic<std::uint64_t> tail; // bytes read so far
+
+  char *data() { return reinterpret_cast<char *>(this) + sizeof(Channel); }
+};
+
+SharedMemoryTransport::SharedMemoryTransport(const std::string &name, int rank, int size, std::size_t channelBytes,
+                                             double timeoutSeconds)
+    : rank_(rank), size_(size), name_(name), capacity_(alignUp(std::max<std::size_t>(channelBytes, LINE))),
+      timeoutSeconds_(timeoutSeconds)
+{
+  if (size <= 0 || rank < 0 || rank >= size)
+    throw std::runtime_error("rank must lie in [0, size)");
+
+  mapSize_ = sizeof(SegmentHeader) + static_cast<std::size_t>(size) * (sizeof(Channel) + capacity_);
+  Clock::time_point deadline = deadlineAfter(timeoutSeconds_);
+
+  // a fresh segment is zero filled, which is the initial state of every counter
+  int fd = -1;
+  if (rank == 0)
+  {
+    fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+      throw systemError("cannot create shared memory " + name);
+    if (::ftruncate(fd, static_cast<off_t>(mapSize_)) != 0)
+    {
+      ::close(fd);
+      ::shm_unlink(name.c_str());
+      throw systemError("cannot size shared memory " + name);
+    }
+  }
+  else
+  {
+    // wait for rank 0 to create and size the segment
+    while (true)
+    {
+      fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+      struct stat st;
+      if (fd >= 0 && ::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) == mapSize_)
+        break;
+      if (fd >= 0)
+        ::close(fd);
+      if (Clock::now() > deadline)
+        throw std::runtime_error("timed out waiting for shared memory " + name);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  map_ = ::mmap(nullptr, mapSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map_ == MAP_FAILED)
+  {
+    map_ = nullptr;
+    if (rank == 0)
+      ::shm_unlink(name.c_str());
+    throw systemError("cannot map shared memory " + name);
+  }
+
+  // once every rank has the segment mapped the name is no longer needed
+  SegmentHeader *header = static_cast<SegmentHeader *>(map_);
+  header->arrived.fetch_add(1, std::memory_order_acq_rel);
+  while (header->arrived.load(std::memory_order_acquire) < static_cast<std::uint32_t>(size))
+  {
+    if (Clock::now() > deadline)
+    {
+      ::munmap(map_, mapSize_);
+      if (rank == 0)
+        ::shm_unlink(name.c_str());
+      throw std::runtime_error("timed out waiting for all ranks on " + name);
+    }
+    std::this_thread::yield();
+  }
+  if (rank == 0)
+  {
+    ::shm_unlink(name.c_str());
+  }
+  unlinked_ = true;
+}
+
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+  if (map_)
+    ::munmap(map_, mapSize_);
+  if (rank_ == 0 && !unlinked_)
+    ::shm_unlink(name_.c_str());
+}
+
+SharedMemoryTransport::Channel *SharedMemoryTransport::channel(int rank) const
+{
+  char *base = static_cast<char *>(map_) + sizeof(SegmentHeader);
+  return reinterpret_cast<Channel *>(base + static_cast<std::size_t>(rank) * (sizeof(Channel) + capacity_));
+}
+
+void SharedMemoryTransport::exchange(const void *send, std::size_t sendBytes, void *recv, std::size_t recvBytes)
+{
+  Channel *out = channel((rank_ + 1) % size_);
+  Channel *in = channel(rank_);
+  const char *src = static_cast<const char *>(send);
+  char *dst = static_cast<char *>(recv);
+
+  std::size_t sent = 0;
+  std::size_t received = 0;
+  Clock::time_point deadline = deadlineAfter(timeoutSeconds_);
+  int idle = 0;
+  while (sent < sendBytes || received < recvBytes)
+  {
+    bool progress = false;
+
+    if (sent < sendBytes)
+    {
+      std::uint64_t head = out->head.load(std::memory_order_relaxed);
+      std::uint64_t tail = out->tail.load(std::memory_order_acquire);
+      std::size_t n = std::min(capacity_ - static_cast<std::size_t>(head - tail), sendBytes - sent);
+      if (n > 0)
+      {
+        std::size_t offset = head % capacity_;
+        std::size_t first = std::min(n, capacity_ - offset);
+        std::memcpy(out->data() + offset, src + sent, first);
+        std::memcpy(out->data(), src + sent + first, n - first);
+        out->head.store(head + n, std::memory_order_release);
+        sent += n;
+        progress = true;
+      }
+    }
+
+    if (received < recvBytes)
+    {
+      std::uint64_t tail = in->tail.load(std::memory_order_relaxed);
+      std::uint64_t head = in->head.load(std::memory_order_acquire);
+      std::size_t n = std::min(static_cast<std::size_t>(head - tail), recvBytes - received);
+      if (n > 0)
+      {
+        std::size_t offset = tail % capacity_;
+        std::size_t first = std::min(n, capacity_ - offset);
+        std::memcpy(dst + received, in->data() + offset, first);
+        std::memcpy(dst + received + first, in->data(), n - first);
+        in->tail.store(tail + n, std::memory_order_release);
+        received += n;
+        progress = true;
+      }
+    }
+
+    // spin briefly, then give the core to the peer we are waiting for
+    if (progress)
+    {
+      idle = 0;
+      deadline = deadlineAfter(timeoutSeconds_);
+    }
+    else if (++idle > 64)
+    {
+      if (Clock::now() > deadline)
+        throw std::runtime_error("shared memory peer made no progress");
+      std::this_thread::yield();
+    }
+  }
+}
+
+TcpTransport::TcpTransport(int rank, int size, int basePort, const std::string &nextHost, double timeoutSeconds)
+    : rank_(rank), size_(size), timeoutSeconds_(timeoutSeconds)
+{
+  if (size <= 0 || rank < 0 || rank >= size)
+    throw std::runtime_error("rank must lie in [0, size)");
+  if (size == 1)
+    return;
+
+  int next = (rank + 1) % size;
+  int prev = (rank + size - 1) % size;
+  Clock::time_point deadline = deadlineAfter(timeoutSeconds_);
+
+  int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0)
+    throw systemError("cannot create socket");
+  int one = 1;
+  ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(static_cast<std::uint16_t>(basePort + rank));
+  if (::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(listener, 1) != 0)
+  {
+    ::close(listener);
+    throw systemError("cannot listen on port " + std::to_string(basePort + rank));
+  }
+
+  try
+  {
+    // connect to the next rank, which may not be listening yet
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *found = nullptr;
+    std::string port = std::to_string(basePort + next);
+    if (::getaddrinfo(nextHost.c_str(), port.c_str(), &hints, &found) != 0 || !found)
+      throw std::runtime_error("cannot resolve " + nextHost);
+    while (true)
+    {
+      sendFd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+      if (sendFd_ >= 0 && ::connect(sendFd_, found->ai_addr, found->ai_addrlen) == 0)
+        break;
+      close();
+      if (Clock::now() > deadline)
+      {
+        ::freeaddrinfo(found);
+        throw std::runtime_error("timed out connecting to " + nextHost + ":" + port);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ::freeaddrinfo(found);
+
+    // introduce ourselves, so a wrong peer is caught here rather than as garbage later
+    std::int32_t me = rank;
+    if (::send(sendFd_, &me, sizeof(me), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(me)))
+      throw systemError("cannot send rank");
+
+    pollfd pfd = {listener, POLLIN, 0};
+    int waitMs = static_cast<int>(std::max(0.0, std::chrono::duration<double, std::milli>(deadline - Clock::now()).count()));
+    if (::poll(&pfd, 1, waitMs) <= 0)
+      throw std::runtime_error("timed out waiting for rank " + std::to_string(prev));
+    recvFd_ = ::accept(listener, nullptr, nullptr);
+    if (recvFd_ < 0)
+      throw systemError("cannot accept connection");
+    std::int32_t peer = -1;
+    if (::recv(recvFd_, &peer, sizeof(peer), MSG_WAITALL) != static_cast<ssize_t>(sizeof(peer)) || peer != prev)
+      throw std::runtime_error("unexpected peer on port " + std::to_string(basePort + rank));
+  }
+  catch (...)
+  {
+    ::close(listener);
+    close();
+    throw;
+  }
+  ::close(listener);
+
+  for (int fd : {sendFd_, recvFd_})
+  {
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+}
+
+TcpTransport::~TcpTransport()
+{
+  close();
+}
+
+void TcpTransport::close()
+{
+  if (sendFd_ >= 0)
+    ::close(sendFd_);
+  if (recvFd_ >= 0)
+    ::close(recvFd_);
+  sendFd_ = -1;
+  recvFd_ = -1;
+}
+
+void TcpTransport::exchange(const void *send, std::size_t sendBytes, void *recv, std::size_t recvBytes)
+{
+  if (size_ == 1)
+  {
+    std::memcpy(recv, send, std::min(sendBytes, recvBytes));
+    return;
+  }
+
+  const char *src = static_cast<const char *>(send);
+  char *dst = static_cast<char *>(recv);
+  std::size_t sent = 0;
+  std::size_t received = 0;
+  int timeoutMs = static_cast<int>(timeoutSeconds_ * 1000.0);
+  while (sent < sendBytes || received < recvBytes)
+  {
+    pollfd fds[2];
+    int nfds = 0;
+    if (sent < sendBytes)
+      fds[nfds++] = {sendFd_, POLLOUT, 0};
+    if (received < recvBytes)
+      fds[nfds++] = {recvFd_, POLLIN, 0};
+
+    int ready = ::poll(fds, nfds, timeoutMs);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready < 0)
+      throw systemError("poll failed");
+    if (ready == 0)
+      throw std::runtime_error("tcp peer made no progress");
+
+    for (int i = 0; i < nfds; i++)
+    {
+      if (fds[i].revents == 0)
+        continue;
+      if (fds[i].fd == sendFd_)
+      {
+        ssize_t n = ::send(sendFd_, src + sent, sendBytes - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          throw systemError("tcp send failed");
+        if (n > 0)
+          sent += static_cast<std::size_t>(n);
+      }
+      else
+      {
+        ssize_t n = ::recv(recvFd_, dst + received, recvBytes - received, 0);
+        if (n == 0)
+          throw std::runtime_error("tcp peer closed the connection");
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          throw systemError("tcp receive failed");
+        if (n > 0)
+          received += static_cast<std::size_t>(n);
+      }
+    }
+  }
+}
+
+void myNN::ringAllReduce(Transport &transport, float *data, std::size_t n, std::vector<float> &scratch)
+{
+  int p = transport.size();
+  if (p == 1 || n == 0)
+    return;
+
+  int r = transport.rank();
+  auto begin = [&](int chunk)
+  { return n * static_cast<std::size_t>(chunk) / static_cast<std::size_t>(p); };
+  auto length = [&](int chunk)
+  { return begin(chunk + 1) - begin(chunk); };
+  scratch.resize(n / p + 1);
+
+  // reduce-scatter: in step s rank r passes on chunk r - s and adds chunk r - s - 1 from
+  // its predecessor, after p - 1 steps it holds the full sum of chunk r + 1
+  for (int s = 0; s < p - 1; s++)
+  {
+    int sendChunk = (r - s + p) % p;
+    int recvChunk = (r - s - 1 + 2 * p) % p;
+    transport.exchange(data + begin(sendChunk), length(sendChunk) * sizeof(float),
+                       scratch.data(), length(recvChunk) * sizeof(float));
+    float *acc = data + begin(recvChunk);
+    for (std::size_t i = 0, len = length(recvChunk); i < len; i++)
+      acc[i] += scratch[i];
+  }
+
+  // all-gather: the finished chunks travel once around the ring
+  for (int s = 0; s < p - 1; s++)
+  {
+    int sendChunk = (r - s + 1 + p) % p;
+    int recvChunk = (r - s + p) % p;
+    transport.exchange(data + begin(sendChunk), length(sendChunk) * sizeof(float),
+                       data + begin(recvChunk), length(recvChunk) * sizeof(float));
+  }
+}
@@ -1,11 +1,43 @@
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <iostream>
 #include <cmath>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 #include "Network.hpp"
 #include "DenseLayer.hpp"
 #include "Tensor.hpp"
 #include "ReLuLayer.hpp"
+#include "Gemm.hpp"
+#include "ThreadPool.hpp"
+#include "Allocator.hpp"
+#include "TensorExpr.hpp"
+#include "Dataset.hpp"
+#include "Checkpoint.hpp"
+#include "InferenceSession.hpp"
+#include "Quantized.hpp"
+#include "Half.hpp"
+#include "StaticNetwork.hpp"
+#include "Profiler.hpp"
+#include "Optimizer.hpp"
+#include "DataParallel.hpp"
+#include "Distributed.hpp"
+#include "InferenceServer.hpp"
+#include "Sparse.hpp"
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace myNN;
 
@@ -315,7 +347,7 @@ void test_LinearRegression()
 
       Tensor dL_dY = net.getLayers().back().dL_dY(y_pred, Y[i]);
 
-      net.backProp(dL_dY, Y[i]);
+      net.backProp(dL_dY, X[i]);
       net.updateParameters(lr);
 
       net.zeroGrad();
@@ -330,8 +362,2129 @@ void test_LinearRegression()
   }
 }
 
-int main()
+// naive reference product used to check the blocked kernels
+Tensor referenceMatMul(Tensor &A, Tensor &B)
 {
+  int m = A.getShape()[0];
+  int k = A.getShape()[1];
+  int n = B.getShape()[1];
+  Tensor C({m, n});
+  for (int i = 0; i < m; i++)
+    for (int j = 0; j < n; j++)
+    {
+      double s = 0.0;
+      for (int p = 0; p < k; p++)
+        s += A(i, p) * B(p, j);
+      C(i, j) = static_cast<float>(s);
+    }
+  return C;
+}
+
+void test_matMulBlocked()
+{
+  // sizes that are not multiples of the register tile and cross the KC block
+  int m = 67, k = 301, n = 45;
+  Tensor A({m, k});
+  Tensor B({k, n});
+  A.apply([](float x)
+          { return ((float)rand() / RAND_MAX - 0.5f); });
+  B.apply([](float x)
+          { return ((float)rand() / RAND_MAX - 0.5f); });
+
+  Tensor C = A.matMul(B);
+  Tensor R = referenceMatMul(A, B);
+
+  assert(C.getShape()[0] == m);
+  assert(C.getShape()[1] == n);
+  for (int i = 0; i < C.size(); i++)
+    assert(std::fabs(C[i] - R[i]) < 1e-3f);
+}
+
+void test_matMulTransposed()
+{
+  Tensor A({37, 19});
+  Tensor B({37, 23});
+  Tensor W({23, 19});
+  A.apply([](float x)
+          { return ((float)rand() / RAND_MAX - 0.5f); });
+  B.apply([](float x)
+          { return ((float)rand() / RAND_MAX - 0.5f); });
+  W.apply([](float x)
+          { return ((float)rand() / RAND_MAX - 0.5f); });
+
+  // A^T * B, as used by DenseLayer::dW
+  Tensor AtB = A.transposeMatMul(B);
+  Tensor At = A.transpose();
+  Tensor refAtB = referenceMatMul(At, B);
+  assert(AtB.getShape()[0] == 19);
+  assert(AtB.getShape()[1] == 23);
+  for (int i = 0; i < AtB.size(); i++)
+    assert(std::fabs(AtB[i] - refAtB[i]) < 1e-4f);
+
+  // B * W^T, as used by DenseLayer::dX
+  Tensor BWt = B.matMulTranspose(W.transpose());
+  Tensor refBWt = referenceMatMul(B, W);
+  assert(BWt.getShape()[0] == 37);
+  assert(BWt.getShape()[1] == 19);
+  for (int i = 0; i < BWt.size(); i++)
+    assert(std::fabs(BWt[i] - refBWt[i]) < 1e-4f);
+}
+
+void test_matMulSmallRows()
+{
+  // batches smaller than a register tile take the unpacked path, with B stored either
+  // by rows or by columns; K and N cross its blocks
+  int k = 1100, n = 70;
+  Tensor B({k, n});
+  Tensor Bt({n, k});
+  B.apply([](float x)
+          { return ((float)rand() / RAND_MAX - 0.5f); });
+  for (int p = 0; p < k; p++)
+    for (int j = 0; j < n; j++)
+      Bt(j, p) = B(p, j);
+  float bias[70];
+  for (int j = 0; j < n; j++)
+    bias[j] = (float)(j % 7) * 0.1f - 0.3f;
+
+  for (int m : {1, 3, 5})
+  {
+    Tensor A({m, k});
+    A.apply([](float x)
+            { return ((float)rand() / RAND_MAX - 0.5f); });
+    Tensor R = referenceMatMul(A, B);
+
+    Tensor C = A.matMul(B);
+    Tensor Ct = A.matMulTranspose(Bt);
+    for (int i = 0; i < R.size(); i++)
+    {
+      assert(std::fabs(C[i] - R[i]) < 1e-3f);
+      assert(std::fabs(Ct[i] - R[i]) < 1e-3f);
+    }
+
+    GemmEpilogue epilogue;
+    epilogue.bias = bias;
+    epilogue.activation = Activation::ReLU;
+    epilogue.alpha = 0.5f;
+    epilogue.beta = 2.0f;
+    for (bool transB : {false, true})
+    {
+      Tensor D({m, n});
+      D.fill(0.25f);
+      gemm(false, transB, m, n, k, A.data(), k, transB ? Bt.data() : B.data(), transB ? k : n,
+           D.getData().data(), n, epilogue);
+      for (int i = 0; i < m; i++)
+        for (int j = 0; j < n; j++)
+        {
+          float expected = std::max(0.0f, 0.5f * R(i, j) + 0.5f + bias[j]);
+          assert(std::fabs(D(i, j) - expected) < 1e-3f);
+        }
+    }
+  }
+}
+
+void test_threadPool()
+{
+  ThreadPool &pool = ThreadPool::instance();
+  int oldThreads = pool.numThreads();
+  std::size_t oldThreshold = pool.serialThreshold();
+
+  // force small kernels onto several threads
+  pool.setNumThreads(4);
+  pool.setSerialThreshold(64);
+
+  std::vector<int> hits(1000, 0);
+  parallelFor(0, 1000, 1000, [&](int lo, int hi)
+              {
+                for (int i = lo; i < hi; i++)
+                  hits[i]++;
+              });
+  for (int h : hits)
+    assert(h == 1);
+
+  Tensor A({53, 70});
+  Tensor B({70, 41});
+  for (int i = 0; i < A.size(); i++)
+    A[i] = (float)(i % 13) - 6.0f;
+  for (int i = 0; i < B.size(); i++)
+    B[i] = (float)(i % 7) * 0.25f;
+
+  Tensor C = A.matMul(B);
+  Tensor R = referenceMatMul(A, B);
+  for (int i = 0; i < C.size(); i++)
+    assert(std::fabs(C[i] - R[i]) < 1e-3f);
+
+  Tensor T = A.transpose();
+  for (int i = 0; i < 53; i++)
+    for (int j = 0; j < 70; j++)
+      assert(T(j, i) == A(i, j));
+
+  Tensor S = A.sumRows();
+  for (int j = 0; j < 70; j++)
+  {
+    float s = 0.0f;
+    for (int i = 0; i < 53; i++)
+      s += A(i, j);
+    assert(std::fabs(S(0, j) - s) < 1e-4f);
+  }
+
+  Tensor D = A - A.mul(2.0f);
+  D.add(A);
+  for (int i = 0; i < D.size(); i++)
+    assert(D[i] == 0.0f);
+
+  Tensor E = A;
+  E.apply([](float x)
+          { return x * x; });
+  for (int i = 0; i < E.size(); i++)
+    assert(E[i] == A[i] * A[i]);
+
+  // an exception in any chunk reaches the caller after the job, and the pool and the
+  // calling thread keep working in parallel afterwards
+  for (int failing : {0, 3})
+  {
+    bool threw = false;
+    try
+    {
+      pool.run(4, [&](int chunk)
+               {
+                 if (chunk == failing)
+                   throw std::runtime_error("chunk failed");
+               });
+    }
+    catch (const std::runtime_error &)
+    {
+      threw = true;
+    }
+    assert(threw && !ThreadPool::inParallelRegion());
+  }
+  std::vector<char> parallel(4, 0);
+  pool.run(4, [&](int chunk)
+           { parallel[chunk] = ThreadPool::inParallelRegion(); });
+  for (char p : parallel)
+    assert(p);
+
+  pool.setSerialThreshold(oldThreshold);
+  pool.setNumThreads(oldThreads);
+}
+
+void test_denseForwardFused()
+{
+  DenseLayer layer(33, 21);
+  for (int j = 0; j < 21; j++)
+    layer.getBias()(0, j) = (float)j * 0.1f - 1.0f;
+
+  Tensor input({10, 33});
+  for (int i = 0; i < input.size(); i++)
+    input[i] = (float)((i * 7) % 11) * 0.1f - 0.5f;
+
+  Tensor unfused = input.matMul(layer.getWeights()).addBroadcast(layer.getBias());
+  Tensor linear = layer.forward(input);
+  for (int i = 0; i < unfused.size(); i++)
+    assert(std::fabs(linear[i] - unfused[i]) < 1e-5f);
+
+  ReLuLayer relu;
+  Tensor reference = relu.forward(unfused);
+  Tensor fused = layer.forward(input, Activation::ReLU);
+  for (int i = 0; i < reference.size(); i++)
+    assert(std::fabs(fused[i] - reference[i]) < 1e-5f);
+}
+
+void test_poolAllocator()
+{
+  std::size_t index;
+  assert(PoolAllocator::sizeClass(1, index) == 64 && index == 0);
+  assert(PoolAllocator::sizeClass(256, index) == 256 && index == 3);
+  assert(PoolAllocator::sizeClass(257, index) == 320 && index == 4);
+  assert(PoolAllocator::sizeClass(4000, index) == 4096);
+
+  PoolAllocator pool;
+  {
+    Workspace workspace(pool);
+
+    DenseLayer layer(64, 32);
+    Tensor input({16, 64}, 0.5f);
+    Tensor target({16, 32}, 0.1f);
+    assert(reinterpret_cast<std::uintptr_t>(input.getData().data()) % TENSOR_ALIGNMENT == 0);
+
+    // after the first step every temporary is served from the free lists
+    std::size_t heapAfterWarmup = 0;
+    for (int step = 0; step < 5; step++)
+    {
+      Tensor y = layer.forward(input);
+      Tensor grad = layer.dL_dY(y, target);
+      layer.dB(grad);
+      layer.dW(grad, input);
+      Tensor dX = layer.backward(grad);
+      layer.updateParameters(0.01f);
+
+      if (step == 0)
+        heapAfterWarmup = pool.stats().heapAllocations;
+    }
+    assert(pool.stats().heapAllocations == heapAfterWarmup);
+    assert(pool.stats().requests > heapAfterWarmup);
+  }
+
+  // a workspace covers its own thread and the pool jobs it starts, no other thread
+  {
+    Workspace workspace(pool);
+    std::size_t requestsBefore = pool.stats().requests;
+    std::thread other([&]
+                      {
+                        assert(&defaultAllocator() != &pool);
+                        Tensor t({8, 8});
+                      });
+    other.join();
+    assert(pool.stats().requests == requestsBefore);
+
+    ThreadPool &threads = ThreadPool::instance();
+    int oldThreads = threads.numThreads();
+    threads.setNumThreads(3);
+    std::vector<char> fromPool(3, 0);
+    threads.run(3, [&](int chunk)
+                { fromPool[chunk] = &defaultAllocator() == &pool; });
+    threads.setNumThreads(oldThreads);
+    for (char used : fromPool)
+      assert(used);
+  }
+  assert(&defaultAllocator() != &pool);
+
+  // outside a workspace nothing is cached, a freed block goes straight back to the system
+  {
+    std::size_t freesBefore = defaultAllocator().stats().heapFrees;
+    {
+      Tensor t({64, 64});
+    }
+    assert(defaultAllocator().stats().heapFrees == freesBefore + 1);
+    assert(defaultAllocator().stats().bytesCached == 0);
+  }
+
+  // everything went back to the pool when the tensors died
+  assert(pool.stats().bytesInUse == 0);
+  pool.release();
+  assert(pool.stats().bytesCached == 0);
+  assert(pool.stats().heapFrees == pool.stats().heapAllocations);
+}
+
+void test_tensorView()
+{
+  Tensor data({6, 4});
+  for (int i = 0; i < data.size(); i++)
+    data[i] = (float)i;
+
+  // rows 2..4 without copying
+  TensorView batch = data.view().rowSlice(2, 5);
+  assert(batch.rows() == 3 && batch.cols() == 4);
+  assert(batch.data() == data.data() + 8);
+  assert(batch(0, 0) == 8 && batch(2, 3) == 19);
+
+  // transposed view reads the same buffer
+  TensorView t = batch.transpose();
+  assert(t.rows() == 4 && t.cols() == 3);
+  assert(t(3, 2) == batch(2, 3));
+
+  // reshape of a contiguous view, materialised copy of a strided one
+  TensorView flat = batch.reshape(2, 6);
+  assert(flat(1, 0) == 14);
+  Tensor copy(t);
+  assert(copy.getShape()[0] == 4 && copy(1, 2) == batch(2, 1));
+
+  // kernels take views directly
+  DenseLayer layer(4, 3);
+  Tensor fromView = layer.forward(batch);
+  Tensor fromCopy = layer.forward(Tensor(batch));
+  for (int i = 0; i < fromView.size(); i++)
+    assert(std::fabs(fromView[i] - fromCopy[i]) < 1e-5f);
+
+  Tensor product = matMul(t, batch);
+  Tensor reference = Tensor(t).matMul(Tensor(batch));
+  for (int i = 0; i < product.size(); i++)
+    assert(std::fabs(product[i] - reference[i]) < 1e-3f);
+
+  Tensor colSums = sumRows(t);
+  assert(colSums.getShape()[1] == 3);
+  assert(colSums(0, 0) == 8 + 9 + 10 + 11);
+
+  // layers are returned by reference, not copied
+  Network net;
+  net.addLayer(DenseLayer(2, 2));
+  net.getLayers()[0].getWeights()(0, 0) = 42.0f;
+  assert(net.getLayers()[0].getWeights()(0, 0) == 42.0f);
+}
+
+void test_tensorExpr()
+{
+  Tensor a({3, 4});
+  Tensor b({3, 4});
+  for (int i = 0; i < a.size(); i++)
+  {
+    a[i] = (float)i;
+    b[i] = (float)(i % 3);
+  }
+
+  // same results as the eager methods
+  Tensor eager = a - b;
+  eager.mul_inplace(0.5f);
+  Tensor fused = eval((lazy(a) - lazy(b)) * 0.5f);
+  assert(fused.getShape()[0] == 3 && fused.getShape()[1] == 4);
+  for (int i = 0; i < fused.size(); i++)
+    assert(fused[i] == eager[i]);
+
+  Tensor diff = a - b;
+  diff.apply([](float x)
+             { return x * x; });
+  assert(std::fabs(mean(square(lazy(a) - lazy(b))) - diff.mean()) < 1e-4f);
+  float shifted = sum(map(lazy(a), [](float x)
+                         { return x + 1.0f; }));
+  assert(shifted == a.sum() + a.size());
+
+  // assign writes into an existing buffer
+  Tensor out({3, 4});
+  assign(out, lazy(a) / 2.0f);
+  assert(out(2, 3) == 5.5f);
+
+  // DenseLayer loss helpers use the fused path
+  DenseLayer layer(1, 1);
+  Tensor pred({3.0f, 1.0f}, {2, 1});
+  Tensor target({1.0f, 1.0f}, {2, 1});
+  assert(std::fabs(layer.rmse(pred, target) - std::sqrt(2.0f)) < 1e-6f);
+  Tensor grad = layer.dL_dY(pred, target);
+  assert(grad(0, 0) == 2.0f && grad(1, 0) == 0.0f);
+
+  // reductions give the same bits on any number of threads, also across rounds of blocks
+  Tensor big({700, 401});
+  for (int i = 0; i < big.size(); i++)
+    big[i] = (float)((i * 7919) % 1009) / 1009.0f - 0.3f;
+  ThreadPool &pool = ThreadPool::instance();
+  int oldThreads = pool.numThreads();
+  std::size_t oldThreshold = pool.serialThreshold();
+  pool.setNumThreads(1);
+  float serialSum = sum(square(lazy(big)));
+  pool.setNumThreads(3);
+  pool.setSerialThreshold(64);
+  for (int r = 0; r < 5; r++)
+    assert(sum(square(lazy(big))) == serialSum);
+  pool.setSerialThreshold(oldThreshold);
+  pool.setNumThreads(oldThreads);
+
+  bool threw = false;
+  try
+  {
+    eval(lazy(a) - lazy(pred));
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void test_fit()
+{
+  // y = 2a - b + 0.5
+  int n = 200;
+  Tensor X({n, 2});
+  Tensor Y({n, 1});
+  for (int i = 0; i < n; i++)
+  {
+    X(i, 0) = (float)(i % 10) / 10.0f;
+    X(i, 1) = (float)(i % 7) / 7.0f;
+    Y(i, 0) = 2.0f * X(i, 0) - X(i, 1) + 0.5f;
+  }
+
+  Network net;
+  net.addLayer(DenseLayer(2, 4));
+  net.addLayer(DenseLayer(4, 1));
+
+  FitOptions options;
+  options.epochs = 60;
+  options.batchSize = 16;
+  options.learningRate = 0.05f;
+  options.seed = 7;
+  std::vector<EpochStats> history = net.fit(X, Y, options);
+
+  assert((int)history.size() == options.epochs);
+  assert(history.back().loss < history.front().loss);
+  assert(history.back().loss < 0.1f);
+  assert(history.back().samplesPerSec > 0.0);
+  std::cout << "fit: loss " << history.front().loss << " -> " << history.back().loss
+            << ", " << history.back().samplesPerSec << " samples/s\n";
+
+  // sequential batches are views onto X, no gathering
+  options.shuffle = false;
+  options.epochs = 5;
+  std::vector<EpochStats> more = net.fit(X, Y, options);
+  assert(more.back().loss < history.front().loss);
+}
+
+void test_mappedDataset()
+{
+  const char *path = "myNN_test_dataset.bin";
+  int n = 103;
+  Tensor X({n, 3});
+  Tensor Y({n, 1});
+  for (int i = 0; i < n; i++)
+  {
+    X(i, 0) = (float)i / 128.0f; // row id, exact in float
+    X(i, 1) = (float)(i % 5) / 5.0f;
+    X(i, 2) = (float)(i % 3) / 3.0f;
+    Y(i, 0) = 0.5f * X(i, 1) - X(i, 2) + 0.25f;
+  }
+
+  // write in two pieces to exercise the streaming writer
+  {
+    DatasetWriter writer(path, 3, 1);
+    writer.append(X.view().rowSlice(0, 50), Y.view().rowSlice(0, 50));
+    writer.append(X.view().rowSlice(50, n), Y.view().rowSlice(50, n));
+  }
+
+  {
+    MappedDataset data(path);
+    assert(data.rows() == n && data.features() == 3 && data.targets() == 1);
+    assert(data.inputs(10, 20)(3, 0) == 13.0f / 128.0f);
+    assert(data.outputs(0, n)(7, 0) == Y(7, 0));
+
+    // every row arrives exactly once per epoch, also with shuffled batches
+    BatchLoader loader(data, 16, true, 3);
+    assert(loader.numBatches() == 7);
+    for (int epoch = 0; epoch < 2; epoch++)
+    {
+      std::vector<int> seen(n, 0);
+      Tensor x, y;
+      while (loader.next(x, y))
+      {
+        assert(x.getShape()[0] == y.getShape()[0]);
+        for (int r = 0; r < x.getShape()[0]; r++)
+        {
+          int row = (int)(x(r, 0) * 128.0f);
+          seen[row]++;
+          assert(y(r, 0) == Y(row, 0));
+        }
+      }
+      for (int c : seen)
+        assert(c == 1);
+      loader.reset();
+    }
+
+    // train straight from the mapped file
+    Network net;
+    net.addLayer(DenseLayer(3, 1));
+    BatchLoader trainLoader(data, 8, true, 1);
+    FitOptions options;
+    options.epochs = 100;
+    options.learningRate = 0.1f;
+    std::vector<EpochStats> history = net.fit(trainLoader, options);
+    assert(history.back().loss < history.front().loss);
+    assert(history.back().loss < 0.05f);
+
+    // a second fit on the used up loader still sees the whole dataset
+    options.epochs = 1;
+    std::vector<EpochStats> again = net.fit(trainLoader, options);
+    assert(again.size() == 1 && again[0].loss > 0.0f && again[0].samplesPerSec > 0.0);
+  }
+
+  // a row count whose byte size wraps to zero, and a file cut short, are both rejected
+  auto rejected = [&]
+  {
+    try
+    {
+      MappedDataset data(path);
+    }
+    catch (const std::runtime_error &)
+    {
+      return true;
+    }
+    return false;
+  };
+  {
+    std::FILE *f = std::fopen(path, "r+b");
+    std::uint64_t hostile = std::uint64_t(1) << 60;
+    std::fseek(f, offsetof(DatasetHeader, rows), SEEK_SET);
+    std::fwrite(&hostile, sizeof(hostile), 1, f);
+    std::fclose(f);
+    assert(rejected());
+  }
+  writeDataset(path, X.view(), Y.view());
+  std::filesystem::resize_file(path, sizeof(DatasetHeader) + (n - 1) * 4 * sizeof(float));
+  assert(rejected());
+
+  std::remove(path);
+}
+
+void test_checkpoint()
+{
+  const char *path = "myNN_test_checkpoint.bin";
+
+  Network net;
+  net.addLayer(DenseLayer(5, 7));
+  net.addLayer(DenseLayer(7, 3));
+  Tensor input({4, 5});
+  for (int i = 0; i < input.size(); i++)
+    input[i] = (float)(i % 9) * 0.1f;
+  Tensor expected = net.forwardPass(input);
+  net.backProp(expected, input);
+
+  saveCheckpoint(net, path, true);
+
+  {
+    MappedCheckpoint mapped(path);
+    assert(mapped.numLayers() == 2);
+    assert(mapped.hasState());
+    assert(mapped.weights(1).rows() == 7 && mapped.weights(1).cols() == 3);
+    assert(reinterpret_cast<std::uintptr_t>(mapped.weights(0).data()) % 64 == 0);
+    assert(reinterpret_cast<std::uintptr_t>(mapped.bias(1).data()) % 64 == 0);
+    assert(mapped.tensor(0, CheckpointTensor::WeightGrad)(2, 3) == net.getLayers()[0].getdW_()(2, 3));
+
+    // inference reads the weights in place
+    Tensor out = mapped.forward(input);
+    for (int i = 0; i < out.size(); i++)
+      assert(std::fabs(out[i] - expected[i]) < 1e-5f);
+
+    InferenceSession session(mapped, 4);
+    TensorView fromSession = session.run(input);
+    assert(std::fabs(fromSession(3, 2) - expected(3, 2)) < 1e-5f);
+  }
+
+  Network loaded = loadCheckpoint(path);
+  Tensor again = loaded.forwardPass(input);
+  for (int i = 0; i < again.size(); i++)
+    assert(again[i] == expected[i]);
+  assert(loaded.getLayers()[1].getdB_()(0, 2) == net.getLayers()[1].getdB_()(0, 2));
+
+  // weights only
+  saveCheckpoint(net, path);
+  {
+    MappedCheckpoint mapped(path);
+    assert(!mapped.hasState());
+    bool threw = false;
+    try
+    {
+      mapped.tensor(0, CheckpointTensor::WeightGrad);
+    }
+    catch (const std::runtime_error &)
+    {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  // table entries are 64 bytes: weights then bias per layer when saved without state
+  auto patchEntry = [&](int entry, std::size_t field, std::uint32_t value)
+  {
+    std::FILE *f = std::fopen(path, "r+b");
+    std::fseek(f, sizeof(CheckpointHeader) + entry * sizeof(CheckpointEntry) + field, SEEK_SET);
+    std::fwrite(&value, sizeof(value), 1, f);
+    std::fclose(f);
+  };
+
+  // a bias that does not match its layer's outputs still maps, but no session is built on it
+  patchEntry(1, offsetof(CheckpointEntry, cols), 8);
+  {
+    MappedCheckpoint mapped(path);
+    bool threw = false;
+    try
+    {
+      InferenceSession session(mapped, 4);
+    }
+    catch (const std::runtime_error &)
+    {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  // a row count that does not fit an int is rejected even when the tensor is empty
+  patchEntry(1, offsetof(CheckpointEntry, rows), 0x80000000u);
+  patchEntry(1, offsetof(CheckpointEntry, cols), 0);
+  {
+    bool threw = false;
+    try
+    {
+      MappedCheckpoint mapped(path);
+    }
+    catch (const std::runtime_error &)
+    {
+      threw = true;
+    }
+    assert(threw);
+  }
+  saveCheckpoint(net, path);
+
+  // an offset close to 2^64 must not wrap around the size check
+  {
+    std::FILE *f = std::fopen(path, "r+b");
+    std::uint64_t hostile = ~std::uint64_t(63);
+    std::fseek(f, sizeof(CheckpointHeader) + offsetof(CheckpointEntry, offset), SEEK_SET);
+    std::fwrite(&hostile, sizeof(hostile), 1, f);
+    std::fclose(f);
+    bool threw = false;
+    try
+    {
+      MappedCheckpoint mapped(path);
+    }
+    catch (const std::runtime_error &)
+    {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  std::remove(path);
+}
+
+void test_inferenceSession()
+{
+  Network net;
+  net.addLayer(DenseLayer(6, 16));
+  net.addLayer(DenseLayer(16, 9));
+  net.addLayer(DenseLayer(9, 2));
+
+  Tensor input({5, 6});
+  for (int i = 0; i < input.size(); i++)
+    input[i] = (float)(i % 4) * 0.25f - 0.3f;
+  Tensor expected = net.forwardPass(input);
+
+  PoolAllocator pool;
+  Workspace workspace(pool);
+
+  InferenceSession session(net, 8);
+  assert(session.inputSize() == 6 && session.outputSize() == 2);
+
+  // parameters plus two 8 x 16 buffers, no gradients
+  std::size_t params = (6 * 16 + 16) + (16 * 9 + 9) + (9 * 2 + 2);
+  assert(session.memoryBytes() == (params + 2 * 8 * 16) * sizeof(float));
+
+  std::size_t requestsBefore = pool.stats().requests;
+  for (int r = 0; r < 3; r++)
+  {
+    TensorView out = session.run(input);
+    assert(out.rows() == 5 && out.cols() == 2);
+    for (int i = 0; i < 5; i++)
+      for (int j = 0; j < 2; j++)
+        assert(std::fabs(out(i, j) - expected(i, j)) < 1e-5f);
+
+    // smaller batches reuse the same buffers
+    TensorView one = session.run(input.view().rowSlice(2, 3));
+    assert(std::fabs(one(0, 1) - expected(2, 1)) < 1e-5f);
+  }
+  assert(pool.stats().requests == requestsBefore);
+}
+
+void test_quantized()
+{
+  // int8 kernel against a plain loop, including the most negative values
+  int M = 3, N = 5, K = 70;
+  int Kp = roundUpK(K);
+  std::vector<std::int8_t> A(M * Kp, 0), B(N * Kp, 0);
+  std::vector<std::int32_t> rowSums(N, 0), C(M * N);
+  for (int i = 0; i < M; i++)
+    for (int k = 0; k < K; k++)
+      A[i * Kp + k] = (std::int8_t)((i * 31 + k * 17) % 255 - 127);
+  for (int j = 0; j < N; j++)
+    for (int k = 0; k < K; k++)
+    {
+      B[j * Kp + k] = (std::int8_t)((j * 13 + k * 29) % 255 - 127);
+      rowSums[j] += B[j * Kp + k];
+    }
+  qgemm(M, N, Kp, A.data(), B.data(), rowSums.data(), C.data());
+  for (int i = 0; i < M; i++)
+    for (int j = 0; j < N; j++)
+    {
+      std::int32_t s = 0;
+      for (int k = 0; k < K; k++)
+        s += A[i * Kp + k] * B[j * Kp + k];
+      assert(C[i * N + j] == s);
+    }
+
+  // every kernel this CPU can run gives the same exact result, not only the picked one
+  std::vector<std::string> kernels = qgemmKernelNames();
+  assert(kernels.front() == qgemmKernelName() && kernels.back() == "portable");
+  for (const std::string &kernel : kernels)
+  {
+    std::vector<std::int32_t> other(M * N, -1);
+    qgemmWith(kernel.c_str(), M, N, Kp, A.data(), B.data(), rowSums.data(), other.data());
+    assert(other == C);
+  }
+  bool threw = false;
+  try
+  {
+    qgemmWith("no-such-kernel", M, N, Kp, A.data(), B.data(), rowSums.data(), C.data());
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  assert(threw);
+
+  Network net;
+  net.addLayer(DenseLayer(40, 64));
+  net.addLayer(DenseLayer(64, 10));
+  Tensor heldOut({32, 40});
+  for (int i = 0; i < heldOut.size(); i++)
+    heldOut[i] = (float)((i * 7) % 19) / 19.0f - 0.5f;
+
+  QuantizedNetwork quantized(net);
+  QuantizationError dynamicError = quantized.compare(net, heldOut);
+  std::cout << "int8 [" << qgemmKernelName() << " of " << kernels.size() << " checked] relative rms error: "
+            << dynamicError.relativeRms << ", max abs: " << dynamicError.maxAbs << "\n";
+  assert(dynamicError.relativeRms < 0.02f);
+
+  quantized.calibrate(net, heldOut);
+  assert(quantized.layer(0).inputScale > 0.0f);
+  QuantizationError calibratedError = quantized.compare(net, heldOut);
+  assert(calibratedError.relativeRms < 0.02f);
+
+  // a quarter of the fp32 weight bytes plus small per-channel vectors
+  std::size_t fp32Bytes = (40 * 64 + 64 * 10) * sizeof(float);
+  assert(quantized.weightBytes() < fp32Bytes / 2);
+}
+
+void test_halfPrecision()
+{
+  // exact and rounded conversions
+  assert(halfToFloat(floatToHalf(1.0f)) == 1.0f);
+  assert(halfToFloat(floatToHalf(-2.5f)) == -2.5f);
+  assert(halfToFloat(floatToHalf(65504.0f)) == 65504.0f);
+  assert(std::isinf(halfToFloat(floatToHalf(70000.0f))));
+  assert(halfToFloat(floatToHalf(std::ldexp(1.0f, -24))) == std::ldexp(1.0f, -24)); // smallest subnormal
+  assert(std::isnan(halfToFloat(floatToHalf(NAN))));
+  assert(bf16ToFloat(floatToBf16(1.0f + std::ldexp(1.0f, -8))) == 1.0f); // tie goes to even
+  assert(bf16ToFloat(floatToBf16(3.0e38f)) > 2.9e38f);
+  assert(std::isnan(bf16ToFloat(floatToBf16(NAN))));
+
+  // vectorised conversions agree with the scalar ones, including the tails
+  std::vector<float> values(37);
+  for (int i = 0; i < (int)values.size(); i++)
+    values[i] = (float)((i * 37) % 101 - 50) * 0.173f;
+  std::vector<std::uint16_t> bf(values.size()), hf(values.size());
+  fromFloat(values.data(), bf.data(), (int)values.size(), DType::BFloat16);
+  fromFloat(values.data(), hf.data(), (int)values.size(), DType::Float16);
+  std::vector<float> back(values.size());
+  toFloat(hf.data(), back.data(), (int)values.size(), DType::Float16);
+  for (int i = 0; i < (int)values.size(); i++)
+  {
+    assert(bf[i] == floatToBf16(values[i]));
+    assert(hf[i] == floatToHalf(values[i]));
+    assert(back[i] == halfToFloat(hf[i]));
+  }
+
+  // reduced precision operands, fp32 accumulation
+  Tensor A({37, 300});
+  Tensor W({300, 45});
+  Tensor bias({1, 45});
+  for (int i = 0; i < A.size(); i++)
+    A[i] = (float)((i * 7) % 23) / 23.0f - 0.5f;
+  for (int i = 0; i < W.size(); i++)
+    W[i] = (float)((i * 11) % 17) / 17.0f - 0.5f;
+  for (int i = 0; i < bias.size(); i++)
+    bias[i] = 0.1f * i;
+  Tensor expected = matMulBias(A, W, bias, Activation::ReLU);
+
+  for (DType dtype : {DType::BFloat16, DType::Float16})
+  {
+    HalfTensor w(W, dtype);
+    assert(w.bytes() * 2 == W.size() * sizeof(float));
+    float tol = dtype == DType::BFloat16 ? 0.15f : 0.02f;
+
+    Tensor got = matMulBias(A, w, bias, Activation::ReLU);
+    Tensor gotHalf = matMulBias(HalfTensor(A, dtype), w, bias, Activation::ReLU);
+    for (int i = 0; i < expected.size(); i++)
+    {
+      assert(std::fabs(got[i] - expected[i]) < tol);
+      assert(std::fabs(gotHalf[i] - expected[i]) < 2 * tol);
+    }
+
+    // w^T read in place
+    Tensor dY({37, 45});
+    for (int i = 0; i < dY.size(); i++)
+      dY[i] = (float)((i * 5) % 13) / 13.0f - 0.5f;
+    Tensor dX = matMulTranspose(dY, w);
+    Tensor dXRef = dY.matMulTranspose(w.toFloat());
+    for (int i = 0; i < dX.size(); i++)
+      assert(std::fabs(dX[i] - dXRef[i]) < 1e-3f);
+  }
+
+  // mixed precision training keeps fp32 master weights
+  int n = 200;
+  Tensor X({n, 2});
+  Tensor Y({n, 1});
+  for (int i = 0; i < n; i++)
+  {
+    X(i, 0) = (float)(i % 10) / 10.0f;
+    X(i, 1) = (float)(i % 7) / 7.0f;
+    Y(i, 0) = 2.0f * X(i, 0) - X(i, 1) + 0.5f;
+  }
+
+  Network net;
+  net.addLayer(DenseLayer(2, 4));
+  net.addLayer(DenseLayer(4, 1));
+  for (DenseLayer &layer : net.getLayers())
+    layer.setPrecision(DType::BFloat16);
+
+  FitOptions options;
+  options.epochs = 60;
+  options.batchSize = 16;
+  options.learningRate = 0.05f;
+  options.seed = 7;
+  std::vector<EpochStats> history = net.fit(X, Y, options);
+  assert(history.back().loss < 0.1f);
+
+  const DenseLayer &first = net.getLayers()[0];
+  Tensor rounded = first.getLowWeights().toFloat();
+  for (int i = 0; i < rounded.size(); i++)
+    assert(rounded[i] == bf16ToFloat(floatToBf16(first.getWeights()[i])));
+  std::cout << "bf16 fit: loss " << history.front().loss << " -> " << history.back().loss << "\n";
+
+  net.getLayers()[0].setPrecision(DType::Float32);
+  assert(net.getLayers()[0].getLowWeights().size() == 0);
+}
+
+void test_staticNetwork()
+{
+  Network net;
+  net.addLayer(DenseLayer(16, 32));
+  net.addLayer(DenseLayer(32, 4));
+
+  StaticNetwork<StaticDense<16, 32>, StaticDense<32, 4>> fixed(net);
+  static_assert(decltype(fixed)::inputs == 16 && decltype(fixed)::outputs == 4);
+
+  Tensor X({8, 16});
+  for (int i = 0; i < X.size(); i++)
+    X[i] = (float)((i * 7) % 19) / 19.0f - 0.5f;
+  Tensor expected = net.forwardPass(X);
+
+  std::array<float, 8 * 4> Y;
+  fixed.forwardBatch(X.data(), Y.data(), 8);
+  for (int i = 0; i < expected.size(); i++)
+    assert(std::fabs(Y[i] - expected[i]) < 1e-4f);
+
+  std::array<float, 16> x;
+  for (int k = 0; k < 16; k++)
+    x[k] = X(3, k);
+  std::array<float, 4> y = fixed.forward(x);
+  for (int j = 0; j < 4; j++)
+    assert(std::fabs(y[j] - expected(3, j)) < 1e-4f);
+
+  // fused ReLU matches the dynamic fused forward
+  StaticDense<16, 32, Activation::ReLU> relu(net.getLayers()[0]);
+  Tensor hidden = net.getLayers()[0].forward(X, Activation::ReLU);
+  std::array<float, 32> h;
+  relu.forward(X.data() + 3 * 16, h.data());
+  for (int j = 0; j < 32; j++)
+    assert(std::fabs(h[j] - hidden(3, j)) < 1e-4f);
+
+  // shapes are checked when copying from a dynamic network
+  bool threw = false;
+  try
+  {
+    StaticNetwork<StaticDense<16, 32>, StaticDense<32, 5>> wrong(net);
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  assert(threw);
+
+  threw = false;
+  try
+  {
+    StaticNetwork<StaticDense<16, 32>> shallow(net);
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  assert(threw);
+
+  int reps = 100000;
+  float checksum = 0.0f;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < reps; r++)
+  {
+    // feed the output back so the calls cannot be hoisted out of the loop
+    std::array<float, 4> out = fixed.forward(x);
+    x[r % 16] = out[r % 4] > 0.0f ? 0.25f : -0.25f;
+    checksum += out[0];
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  assert(std::isfinite(checksum));
+  std::cout << "static 16-32-4 forward: " << seconds / reps * 1e9 << " ns/sample\n";
+}
+
+void test_profiler()
+{
+  Profiler &profiler = Profiler::instance();
+  profiler.clear();
+
+  // disabled scopes record nothing
+  {
+    ProfileScope scope("idle", "test");
+  }
+  assert(profiler.events().empty());
+
+  profiler.setEnabled(true);
+  {
+    ProfileLayer layer(3);
+    ProfileScope scope("manual", "test", 2e6, 1e6);
+    Tensor t({64, 64}, 1.0f);
+  }
+
+  Network net;
+  net.addLayer(DenseLayer(16, 32));
+  net.addLayer(DenseLayer(32, 4));
+  Tensor x({8, 16}, 0.5f);
+  Tensor y({8, 4}, 0.25f);
+  Tensor pred = net.forwardPass(x);
+  net.backProp(net.getLayers().back().dL_dY(pred, y), x);
+  net.updateParameters(0.01f);
+
+  // scopes belong to the innermost layer marked on their thread, and the summary adds
+  // them up per layer; the same as the scopes inside Network do when compiled in
+  {
+    ProfileLayer outer(1);
+    {
+      ProfileScope scope("attributed", "test", 100.0, 8.0);
+    }
+    {
+      ProfileLayer inner(2);
+      ProfileScope scope("attributed", "test", 50.0);
+    }
+    ProfileScope scope("attributed", "test", 100.0, 8.0);
+  }
+  {
+    ProfileScope scope("attributed", "test", 1.0);
+  }
+  profiler.setEnabled(false);
+
+  int attributed = 0;
+  for (const ProfileStats &s : profiler.summary())
+  {
+    if (s.name != "attributed")
+      continue;
+    attributed++;
+    if (s.layer == 1)
+      assert(s.calls == 2 && s.flops == 200.0 && s.bytes == 16.0);
+    else if (s.layer == 2)
+      assert(s.calls == 1 && s.flops == 50.0);
+    else
+      assert(s.layer == -1 && s.calls == 1 && s.flops == 1.0);
+  }
+  assert(attributed == 3);
+
+  std::vector<ProfileEvent> events = profiler.events();
+  assert(!events.empty());
+  assert(std::string(events[0].name) == "manual");
+  assert(events[0].layer == 3 && events[0].allocations == 1 && events[0].durationUs >= 0.0);
+
+#ifdef MYNN_ENABLE_PROFILING
+  // kernel scopes inside the layers are attributed to them
+  bool layerMatMul = false;
+  for (const ProfileStats &s : profiler.summary())
+    layerMatMul = layerMatMul || (s.name == "dense.forward" && s.layer == 1 && s.calls == 1 && s.flops == 2.0 * 8 * 32 * 4);
+  assert(layerMatMul);
+  profiler.printReport(std::cout);
+#endif
+
+  std::string path = (std::filesystem::temp_directory_path() / "myNN_test_trace.json").string();
+  profiler.writeChromeTrace(path);
+  std::FILE *f = std::fopen(path.c_str(), "r");
+  assert(f);
+  char head[16] = {};
+  assert(std::fread(head, 1, 15, f) == 15);
+  std::fclose(f);
+  std::remove(path.c_str());
+  assert(std::string(head) == "{\"traceEvents\":");
+
+  profiler.clear();
+}
+
+void test_layerGraph()
+{
+  Network net;
+  net.addLayer(DenseLayer(8, 16));
+  net.addLayer(ReLuLayer());
+  net.addLayer(DenseLayer(16, 16));
+  net.addLayer(ReLuLayer());
+  net.addLayer(DenseLayer(16, 4));
+  assert(net.numNodes() == 5 && net.getLayers().size() == 3);
+  assert(std::string(net.node(1).name()) == "relu");
+  assert(net.activationAfter(0) == Activation::ReLU && net.activationAfter(2) == Activation::None);
+  assert(net.activationsFoldIntoDense());
+
+  int rows = 10;
+  Tensor x({rows, 8});
+  for (int i = 0; i < x.size(); i++)
+    x[i] = (float)((i * 7) % 19) / 19.0f - 0.5f;
+
+  // reference: every layer on its own, activations applied by hand
+  ReLuLayer relu;
+  std::vector<DenseLayer> &dense = net.getLayers();
+  Tensor h1 = relu.forward(dense[0].forward(x));
+  Tensor h2 = relu.forward(dense[1].forward(h1));
+  Tensor expected = dense[2].forward(h2);
+
+  Tensor trained = net.forwardPass(x);
+  Tensor predicted = net.predict(x);
+  for (int i = 0; i < expected.size(); i++)
+  {
+    assert(std::fabs(trained[i] - expected[i]) < 1e-5f);
+    assert(std::fabs(predicted[i] - expected[i]) < 1e-5f);
+  }
+
+  // both activations fused; inference ping-pongs between two buffers
+  PlanStats inference = net.planStats(8, rows, false);
+  assert(inference.steps == 3 && inference.fused == 2 && inference.buffers == 2);
+  assert(inference.activationBytes == 2u * rows * 16 * sizeof(float));
+  assert(inference.unsharedBytes == 4u * rows * 16 * sizeof(float));
+  PlanStats training = net.planStats(8, rows, true);
+  assert(training.buffers == 2 && training.activationBytes <= training.unsharedBytes / 2);
+
+  // gradients through the fused graph against central differences of the MSE
+  Tensor y({rows, 4}, 0.3f);
+  auto mse = [&]()
+  { return mean(square(lazy(net.forwardPass(x)) - lazy(y))); };
+  Tensor pred = net.forwardPass(x);
+  net.backProp(net.getLayers().back().dL_dY(pred, y), x);
+  for (int l = 0; l < 2; l++)
+  {
+    Tensor &w = net.getLayers()[l].getWeights();
+    float analytic = net.getLayers()[l].getdW_()(3, 5);
+    float eps = 1e-2f;
+    float saved = w(3, 5);
+    w(3, 5) = saved + eps;
+    float up = mse();
+    w(3, 5) = saved - eps;
+    float down = mse();
+    w(3, 5) = saved;
+    float numeric = (up - down) / (2 * eps);
+    assert(std::fabs(numeric - analytic) < 1e-3f + 0.02f * std::fabs(analytic));
+  }
+
+  // an activation that cannot be fused runs as a step of its own
+  Network leading;
+  leading.addLayer(ReLuLayer());
+  leading.addLayer(DenseLayer(8, 2));
+  assert(!leading.activationsFoldIntoDense());
+  assert(leading.planStats(8, rows, false).steps == 2);
+  Tensor out = leading.predict(x);
+  Tensor ref = leading.getLayers()[0].forward(relu.forward(x));
+  for (int i = 0; i < ref.size(); i++)
+    assert(std::fabs(out[i] - ref[i]) < 1e-5f);
+  bool threw = false;
+  try
+  {
+    InferenceSession session(leading, 4);
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  assert(threw);
+
+  // the activations travel with the Dense layers to the other runtimes
+  InferenceSession session(net, rows);
+  TensorView served = session.run(x);
+  for (int i = 0; i < expected.size(); i++)
+    assert(std::fabs(served.data()[i] - predicted[i]) < 1e-5f);
+
+  const char *path = "myNN_test_graph.bin";
+  saveCheckpoint(net, path);
+  Network loaded = loadCheckpoint(path);
+  assert(loaded.numNodes() == 5 && loaded.activationAfter(1) == Activation::ReLU);
+  Tensor reloaded = loaded.predict(x);
+  {
+    MappedCheckpoint mapped(path);
+    Tensor mappedOut = mapped.forward(x);
+    for (int i = 0; i < expected.size(); i++)
+    {
+      assert(reloaded[i] == predicted[i]);
+      assert(std::fabs(mappedOut[i] - predicted[i]) < 1e-5f);
+    }
+  }
+  std::remove(path);
+
+  QuantizedNetwork quantized(net);
+  assert(quantized.layer(0).activation == Activation::ReLU);
+  assert(quantized.compare(net, x).relativeRms < 0.03f);
+
+  // training a network with activations through fit
+  int n = 256;
+  Tensor X({n, 2});
+  Tensor Y({n, 1});
+  for (int i = 0; i < n; i++)
+  {
+    X(i, 0) = (float)(i % 16) / 8.0f - 1.0f;
+    X(i, 1) = (float)(i % 11) / 5.5f - 1.0f;
+    Y(i, 0) = std::fabs(X(i, 0)) + 0.5f * std::fabs(X(i, 1));
+  }
+  Network mlp;
+  mlp.addLayer(DenseLayer(2, 16));
+  mlp.addLayer(ReLuLayer());
+  mlp.addLayer(DenseLayer(16, 1));
+  FitOptions options;
+  options.epochs = 150;
+  options.batchSize = 16;
+  options.learningRate = 0.05f;
+  std::vector<EpochStats> history = mlp.fit(X, Y, options);
+  std::cout << "relu mlp fit: loss " << history.front().loss << " -> " << history.back().loss << "\n";
+  assert(history.back().loss < history.front().loss * 0.5f);
+}
+
+void test_optimizers()
+{
+  // scalar reference of every rule, with L2 on the weights and none on the bias
+  auto reference = [](const OptimizerConfig &c, float lr, float decay, float &p, float g, float &m, float &v, int t)
+  {
+    if (c.kind != OptimizerKind::AdamW)
+      g += decay * p;
+    if (c.kind == OptimizerKind::SGD)
+    {
+      p -= lr * g;
+      return;
+    }
+    if (c.kind == OptimizerKind::Momentum)
+    {
+      m = c.momentum * m + g;
+      p -= lr * m;
+      return;
+    }
+    m = c.beta1 * m + (1.0f - c.beta1) * g;
+    v = c.beta2 * v + (1.0f - c.beta2) * g * g;
+    double mHat = m / (1.0 - std::pow((double)c.beta1, t));
+    double vHat = v / (1.0 - std::pow((double)c.beta2, t));
+    double update = mHat / (std::sqrt(vHat) + c.epsilon);
+    if (c.kind == OptimizerKind::AdamW)
+      update += decay * p;
+    p -= (float)(lr * update);
+  };
+
+  for (OptimizerKind kind : {OptimizerKind::SGD, OptimizerKind::Momentum, OptimizerKind::Adam, OptimizerKind::AdamW})
+  {
+    OptimizerConfig config;
+    config.kind = kind;
+    config.weightDecay = 0.01f;
+
+    DenseLayer layer(9, 5);
+    std::vector<float> w(layer.getWeights().getData().begin(), layer.getWeights().getData().end());
+    std::vector<float> b(layer.getBias().getData().begin(), layer.getBias().getData().end());
+    std::vector<float> mW(w.size(), 0.0f), vW(w.size(), 0.0f), mB(b.size(), 0.0f), vB(b.size(), 0.0f);
+
+    for (int t = 1; t <= 4; t++)
+    {
+      for (int i = 0; i < layer.getdW_().size(); i++)
+        layer.getdW_()[i] = (float)((i * 5 + t) % 11) / 11.0f - 0.5f;
+      for (int i = 0; i < layer.getdB_().size(); i++)
+        layer.getdB_()[i] = (float)((i + t) % 3) - 1.0f;
+
+      for (size_t i = 0; i < w.size(); i++)
+        reference(config, 0.05f, config.weightDecay, w[i], layer.getdW_()[i], mW[i], vW[i], t);
+      for (size_t i = 0; i < b.size(); i++)
+        reference(config, 0.05f, 0.0f, b[i], layer.getdB_()[i], mB[i], vB[i], t);
+
+      layer.step(config, 0.05f);
+    }
+
+    for (size_t i = 0; i < w.size(); i++)
+      assert(std::fabs(layer.getWeights()[i] - w[i]) < 1e-5f);
+    for (size_t i = 0; i < b.size(); i++)
+      assert(std::fabs(layer.getBias()[i] - b[i]) < 1e-5f);
+    assert(layer.getWeightState().steps == 4 && layer.getWeightState().kind == kind);
+    assert(layer.getWeightState().m.size() == (kind == OptimizerKind::SGD ? 0 : 45));
+    assert(layer.getWeightState().v.size() == (kind == OptimizerKind::Adam || kind == OptimizerKind::AdamW ? 45 : 0));
+  }
+
+  // SGD gives the same weights as w -= lr * dW
+  DenseLayer sgd(6, 4, true);
+  Tensor expected = sgd.getWeights() - sgd.getdW_().mul(0.1f);
+  sgd.updateParameters(0.1f);
+  for (int i = 0; i < expected.size(); i++)
+    assert(sgd.getWeights()[i] == expected[i]);
+
+  // no allocations once the moments exist, and several threads give the same result
+  ThreadPool &pool = ThreadPool::instance();
+  int oldThreads = pool.numThreads();
+  std::size_t oldThreshold = pool.serialThreshold();
+
+  OptimizerConfig adam;
+  adam.kind = OptimizerKind::AdamW;
+  adam.weightDecay = 0.1f;
+  DenseLayer serial(40, 30, true);
+  DenseLayer threaded = serial;
+  serial.step(adam, 0.01f);
+
+  pool.setNumThreads(4);
+  pool.setSerialThreshold(64);
+  threaded.step(adam, 0.01f);
+  std::size_t requestsBefore = defaultAllocator().stats().requests;
+  threaded.step(adam, 0.01f);
+  assert(defaultAllocator().stats().requests == requestsBefore);
+  pool.setSerialThreshold(oldThreshold);
+  pool.setNumThreads(oldThreads);
+
+  serial.step(adam, 0.01f);
+  for (int i = 0; i < serial.getWeights().size(); i++)
+    assert(serial.getWeights()[i] == threaded.getWeights()[i]);
+
+  // gradients cleared in the same pass
+  adam.clearGradients = true;
+  threaded.step(adam, 0.01f);
+  for (int i = 0; i < threaded.getdW_().size(); i++)
+    assert(threaded.getdW_()[i] == 0.0f);
+  assert(threaded.getWeightState().steps == 3);
+
+  // switching the rule starts from fresh moments
+  OptimizerConfig momentum;
+  momentum.kind = OptimizerKind::Momentum;
+  threaded.step(momentum, 0.01f);
+  assert(threaded.getWeightState().steps == 1 && threaded.getWeightState().v.size() == 0);
+
+  // fit with Adam on y = 2a - b + 0.5
+  int n = 200;
+  Tensor X({n, 2});
+  Tensor Y({n, 1});
+  for (int i = 0; i < n; i++)
+  {
+    X(i, 0) = (float)(i % 10) / 10.0f;
+    X(i, 1) = (float)(i % 7) / 7.0f;
+    Y(i, 0) = 2.0f * X(i, 0) - X(i, 1) + 0.5f;
+  }
+  Network net;
+  net.addLayer(DenseLayer(2, 8));
+  net.addLayer(ReLuLayer());
+  net.addLayer(DenseLayer(8, 1));
+  FitOptions options;
+  options.epochs = 40;
+  options.batchSize = 16;
+  options.learningRate = 0.01f;
+  options.optimizer.kind = OptimizerKind::Adam;
+  options.seed = 3;
+  std::vector<EpochStats> history = net.fit(X, Y, options);
+  assert(history.back().loss < history.front().loss);
+  assert(history.back().loss < 0.1f);
+  std::cout << "adam (" << optimizerKernelName() << "): loss " << history.front().loss << " -> "
+            << history.back().loss << "\n";
+
+  // the moments survive a checkpoint, so training resumes exactly
+  const char *path = "myNN_test_optimizer.bin";
+  saveCheckpoint(net, path, true);
+  Network resumed = loadCheckpoint(path);
+  std::remove(path);
+  assert(resumed.getLayers()[0].getWeightState().kind == OptimizerKind::Adam);
+  assert(resumed.getLayers()[0].getWeightState().steps == net.getLayers()[0].getWeightState().steps);
+  assert(resumed.getLayers()[1].getBiasState().v(0, 0) == net.getLayers()[1].getBiasState().v(0, 0));
+
+  options.epochs = 1;
+  options.shuffle = false;
+  net.fit(X, Y, options);
+  resumed.fit(X, Y, options);
+  for (int l = 0; l < 2; l++)
+    for (int i = 0; i < net.getLayers()[l].getWeights().size(); i++)
+      assert(resumed.getLayers()[l].getWeights()[i] == net.getLayers()[l].getWeights()[i]);
+}
+
+void test_gradAccumulation()
+{
+  // C = alpha * A * B + beta * C across edge tiles and K blocks
+  int m = 19, k = 301, n = 37;
+  Tensor A({m, k});
+  Tensor B({k, n});
+  for (int i = 0; i < A.size(); i++)
+    A[i] = (float)(i % 17) / 17.0f - 0.5f;
+  for (int i = 0; i < B.size(); i++)
+    B[i] = (float)(i % 11) / 11.0f - 0.5f;
+  Tensor R = referenceMatMul(A, B);
+
+  Tensor C({m, n});
+  for (int i = 0; i < C.size(); i++)
+    C[i] = (float)(i % 5) - 2.0f;
+  Tensor old = C;
+  matMulInto(A, B, C, 0.5f, 2.0f);
+  for (int i = 0; i < C.size(); i++)
+    assert(std::fabs(C[i] - (0.5f * R[i] + 2.0f * old[i])) < 1e-3f);
+
+  // beta = 0 never reads C
+  C.fill(NAN);
+  matMulInto(A, B, C);
+  for (int i = 0; i < C.size(); i++)
+    assert(std::fabs(C[i] - R[i]) < 1e-3f);
+
+  // empty K only scales
+  GemmEpilogue epilogue;
+  epilogue.beta = 3.0f;
+  float small[2] = {1.0f, -1.0f};
+  gemmStrided(1, 2, 0, nullptr, 0, 1, nullptr, 2, 1, small, 2, epilogue);
+  assert(small[0] == 3.0f && small[1] == -3.0f);
+
+  bool threw = false;
+  try
+  {
+    Tensor wrong({m, n + 1});
+    matMulInto(A, B, wrong);
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  assert(threw);
+
+  Tensor sums({1, k});
+  sums.fill(1.0f);
+  sumRowsInto(A, sums, 2.0f, 1.0f);
+  Tensor plain = A.sumRows();
+  for (int j = 0; j < k; j++)
+    assert(std::fabs(sums(0, j) - (1.0f + 2.0f * plain(0, j))) < 1e-4f);
+
+  // two halves of a batch accumulate to the gradients of the whole batch, in place
+  DenseLayer layer(12, 7);
+  Tensor x({10, 12});
+  Tensor dY({10, 7});
+  for (int i = 0; i < x.size(); i++)
+    x[i] = (float)(i % 9) * 0.1f - 0.4f;
+  for (int i = 0; i < dY.size(); i++)
+    dY[i] = (float)(i % 4) * 0.2f - 0.3f;
+  layer.dW(dY, x);
+  layer.dB(dY);
+  Tensor fullW = layer.getdW_();
+  Tensor fullB = layer.getdB_();
+
+  const float *dWBuffer = layer.getdW_().data();
+  std::size_t requestsBefore = defaultAllocator().stats().requests;
+  Tensor dY0 = Tensor(dY.view().rowSlice(0, 4));
+  Tensor dY1 = Tensor(dY.view().rowSlice(4, 10));
+  std::size_t slices = defaultAllocator().stats().requests;
+  layer.dW(dY0, x.view().rowSlice(0, 4));
+  layer.dB(dY0);
+  layer.dW(dY1, x.view().rowSlice(4, 10), true);
+  layer.dB(dY1, true);
+  assert(defaultAllocator().stats().requests == slices && slices - requestsBefore == 2);
+  assert(layer.getdW_().data() == dWBuffer);
+  for (int i = 0; i < fullW.size(); i++)
+    assert(std::fabs(layer.getdW_()[i] - fullW[i]) < 1e-5f);
+  for (int i = 0; i < fullB.size(); i++)
+    assert(std::fabs(layer.getdB_()[i] - fullB[i]) < 1e-5f);
+
+  // fit with micro-batches takes the same steps as with whole batches
+  int rows = 96;
+  Tensor X({rows, 3});
+  Tensor Y({rows, 2});
+  for (int i = 0; i < rows; i++)
+  {
+    X(i, 0) = (float)(i % 8) / 8.0f;
+    X(i, 1) = (float)(i % 5) / 5.0f;
+    X(i, 2) = (float)(i % 3) / 3.0f;
+    Y(i, 0) = X(i, 0) - 0.5f * X(i, 2);
+    Y(i, 1) = X(i, 1) * 0.3f + 0.1f;
+  }
+  Network whole;
+  whole.addLayer(DenseLayer(3, 16));
+  whole.addLayer(ReLuLayer());
+  whole.addLayer(DenseLayer(16, 2));
+  Network micro = whole;
+
+  FitOptions options;
+  options.epochs = 3;
+  options.batchSize = 32;
+  options.learningRate = 0.05f;
+  options.optimizer.kind = OptimizerKind::Momentum;
+  options.shuffle = false;
+  std::vector<EpochStats> a = whole.fit(X, Y, options);
+  options.microBatchSize = 6; // 32 rows are 5 slices of 6 and one of 2
+  std::vector<EpochStats> b = micro.fit(X, Y, options);
+
+  for (int e = 0; e < options.epochs; e++)
+    assert(std::fabs(a[e].loss - b[e].loss) < 1e-4f);
+  for (int l = 0; l < 2; l++)
+    for (int i = 0; i < whole.getLayers()[l].getWeights().size(); i++)
+      assert(std::fabs(whole.getLayers()[l].getWeights()[i] - micro.getLayers()[l].getWeights()[i]) < 1e-4f);
+}
+
+void test_dataParallel()
+{
+  int rows = 90;
+  Tensor X({rows, 5});
+  Tensor Y({rows, 2});
+  for (int i = 0; i < rows; i++)
+  {
+    for (int j = 0; j < 5; j++)
+      X(i, j) = (float)((i * (j + 3)) % 13) / 13.0f - 0.5f;
+    Y(i, 0) = X(i, 0) * X(i, 1) + 0.2f;
+    Y(i, 1) = X(i, 2) - X(i, 4);
+  }
+
+  Network serial;
+  serial.addLayer(DenseLayer(5, 24));
+  serial.addLayer(ReLuLayer());
+  serial.addLayer(DenseLayer(24, 2));
+  Network parallel = serial;
+
+  ThreadPool &pool = ThreadPool::instance();
+  int oldThreads = pool.numThreads();
+  std::size_t oldThreshold = pool.serialThreshold();
+  pool.setNumThreads(4);
+  pool.setSerialThreshold(64);
+
+  FitOptions options;
+  options.epochs = 4;
+  options.batchSize = 32; // the last batch of 26 rows is uneven across shards
+  options.learningRate = 0.02f;
+  options.optimizer.kind = OptimizerKind::Adam;
+  options.shuffle = false;
+  std::vector<EpochStats> a = serial.fit(X, Y, options);
+
+  DataParallelTrainer trainer(parallel, 3);
+  assert(trainer.numReplicas() == 3);
+  std::vector<EpochStats> b = trainer.fit(X, Y, options);
+
+  // one step per batch on the summed shard gradients is the serial step
+  for (int e = 0; e < options.epochs; e++)
+    assert(std::fabs(a[e].loss - b[e].loss) < 1e-4f);
+  for (int l = 0; l < 2; l++)
+    for (int i = 0; i < serial.getLayers()[l].getWeights().size(); i++)
+      assert(std::fabs(serial.getLayers()[l].getWeights()[i] - parallel.getLayers()[l].getWeights()[i]) < 1e-4f);
+  assert(parallel.getLayers()[0].getWeightState().steps == options.epochs * 3);
+
+  // fewer rows than replicas, and micro-batches inside the shards
+  float loss = trainer.trainBatch(X.view().rowSlice(0, 2), Y.view().rowSlice(0, 2), options);
+  assert(std::isfinite(loss));
+  options.microBatchSize = 4;
+  trainer.trainBatch(X.view().rowSlice(0, 30), Y.view().rowSlice(0, 30), options);
+
+  // from inside a pool job the shards run serially instead of waiting on the pool
+  float nested = 0.0f;
+  pool.run(2, [&](int chunk)
+           {
+             if (chunk == 0)
+               nested = trainer.trainBatch(X.view().rowSlice(0, 30), Y.view().rowSlice(0, 30), options);
+           });
+  assert(std::isfinite(nested) && nested > 0.0f);
+
+  pool.setSerialThreshold(oldThreshold);
+  pool.setNumThreads(oldThreads);
+
+  // replicas only read the shared weights
+  DenseLayer owner(4, 3);
+  DenseLayer replica(4, 3);
+  replica.shareParameters(owner);
+  assert(replica.sharesParameters() && replica.getWeights().size() == 0);
+  Tensor in({2, 4});
+  in.fill(0.5f);
+  Tensor fromOwner = owner.forward(in);
+  Tensor fromReplica = replica.forward(in);
+  for (int i = 0; i < fromOwner.size(); i++)
+    assert(fromOwner[i] == fromReplica[i]);
+  bool threw = false;
+  try
+  {
+    replica.updateParameters(0.1f);
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  assert(threw);
+
+  options.epochs = 1;
+  options.microBatchSize = 0;
+  std::vector<ScalingPoint> report = scalingReport(serial, X, Y, options, 2, &std::cout);
+  assert(report.size() == 2 && report[0].threads == 1 && report[1].threads == 2);
+  assert(report[0].speedup == 1.0 && report[1].samplesPerSec > 0.0);
+  assert(pool.numThreads() == oldThreads);
+}
+
+Network distributedNet()
+{
+  Network net;
+  net.addLayer(DenseLayer(6, 16));
+  net.addLayer(ReLuLayer());
+  net.addLayer(DenseLayer(16, 3));
+  return net;
+}
+
+// rows of the training set of the distributed test; rank r trains on rows
+// [r * rowsPerRank, (r + 1) * rowsPerRank)
+Tensor distributedData(int rows, int cols, int salt)
+{
+  Tensor t({rows, cols});
+  for (int i = 0; i < t.size(); i++)
+    t[i] = (float)((i * (7 + salt)) % 19) / 19.0f - 0.5f;
+  return t;
+}
+
+// one rank of test_distributed, run by the test process as rank 0 and by copies of it
+// started with --distributed-rank for the others
+bool distributedRank(const std::string &kind, int rank, int size, const std::string &name, int port)
+{
+  std::unique_ptr<Transport> link;
+  if (kind == "shm")
+    link = std::make_unique<SharedMemoryTransport>(name, rank, size, 1000, 20.0); // small rings wrap around
+  else
+    link = std::make_unique<TcpTransport>(rank, size, port, "127.0.0.1", 20.0);
+  assert(link->rank() == rank && link->size() == size);
+
+  // uneven chunks
+  std::vector<float> v(1001);
+  for (size_t i = 0; i < v.size(); i++)
+    v[i] = rank + (float)i * 0.5f;
+  std::vector<float> scratch;
+  ringAllReduce(*link, v.data(), v.size(), scratch);
+  for (size_t i = 0; i < v.size(); i++)
+    assert(v[i] == size * (size - 1) / 2.0f + size * (float)i * 0.5f);
+
+  // every rank starts from different weights until rank 0's are broadcast
+  srand(rank == 0 ? 11 : 100 + rank);
+  Network net = distributedNet();
+  DistributedTrainer trainer(net, *link, 256); // several buckets in flight per step
+  trainer.broadcastParameters();
+
+  int rowsPerRank = 24;
+  int batch = 8;
+  Tensor X = distributedData(size * rowsPerRank, 6, 0);
+  Tensor Y = distributedData(size * rowsPerRank, 3, 5);
+  Tensor localX = Tensor(X.view().rowSlice(rank * rowsPerRank, (rank + 1) * rowsPerRank));
+  Tensor localY = Tensor(Y.view().rowSlice(rank * rowsPerRank, (rank + 1) * rowsPerRank));
+
+  FitOptions options;
+  options.epochs = 3;
+  options.batchSize = batch;
+  options.learningRate = 0.05f;
+  options.optimizer.kind = OptimizerKind::Momentum;
+  options.shuffle = false;
+  std::vector<EpochStats> history = trainer.fit(localX, localY, options);
+
+  // serial reference: global batch k is batch k of every rank
+  Tensor globalX({size * rowsPerRank, 6});
+  Tensor globalY({size * rowsPerRank, 3});
+  int row = 0;
+  for (int k = 0; k < rowsPerRank / batch; k++)
+    for (int r = 0; r < size; r++)
+      for (int i = 0; i < batch; i++, row++)
+      {
+        int src = r * rowsPerRank + k * batch + i;
+        for (int j = 0; j < 6; j++)
+          globalX(row, j) = X(src, j);
+        for (int j = 0; j < 3; j++)
+          globalY(row, j) = Y(src, j);
+      }
+  srand(11);
+  Network reference = distributedNet();
+  options.batchSize = batch * size;
+  std::vector<EpochStats> expected = reference.fit(globalX, globalY, options);
+
+  bool ok = true;
+  for (int e = 0; e < options.epochs; e++)
+    ok = ok && std::fabs(history[e].loss - expected[e].loss) < 1e-4f;
+  for (int l = 0; l < 2; l++)
+    for (int i = 0; i < net.getLayers()[l].getWeights().size(); i++)
+      ok = ok && std::fabs(net.getLayers()[l].getWeights()[i] - reference.getLayers()[l].getWeights()[i]) < 1e-4f;
+  return ok;
+}
+
+void test_distributed()
+{
+  int size = 3;
+  for (std::string kind : {"shm", "tcp"})
+  {
+    std::string name = "/myNN_test_" + std::to_string(getpid());
+    std::string port = std::to_string(20000 + getpid() % 20000);
+    std::string sizeArg = std::to_string(size);
+    std::vector<std::string> ranks;
+    for (int r = 0; r < size; r++)
+      ranks.push_back(std::to_string(r));
+
+    // local processes running this binary, everything they need prepared before fork
+    std::vector<pid_t> children;
+    for (int r = 1; r < size; r++)
+    {
+      pid_t pid = fork();
+      if (pid == 0)
+      {
+        execl("/proc/self/exe", "myNN_tests", "--distributed-rank", kind.c_str(), ranks[r].c_str(),
+              sizeArg.c_str(), name.c_str(), port.c_str(), (char *)nullptr);
+        _exit(127);
+      }
+      assert(pid > 0);
+      children.push_back(pid);
+    }
+
+    bool ok = distributedRank(kind, 0, size, name, std::stoi(port));
+    for (pid_t pid : children)
+    {
+      int status = 0;
+      waitpid(pid, &status, 0);
+      assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    assert(ok);
+    std::cout << "ring all-reduce over " << kind << ": " << size << " processes match serial training\n";
+  }
+}
+
+void test_inferenceServer()
+{
+  srand(5);
+  Network net;
+  net.addLayer(DenseLayer(4, 8));
+  net.addLayer(ReLuLayer());
+  net.addLayer(DenseLayer(8, 2));
+
+  Tensor X({32, 4});
+  for (int i = 0; i < X.size(); i++)
+    X[i] = (float)((i * 5) % 11) / 11.0f - 0.5f;
+  Tensor expected = net.predict(X);
+
+  {
+    // the deadline is far off, so batches go out when they are full
+    ServerOptions options;
+    options.maxBatch = 8;
+    options.maxWait = std::chrono::milliseconds(200);
+    InferenceServer server(net, options);
+    assert(server.inputSize() == 4);
+
+    // callers on several threads, each waiting on its own futures
+    std::vector<std::future<Tensor>> results(32);
+    std::vector<std::thread> callers;
+    for (int t = 0; t < 4; t++)
+    {
+      callers.emplace_back([&, t]
+                           {
+                             for (int i = t; i < 32; i += 4)
+                               results[i] = server.submit(X.view().rowSlice(i, i + 1));
+                           });
+    }
+    for (std::thread &caller : callers)
+      caller.join();
+
+    for (int i = 0; i < 32; i++)
+    {
+      Tensor y = results[i].get();
+      assert(y.getShape()[0] == 1 && y.getShape()[1] == 2);
+      for (int j = 0; j < 2; j++)
+        assert(std::fabs(y(0, j) - expected(i, j)) < 1e-5f);
+    }
+
+    ServerStats stats = server.stats();
+    assert(stats.requests == 32);
+    assert(stats.batchSizes.total == stats.batches);
+    assert(stats.latencyUs.total == 32);
+    assert(stats.meanBatchSize() > 1.0);
+    assert(stats.p50Us > 0.0 && stats.p50Us <= stats.p99Us);
+
+    bool threw = false;
+    try
+    {
+      server.submit(X.view().rowSlice(0, 2));
+    }
+    catch (const std::runtime_error &)
+    {
+      threw = true;
+    }
+    assert(threw);
+
+    std::ostringstream report;
+    server.printStats(report);
+    assert(report.str().find("p99") != std::string::npos);
+  }
+
+  {
+    // a lone request goes out on its own once it has waited maxWait
+    ServerOptions options;
+    options.maxBatch = 16;
+    options.maxWait = std::chrono::milliseconds(2);
+    InferenceServer server(net, options);
+    Tensor y = server.submit(X.view().rowSlice(3, 4)).get();
+    assert(std::fabs(y(0, 1) - expected(3, 1)) < 1e-5f);
+    ServerStats stats = server.stats();
+    assert(stats.batches == 1 && stats.batchSizes.counts[0] == 1);
+    assert(stats.maxUs >= 2000.0);
+
+    server.resetStats();
+    assert(server.stats().requests == 0);
+
+    // what is still queued is answered before the server goes away
+    std::future<Tensor> pending = server.submit(X.view().rowSlice(5, 6));
+    options.maxWait = std::chrono::seconds(10);
+    auto slow = std::make_unique<InferenceServer>(net, options);
+    std::future<Tensor> drained = slow->submit(X.view().rowSlice(6, 7));
+    slow.reset();
+    assert(std::fabs(pending.get()(0, 0) - expected(5, 0)) < 1e-5f);
+    assert(std::fabs(drained.get()(0, 0) - expected(6, 0)) < 1e-5f);
+  }
+
+  std::cout << "inference server: dynamic batches match predict\n";
+}
+
+void test_sparse()
+{
+  // CSR round trip, rows with no entries included
+  Tensor M({3, 5});
+  M(0, 1) = 2.0f;
+  M(0, 4) = -1.0f;
+  M(2, 0) = 3.0f;
+  SparseTensor S(M);
+  assert(S.rows() == 3 && S.cols() == 5 && S.nnz() == 3);
+  assert(S.rowStart()[1] == 2 && S.rowStart()[2] == 2 && S.colIndex()[2] == 0);
+  Tensor back = S.toDense();
+  for (int i = 0; i < M.size(); i++)
+    assert(back[i] == M[i]);
+
+  // exactly sparsity * size of the smallest magnitudes go
+  Tensor W({40, 30});
+  for (int i = 0; i < W.size(); i++)
+    W[i] = (float)((i * 37) % 101 - 50) / 50.0f;
+  Tensor original = W;
+  float threshold = pruneByMagnitude(W, 0.9f);
+  int zeros = 0;
+  for (int i = 0; i < W.size(); i++)
+  {
+    if (W[i] == 0.0f)
+      zeros++;
+    else
+      assert(W[i] == original[i] && std::fabs(W[i]) >= threshold);
+  }
+  assert(zeros == 1080);
+
+  // a * S^T with the fused epilogue and a * S agree with the dense products, for a
+  // single row, a batch and a strided view
+  Tensor bias({1, 30});
+  for (int i = 0; i < bias.size(); i++)
+    bias[i] = 0.05f * (i % 7) - 0.1f;
+  SparseTensor wT(W.view().transpose());
+  assert(wT.nnz() == 120 && std::fabs(wT.density() - 0.1) < 1e-9);
+  Tensor A({17, 40});
+  for (int i = 0; i < A.size(); i++)
+    A[i] = (float)((i * 7) % 23) / 23.0f - 0.5f;
+  for (int rows : {1, 17})
+  {
+    TensorView a = A.view().rowSlice(0, rows);
+    Tensor expected = matMulBias(a, W, bias, Activation::ReLU);
+    Tensor got({rows, 30});
+    GemmEpilogue epilogue;
+    epilogue.bias = bias.data();
+    epilogue.activation = Activation::ReLU;
+    sparseMatMulTranspose(a, wT, got.getData().data(), 30, epilogue);
+    for (int i = 0; i < expected.size(); i++)
+      assert(std::fabs(got[i] - expected[i]) < 1e-5f);
+
+    Tensor dY({rows, 30});
+    for (int i = 0; i < dY.size(); i++)
+      dY[i] = (float)((i * 5) % 13) / 13.0f - 0.5f;
+    Tensor dX = matMul(dY, wT);
+    Tensor dXRef = dY.matMulTranspose(W);
+    assert(dX.getShape()[0] == rows && dX.getShape()[1] == 40);
+    for (int i = 0; i < dX.size(); i++)
+      assert(std::fabs(dX[i] - dXRef[i]) < 1e-5f);
+  }
+  // a batch already stored transposed is read in place
+  Tensor At(A.view().transpose());
+  Tensor rowMajor = matMulTranspose(A, wT);
+  Tensor fromTransposed = matMulTranspose(At.view().transpose(), wT);
+  for (int i = 0; i < rowMajor.size(); i++)
+    assert(std::fabs(rowMajor[i] - fromTransposed[i]) < 1e-5f);
+
+  // a pruned network runs sparse in training and inference
+  srand(9);
+  Network net;
+  net.addLayer(DenseLayer(40, 64));
+  net.addLayer(ReLuLayer());
+  net.addLayer(DenseLayer(64, 4));
+  Tensor Y({17, 4});
+  for (int i = 0; i < Y.size(); i++)
+    Y[i] = (float)(i % 5) / 5.0f;
+
+  Network dense = net;
+  net.getLayers()[0].prune(0.8f);
+  dense.getLayers()[0].getWeights() = net.getLayers()[0].getWeights();
+  assert(net.getLayers()[0].isSparse() && !net.getLayers()[1].isSparse());
+  assert(net.getLayers()[0].getSparseWeights().nnz() == 512);
+
+  Tensor predSparse = net.predict(A);
+  Tensor predDense = dense.predict(A);
+  for (int i = 0; i < predDense.size(); i++)
+    assert(std::fabs(predSparse[i] - predDense[i]) < 1e-5f);
+
+  std::size_t sessionBytes[2];
+  PoolAllocator pool;
+  {
+    Workspace workspace(pool);
+    InferenceSession sparseSession(net, 17);
+    InferenceSession denseSession(dense, 17);
+
+    // the pruned layer trades its dense weights for the stored ones and planned scratch
+    const SparseTensor &stored = net.getLayers()[0].getSparseWeights();
+    assert(stored.bytes() < 40 * 64 * sizeof(float));
+    SparseScratch scratch;
+    scratch.reserve(17, 40, 64);
+    assert(sparseSession.memoryBytes() ==
+           denseSession.memoryBytes() - 40 * 64 * sizeof(float) + stored.bytes() + scratch.bytes());
+
+    // and runs without allocating, like a dense session
+    std::size_t requestsBefore = pool.stats().requests;
+    for (int r = 0; r < 3; r++)
+    {
+      TensorView served = sparseSession.run(A);
+      for (int i = 0; i < predDense.size(); i++)
+        assert(std::fabs(served.data()[i] - predDense[i]) < 1e-5f);
+      TensorView one = sparseSession.run(A.view().rowSlice(4, 5));
+      for (int j = 0; j < 4; j++)
+        assert(std::fabs(one(0, j) - predDense(4, j)) < 1e-5f);
+    }
+    assert(pool.stats().requests == requestsBefore);
+    sessionBytes[0] = sparseSession.memoryBytes();
+    sessionBytes[1] = denseSession.memoryBytes();
+  }
+
+  // fine-tuning keeps the pattern, and a dense layer gets the same gradients
+  FitOptions options;
+  options.epochs = 3;
+  options.batchSize = 17;
+  options.learningRate = 0.05f;
+  options.shuffle = false;
+  std::vector<EpochStats> a = net.fit(A, Y, options);
+  const Tensor &tuned = net.getLayers()[0].getWeights();
+  for (int i = 0; i < tuned.size(); i++)
+  {
+    if (dense.getLayers()[0].getWeights()[i] == 0.0f)
+      assert(tuned[i] == 0.0f);
+  }
+  assert(net.getLayers()[0].getSparseWeights().nnz() == 512);
+  std::vector<EpochStats> b = dense.fit(A, Y, options);
+  assert(std::fabs(a[0].loss - b[0].loss) < 1e-5f);
+
+  bool threw = false;
+  try
+  {
+    net.getLayers()[0].setPrecision(DType::BFloat16);
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  assert(threw);
+
+  net.getLayers()[0].setSparse(false);
+  assert(!net.getLayers()[0].isSparse() && net.getLayers()[0].getSparseWeights().nnz() == 0);
+
+  std::cout << "sparse weights: pruned layers match dense (" << sessionBytes[0] << " vs "
+            << sessionBytes[1] << " bytes, " << sparseKernelName() << ")\n";
+}
+
+void test_sparseInput()
+{
+  // a few nonzeros per row out of many columns, rows 3 and 9 empty
+  int rows = 13;
+  int cols = 500;
+  Tensor dense({rows, cols});
+  for (int i = 0; i < rows; i++)
+  {
+    if (i == 3 || i == 9)
+      continue;
+    for (int t = 0; t < 3; t++)
+      dense(i, (i * 37 + t * 101) % 60 + (t == 2 ? 400 : 0)) = 0.5f + 0.25f * t;
+  }
+  SparseTensor X(dense);
+  assert(X.nnz() == 33);
+
+  srand(4);
+  DenseLayer layer(cols, 6);
+  for (int i = 0; i < layer.getBias().size(); i++)
+    layer.getBias()[i] = 0.1f * i - 0.2f;
+  Tensor expected = layer.forward(dense, Activation::ReLU);
+  Tensor got = layer.forward(X, Activation::ReLU);
+  for (int i = 0; i < expected.size(); i++)
+    assert(std::fabs(got[i] - expected[i]) < 1e-5f);
+
+  // only the rows of w for columns that occur get a gradient, accumulation merges rows
+  Tensor dY({rows, 6});
+  for (int i = 0; i < dY.size(); i++)
+    dY[i] = (float)((i * 5) % 13) / 13.0f - 0.5f;
+  SparseTensor firstRows(dense.view().rowSlice(0, 7));
+  SparseTensor lastRows(dense.view().rowSlice(7, rows));
+  layer.dW(Tensor(dY.view().rowSlice(0, 7)), firstRows);
+  assert(layer.hasRowGradient());
+  layer.dW(Tensor(dY.view().rowSlice(7, rows)), lastRows, true);
+  layer.dW(dY, dense); // dense reference in dW_
+  assert(!layer.hasRowGradient());
+
+  DenseLayer sparseLayer = layer;
+  sparseLayer.dW(Tensor(dY.view().rowSlice(0, 7)), firstRows);
+  sparseLayer.dW(Tensor(dY.view().rowSlice(7, rows)), lastRows, true);
+  const SparseRows &grad = sparseLayer.getdWRows();
+  assert(grad.totalRows == cols && grad.values.getShape()[1] == 6);
+  int touched = 0;
+  for (int k = 0; k < cols; k++)
+  {
+    bool stored = std::binary_search(grad.rows.begin(), grad.rows.end(), k);
+    bool used = false;
+    for (int i = 0; i < rows; i++)
+      used = used || dense(i, k) != 0.0f;
+    assert(stored == used);
+    if (!stored)
+      continue;
+    for (int j = 0; j < 6; j++)
+      assert(std::fabs(grad.values(touched, j) - layer.getdW_()(k, j)) < 1e-5f);
+    touched++;
+  }
+  assert(touched == (int)grad.rows.size());
+
+  // accumulating dense and sparse inputs into one gradient, in either order, keeps both
+  DenseLayer mixed = layer;
+  mixed.dW(Tensor(dY.view().rowSlice(0, 7)), dense.view().rowSlice(0, 7));
+  mixed.dW(Tensor(dY.view().rowSlice(7, rows)), lastRows, true);
+  assert(!mixed.hasRowGradient());
+  for (int i = 0; i < layer.getdW_().size(); i++)
+    assert(std::fabs(mixed.getdW_()[i] - layer.getdW_()[i]) < 1e-5f);
+  mixed.dW(Tensor(dY.view().rowSlice(0, 7)), firstRows);
+  mixed.dW(Tensor(dY.view().rowSlice(7, rows)), dense.view().rowSlice(7, rows), true);
+  assert(!mixed.hasRowGradient());
+  for (int i = 0; i < layer.getdW_().size(); i++)
+    assert(std::fabs(mixed.getdW_()[i] - layer.getdW_()[i]) < 1e-5f);
+
+  // a network on sparse input takes the same SGD steps as on the dense one
+  srand(12);
+  Network sparseNet;
+  sparseNet.addLayer(DenseLayer(cols, 8));
+  sparseNet.addLayer(ReLuLayer());
+  sparseNet.addLayer(DenseLayer(8, 2));
+  Network denseNet = sparseNet;
+  Tensor Y({rows, 2});
+  for (int i = 0; i < Y.size(); i++)
+    Y[i] = (float)(i % 3) / 3.0f;
+
+  for (int s = 0; s < 3; s++)
+  {
+    Tensor pred = sparseNet.forwardPass(X);
+    Tensor dL = sparseNet.getLayers().back().dL_dY(pred, Y);
+    assert(sparseNet.backProp(dL, X).size() == 0);
+    sparseNet.updateParameters(0.1f);
+
+    Tensor predDense = denseNet.forwardPass(dense);
+    denseNet.backProp(denseNet.getLayers().back().dL_dY(predDense, Y), dense);
+    denseNet.updateParameters(0.1f);
+    for (int i = 0; i < pred.size(); i++)
+      assert(std::fabs(pred[i] - predDense[i]) < 1e-5f);
+  }
+  for (int l = 0; l < 2; l++)
+  {
+    const Tensor &a = sparseNet.getLayers()[l].getWeights();
+    const Tensor &b = denseNet.getLayers()[l].getWeights();
+    for (int i = 0; i < a.size(); i++)
+      assert(std::fabs(a[i] - b[i]) < 1e-5f);
+  }
+  Tensor served = sparseNet.predict(X);
+  Tensor servedDense = denseNet.predict(dense);
+  for (int i = 0; i < served.size(); i++)
+    assert(std::fabs(served[i] - servedDense[i]) < 1e-5f);
+
+  // Adam on row gradients leaves the weights of unseen features alone
+  Tensor before = sparseNet.getLayers()[0].getWeights();
+  OptimizerConfig adam;
+  adam.kind = OptimizerKind::Adam;
+  for (int s = 0; s < 2; s++)
+  {
+    Tensor pred = sparseNet.forwardPass(X);
+    sparseNet.backProp(sparseNet.getLayers().back().dL_dY(pred, Y), X);
+    sparseNet.step(adam, 0.01f);
+  }
+  const Tensor &after = sparseNet.getLayers()[0].getWeights();
+  const std::vector<int> &seen = sparseNet.getLayers()[0].getdWRows().rows;
+  for (int k = 0; k < cols; k++)
+  {
+    bool moved = false;
+    for (int j = 0; j < 8; j++)
+      moved = moved || after(k, j) != before(k, j);
+    assert(moved == std::binary_search(seen.begin(), seen.end(), k));
+  }
+
+  std::cout << "sparse input: " << seen.size() << " of " << cols << " weight rows updated\n";
+}
+
+void test_simdKernels()
+{
+  // odd sizes, so every kernel runs its vector loop and its tail
+  for (int n : {1, 7, 31, 33, 1000, 4099})
+  {
+    Tensor a({1, n});
+    Tensor b({1, n});
+    for (int i = 0; i < n; i++)
+    {
+      a[i] = static_cast<float>((i * 7) % 23) / 23.0f - 0.5f;
+      b[i] = static_cast<float>((i * 5) % 17) / 17.0f + 0.25f;
+    }
+
+    Tensor added = a;
+    added.add(b);
+    Tensor subtracted = a;
+    subtracted.sub(b);
+    Tensor multiplied = a;
+    multiplied.mul_inplace(b);
+    Tensor difference = a - b;
+    Tensor scaled = a.mul(3.0f);
+    Tensor shifted = a;
+    shifted.add(2.0f);
+    shifted.sub(0.5f);
+    shifted.mul_inplace(-1.5f);
+    Tensor doubled = a;
+    doubled.add(doubled);
+    Tensor squared = a;
+    squared.apply([](float x)
+                  { return x * x; });
+    for (int i = 0; i < n; i++)
+    {
+      assert(added[i] == a[i] + b[i]);
+      assert(subtracted[i] == a[i] - b[i]);
+      assert(multiplied[i] == a[i] * b[i]);
+      assert(difference[i] == a[i] - b[i]);
+      assert(scaled[i] == a[i] * 3.0f);
+      assert(shifted[i] == ((a[i] + 2.0f) - 0.5f) * -1.5f);
+      assert(doubled[i] == a[i] + a[i]);
+      assert(squared[i] == a[i] * a[i]);
+    }
+
+    double exact = 0.0;
+    for (int i = 0; i < n; i++)
+      exact += b[i];
+    assert(std::fabs(b.sum() - exact) < 1e-5 * exact);
+    assert(std::fabs(b.mean() - exact / n) < 1e-5 * exact / n);
+
+    a.fill(0.75f);
+    for (int i = 0; i < n; i++)
+      assert(a[i] == 0.75f);
+    a.zeroGrad();
+    assert(a.sum() == 0.0f);
+  }
+
+  // a long sum of the same value stays exact where a single running sum would not
+  Tensor ones({1, 1 << 20}, 1.0f);
+  ones.add(1.0f / 256.0f);
+  assert(ones.sum() == (1 << 20) + 4096.0f);
+
+  std::cout << "elementwise kernels [" << tensorKernelName() << "]\n";
+}
+
+void test_matMulGflops()
+{
+  int n = 256;
+  Tensor A({n, n}, 0.5f);
+  Tensor B({n, n}, 0.25f);
+
+  int reps = 5;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < reps; r++)
+  {
+    Tensor C = A.matMul(B);
+    assert(std::fabs(C(n - 1, n - 1) - n * 0.125f) < 1e-3f);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  double gflops = 2.0 * n * n * n * reps / seconds * 1e-9;
+  std::cout << "matMul " << n << "x" << n << "x" << n << " [" << gemmKernelName() << "]: "
+            << gflops << " GFLOP/s\n";
+}
+
+int main(int argc, char **argv)
+{
+  // one of the processes started by test_distributed
+  if (argc == 7 && std::string(argv[1]) == "--distributed-rank")
+    return distributedRank(argv[2], std::atoi(argv[3]), std::atoi(argv[4]), argv[5], std::atoi(argv[6])) ? 0 : 1;
+
   std::cout << "Running Tensor tests...\n";
 
   // test_ConstructorAndShape();
@@ -346,6 +2499,33 @@ int main()
 
   test_LinearRegression();
 
+  test_matMulBlocked();
+  test_matMulTransposed();
+  test_matMulSmallRows();
+  test_threadPool();
+  test_denseForwardFused();
+  test_poolAllocator();
+  test_tensorView();
+  test_tensorExpr();
+  test_fit();
+  test_mappedDataset();
+  test_checkpoint();
+  test_inferenceSession();
+  test_quantized();
+  test_halfPrecision();
+  test_staticNetwork();
+  test_profiler();
+  test_layerGraph();
+  test_optimizers();
+  test_gradAccumulation();
+  test_dataParallel();
+  test_distributed();
+  test_inferenceServer();
+  test_sparse();
+  test_sparseInput();
+  test_simdKernels();
+  test_matMulGflops();
+
   // std::cout
   //     << "All tests passed successfully.\n";
 